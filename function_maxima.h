@@ -2,12 +2,29 @@
 #define FUNCTION_MAXIMA_H
 
 #include<map>
-#include<set>
+#include<vector>
 #include<utility>
 #include<memory>
 #include<cassert>
 #include<list>
 #include<typeinfo>
+#include<algorithm>
+#include<iterator>
+#include<cstddef>
+#include<type_traits>
+#include<optional>
+#include<cstdint>
+#include<mutex>
+#include<memory_resource>
+#include<functional>
+#include<chrono>
+#include<istream>
+#include<ostream>
+#include<new>
+#include<cstring>
+#include<thread>
+#include<exception>
+#include<atomic>
 
 class InvalidArg : public std::exception {
 public:
@@ -16,495 +33,7911 @@ public:
     }
 } InvArg;
 
-template<typename A, typename V>
-class FunctionMaxima {
-private:
-    using maxima_set_value_t = std::pair<std::shared_ptr<V>, std::shared_ptr<A>>;
+/**
+ * Storage policies decide how FunctionMaxima lays out the points of the function and its maxima index.
+ * Every policy has a nested storage<A, V, Allocator, Instrumentation> template with the same interface
+ * (its comparators report to the static hooks of Instrumentation, see NoInstrumentation):
+ * - construction from an allocator, copying with the allocator of the copy given (or selected like in
+ *   the standard containers), get_allocator; swapped storages must have equal allocators,
+ * - position / mx_position - bidirectional handles into the function and into the maxima index,
+ * - lookups (find, lower_bound) and static accessors (arg, value, point, mx_point),
+ *   point and mx_point return references to point_type objects kept by the storage,
+ * - insert / erase of points and mx_assign (bulk, replaces the whole index) of maxima,
+ * - the maxima index itself, in one of two shapes chosen by the run_length constant:
+ *   run-length storages keep a run (mx_run) for every plateau of maxima at consecutive points with equal
+ *   values and change it by mx_run_insert / mx_run_resize / mx_run_rekey / mx_run_erase, which are journaled
+ *   until mx_commit or mx_rollback (both noexcept), mx_join merges runs meeting at a splice;
+ *   the others keep an entry for every maximum and change it by mx_find / mx_insert / mx_erase at once,
+ *   with mx_commit and mx_rollback doing nothing,
+ * - erase_prefix of the points before a position and mx_erase_before of the maxima before a position
+ *   in the argument order,
+ * - split_off (the points from a position on with their maxima go to an empty storage) and splice
+ *   (all points of another storage go before a position), which move the points instead of copying them
+ *   and keep maxima positions valid unless the storage is persistent,
+ * - mx_argument_begin / mx_argument_lower_bound / mx_argument_upper_bound over the maxima ordered by argument,
+ * - order statistics: size / mx_size, nth / mx_nth and rank (points with smaller arguments) /
+ *   mx_rank (maxima ordered before a point),
+ * - two-phase value replacement: stage (may throw, modifies nothing) and commit (noexcept),
+ *   staged_point copies a point with a staged value.
+ * FunctionMaxima builds its strong exception safety on top of that split, unless the storage is persistent:
+ * then any modification may throw and FunctionMaxima modifies an O(1) copy that replaces the storage
+ * only when the whole update succeeds.
+ */
 
-    struct argumentComparator {
-        using is_transparent = std::true_type;
+/**
+ * Compact storage: every point is a single OrderStatisticSet node holding the argument and the value inline,
+ * the maxima index refers to those nodes through plain (non-owning) pointers, so updates do not touch
+ * any reference counters. Points handed out by iterators live inside the function; copying
+ * a point_type detaches it (copies the argument and the value), so the copy outlives the function.
+ * Requires V to be nothrow move assignable (new values are staged aside and moved in on commit).
+ */
+struct NodeStorage {
+    template<typename A, typename V, typename Allocator, typename Instrumentation>
+    class storage;
+};
 
-        bool operator()(const std::shared_ptr<A> &lhs, const std::shared_ptr<A> &rhs) const {
-            return *lhs < *rhs;
-        }
+/**
+ * Default storage: OrderStatisticSet of points holding shared pointers to their argument and value,
+ * maxima kept in a MaximaIndex of runs whose first points share the same pointers.
+ * Arithmetic arguments and values are not worth sharing: with both of them arithmetic the points keep them
+ * inline instead (the layout of NodeStorage, with the same stability of positions as the shared one).
+ */
+struct MapStorage {
+    template<typename A, typename V, typename Allocator, typename Instrumentation>
+    class shared_storage;
 
-        bool operator()(const std::shared_ptr<A> &lhs, const A &rhs) const {
-            return *lhs < rhs;
-        }
+    template<typename A, typename V, typename Allocator, typename Instrumentation>
+    using storage = std::conditional_t<std::is_arithmetic<A>::value && std::is_arithmetic<V>::value,
+            NodeStorage::storage<A, V, Allocator, Instrumentation>, shared_storage<A, V, Allocator, Instrumentation>>;
+};
 
-        bool operator()(const A &lhs, const std::shared_ptr<A> &rhs) const {
-            return lhs < *rhs;
-        }
+/* the acknowledgement FlatStorage requires, see there */
+constexpr bool shifting_positions = true;
 
-        bool operator()(const A &lhs, const A &rhs) const {
-            return lhs < rhs;
-        }
+/**
+ * Cache-friendly storage: points are kept inline in a sorted sequence of blocks of at most BlockSize points,
+ * routed by a contiguous array of fences (lower bounds of the keys of each block except the first one).
+ * Lookups do a binary search over the fences and then over a single block, so comparisons never
+ * dereference per-point heap pointers. The maxima index keeps its own copy of the first point of every run
+ * and the argument of its last one.
+ * Unlike the other storages, it does not keep iterators valid until their point is erased: a modification
+ * invalidates the iterators of the points that follow the modified one (like in std::vector), those
+ * of the preceding points stay valid. Points moving within and between contiguous blocks cannot keep
+ * stable handles, so the storage has to be asked for explicitly as FlatStorage<shifting_positions>
+ * (or FlatStorage<shifting_positions, BlockSize>).
+ * Requires A and V to be nothrow move constructible and assignable.
+ */
+template<bool ShiftingPositions, std::size_t BlockSize = 64>
+struct FlatStorage {
+    static_assert(ShiftingPositions, "FlatStorage invalidates the iterators after a modified point, "
+                                     "opt in with FlatStorage<shifting_positions>");
+    static_assert(BlockSize >= 4, "FlatStorage blocks must hold at least 4 points");
 
-    };
+    template<typename A, typename V, typename Allocator, typename Instrumentation>
+    class storage;
+};
 
-    using values_map_t = std::map<std::shared_ptr<A>, std::shared_ptr<V>, argumentComparator>;
+/**
+ * Persistent storage: the points and the maxima are kept in PersistentSets, so copying a function
+ * (see FunctionMaxima::snapshot) is O(1) and the copy shares all nodes with the original.
+ * A modification copies the paths it changes and leaves every other version intact, so versions
+ * may be read by any number of threads while a single thread keeps modifying its own version.
+ * Points are shared between versions through shared pointers to immutable arguments and values.
+ * Positions keep the version they point into alive.
+ * Versions share memory, so an allocator must outlive every version and be safe to use from every thread
+ * that may drop the last reference to a version (e.g. not std::pmr::unsynchronized_pool_resource).
+ */
+struct PersistentStorage {
+    template<typename A, typename V, typename Allocator, typename Instrumentation>
+    class storage;
+};
 
-    struct maximaSetComparator {
-        using is_transparent = std::true_type;
+/**
+ * Instrumentation policies observe what a FunctionMaxima does. Every policy provides:
+ * - static hooks argument_compared and maxima_compared called by the comparators of the storages,
+ *   maxima_changed(inserted, removed) called after a successful modification and rolled_back called
+ *   in the catch paths,
+ * - allocator_t<Allocator>, the allocator the storages are given instead of Allocator,
+ * - scope<Function>, a guard FunctionMaxima keeps for the duration of every public modification and lookup.
+ * The default NoInstrumentation does nothing, so all of it compiles out.
+ */
+struct NoInstrumentation {
+    template<typename Allocator>
+    using allocator_t = Allocator;
 
-        bool operator()(const maxima_set_value_t &lhs, const maxima_set_value_t &rhs) const {
-            if (*(rhs.first) < *(lhs.first))
-                return true;
-            if (*(lhs.first) < *(rhs.first))
-                return false;
-            return *(lhs.second) < *(rhs.second);
-        }
+    static void argument_compared() noexcept {}
 
-        bool operator()(const maxima_set_value_t &lhs, const typename values_map_t::iterator &rhs) const {
-            if (*(rhs->second) < *(lhs.first))
-                return true;
-            if (*(lhs.first) < *(rhs->second))
-                return false;
-            return *(lhs.second) < *(rhs->first);
-        }
+    static void maxima_compared() noexcept {}
 
-        bool operator()(const typename values_map_t::iterator &lhs, const maxima_set_value_t &rhs) const {
-            if (*(rhs.first) < *(lhs->second))
-                return true;
-            if (*(lhs->second) < *(rhs.first))
-                return false;
-            return *(lhs->first) < *(rhs.second);
-        }
+    static void maxima_changed(std::size_t, std::size_t) noexcept {}
 
-        bool operator()(const typename values_map_t::iterator &lhs, const typename values_map_t::iterator &rhs) const {
-            if (*(rhs->second) < *(lhs->second))
-                return true;
-            if (*(lhs->second) < *(rhs->second))
-                return false;
-            return *(lhs->first) < *(rhs->first);
-        }
+    static void rolled_back() noexcept {}
 
+    template<typename Function>
+    struct scope {
+        scope(NoInstrumentation &, const char *, const Function &) noexcept {}
     };
+};
 
-    bool are_pointed_values_equal(std::shared_ptr<V> x, std::shared_ptr<V> y) {
-        return !(*x < *y) && !(*y < *x);
-    }
+/**
+ * Counts the costs of the operations of one FunctionMaxima: comparisons made by the comparators of
+ * its storage, allocations made by its allocator, maxima inserted into and removed from the index
+ * and rollbacks. Hooks are static, they count into the operation running on the current thread,
+ * whose costs are added to the totals of the instance (atomically) when it ends, so const operations
+ * may still run on several threads at once. Allocations made outside of every operation, while a function
+ * is copy constructed, have no instance to count into and go to unscoped_allocations instead.
+ * Every sample_every-th operation is timed and reported to on_sample (if set) with its costs
+ * and the sizes of the function after it; on_sample must not throw, and must be safe to call
+ * from several threads if const operations run on them.
+ * A copy starts with zero counters and the sampling settings of the original.
+ */
+class CountingInstrumentation {
+public:
+    struct counters {
+        std::uint64_t argument_comparisons = 0;
+        std::uint64_t maxima_comparisons = 0;
+        std::uint64_t allocations = 0;
+        std::uint64_t maxima_inserted = 0;
+        std::uint64_t maxima_removed = 0;
+        std::uint64_t rollbacks = 0;
+    };
 
-    using maxima_set_t = std::set<std::pair<std::shared_ptr<V>, std::shared_ptr<A> >, maximaSetComparator>;
-    values_map_t function_map;
-    maxima_set_t maxima_set;
+    struct sample {
+        const char *operation;
+        std::chrono::nanoseconds latency;
+        counters costs;
+        std::size_t points;
+        std::size_t maxima;//in the index, which lags behind the writes to a lazy function
+    };
 
-    typename maxima_set_t::iterator make_maximum_if_is(typename values_map_t::iterator point) {
-        if (point == function_map.end() ||
-            maxima_set.end() != maxima_set.find(point))
-            return maxima_set.end();
-        /* czy point != begin ? */
-        auto prev = point;
-        prev--;
-        auto next = point;
-        next++;
-        bool lhs_maximum = (point == function_map.begin() || !(*(point->second) < *(prev->second)));
-        bool rhs_maximum = (next == function_map.end() || !(*(point->second) < *(next->second)));
-        if (lhs_maximum && rhs_maximum)
-            return maxima_set.insert(maxima_set.begin(), std::make_pair(point->second, point->first));
-        return maxima_set.end();
-    }
+    std::function<void(const sample &)> on_sample;
+    std::uint64_t sample_every = 1;
 
-    typename maxima_set_t::iterator make_previous_maximum_if_is(typename values_map_t::iterator point) {
-        if (point == function_map.begin())
-            return maxima_set.end();
-        point--;
-        return make_maximum_if_is(point);
-    }
+    CountingInstrumentation() = default;
 
-    typename maxima_set_t::iterator make_next_maximum_if_is(typename values_map_t::iterator point) {
-        if (point == function_map.end() || (point++) == function_map.end())
-            return maxima_set.end();
-        return make_maximum_if_is(point);
+    CountingInstrumentation(const CountingInstrumentation &other)
+            : on_sample(other.on_sample), sample_every(other.sample_every) {}
+
+    CountingInstrumentation &operator=(const CountingInstrumentation &other) = delete;
+
+    /* sums of the costs of the finished operations */
+    counters totals() const noexcept {
+        counters result;
+        result.argument_comparisons = total.argument_comparisons.load(std::memory_order_relaxed);
+        result.maxima_comparisons = total.maxima_comparisons.load(std::memory_order_relaxed);
+        result.allocations = total.allocations.load(std::memory_order_relaxed);
+        result.maxima_inserted = total.maxima_inserted.load(std::memory_order_relaxed);
+        result.maxima_removed = total.maxima_removed.load(std::memory_order_relaxed);
+        result.rollbacks = total.rollbacks.load(std::memory_order_relaxed);
+        return result;
     }
 
-    void rollback(typename values_map_t::iterator p1, typename maxima_set_t::iterator m1,
-                  typename maxima_set_t::iterator m2, typename maxima_set_t::iterator m3) noexcept {
-        auto f_end = function_map.end();
-        auto m_end = maxima_set.end();
-        if (p1 != f_end)
-            function_map.erase(p1);
-        if (m1 != m_end)
-            maxima_set.erase(m1);
-        if (m3 != m_end)
-            maxima_set.erase(m3);
-        if (m2 != m_end)
-            maxima_set.erase(m2);
+    /* allocations of all instances made outside of their operations, see counting_allocator */
+    static std::uint64_t unscoped_allocations() noexcept {
+        return unscoped.load(std::memory_order_relaxed);
     }
 
-public:
-    FunctionMaxima() = default;
+    /* Allocator counting every allocation, into unscoped_allocations when no operation runs on this thread */
+    template<typename Allocator>
+    class counting_allocator : public Allocator {
+    private:
+        using traits = std::allocator_traits<Allocator>;
 
-    FunctionMaxima(const FunctionMaxima &other) = default;
+    public:
+        using value_type = typename traits::value_type;
+        using propagate_on_container_copy_assignment = typename traits::propagate_on_container_copy_assignment;
+        using propagate_on_container_move_assignment = typename traits::propagate_on_container_move_assignment;
+        using propagate_on_container_swap = typename traits::propagate_on_container_swap;
+        using is_always_equal = typename traits::is_always_equal;
 
-    FunctionMaxima &operator=(FunctionMaxima other) noexcept {
-        function_map.swap(other.function_map);
-        maxima_set.swap(other.maxima_set);
-        return *this;
-    }
+        template<typename U>
+        struct rebind {
+            using other = counting_allocator<typename traits::template rebind_alloc<U>>;
+        };
 
-    /**
-     * @brief Checks value at point a
-     * Guarantees strong exception safety by not performing any modifications to the structure
-     * and letting through any exceptions
-     *
-     * @param a
-     * @return V const&
-     */
-    V const &value_at(A const &a) const {
-        auto point = function_map.find(a);
-        if (point == function_map.end()) {
-            throw InvArg;
-        } else {
-            return *(point->second);
+        counting_allocator() = default;
+
+        counting_allocator(const Allocator &base) noexcept : Allocator(base) {}
+
+        template<typename Other>
+        counting_allocator(const counting_allocator<Other> &other) noexcept
+                : Allocator(static_cast<const Other &>(other)) {}
+
+        value_type *allocate(std::size_t n) {
+            if (current != nullptr)
+                ++current->costs.allocations;
+            else
+                unscoped.fetch_add(1, std::memory_order_relaxed);
+            return traits::allocate(*this, n);
         }
-    }
 
-    /**
-     * @brief Set value to the argument in function
-     * Guarantees strong exception safety using the rollback method.
-     * Firstly it prepares itself to make changes using operations that may throw exceptions
-     * Then it performs modifications to the structure that may throw exceptions and in case of one performs a rollback
-     * Then it performs noexcept modifications
-     *
-     * @param a
-     * @param v
-     */
-    void set_value(A const &a, V const &v) {
-        auto a_ptr = std::make_shared<A>(a);
-        auto v_ptr = std::make_shared<V>(v);
-        auto point = make_pair(a_ptr, v_ptr);
-        auto max = make_pair(v_ptr, a_ptr);
-        auto f_end = function_map.end();
-        auto f_begin = function_map.begin();
-        auto m_end = maxima_set.end();
-        auto lower = function_map.lower_bound(a_ptr);
-        auto upper = function_map.upper_bound(a_ptr);
-        auto next_max = m_end;
-        auto prev_max = m_end;
-        auto insert_max = m_end;
-        auto inserted_prev_max = m_end;
-        auto inserted_next_max = m_end;
-        auto prev = lower;
-        if (upper != f_end)
-            next_max = maxima_set.find(upper);
-        if (lower != f_begin) {
-            prev--;
-            prev_max = maxima_set.find(prev);
+        counting_allocator select_on_container_copy_construction() const {
+            return counting_allocator(traits::select_on_container_copy_construction(*this));
         }
-        bool erase_prev = lower == f_begin || *(prev->second) < *v_ptr;
-        bool erase_next = upper == f_end || *(upper->second) < *v_ptr;
-        //point is already in the domain
-        if (lower != f_end && !(*a_ptr < *(lower->first))) {
-            if (are_pointed_values_equal(lower->second, v_ptr))
-                return;
-            auto already_max = maxima_set.find(lower);
-            auto dummy = lower->second;
-            try {
-                lower->second = v_ptr;
-                insert_max = make_maximum_if_is(lower);                //Theselines may throw an exception
-                inserted_prev_max = make_previous_maximum_if_is(lower);//
-                inserted_next_max = make_next_maximum_if_is(lower);    //
-                if (m_end != prev_max && erase_prev)//These lines are noexcept
-                    maxima_set.erase(prev_max);     //
-                if (m_end != next_max && erase_next)//
-                    maxima_set.erase(next_max);     //
-                if (m_end != already_max)           //
-                    maxima_set.erase(already_max);  //
-            } catch (...) {
-                lower->second = dummy;
-                rollback(f_end, insert_max, inserted_next_max, inserted_prev_max);
-                throw;
-            }
+
+        friend bool operator==(const counting_allocator &lhs, const counting_allocator &rhs) noexcept {
+            return static_cast<const Allocator &>(lhs) == static_cast<const Allocator &>(rhs);
         }
-            //point is not in the domain
-        else {
-            auto inserted_point = function_map.insert(f_end, point);//First modification that may throw an exception
-            try {
-                insert_max = make_maximum_if_is(inserted_point);                //Theselines may throw an exception
-                inserted_prev_max = make_previous_maximum_if_is(inserted_point);//
-                inserted_next_max = make_next_maximum_if_is(inserted_point);    //
-                if (m_end != prev_max && erase_prev)//These lines are noexcept
-                    maxima_set.erase(prev_max);     //
-                if (m_end != next_max && erase_next)//
-                    maxima_set.erase(next_max);     //
-            } catch (...) {
-                rollback(inserted_point, insert_max, inserted_next_max, inserted_prev_max);
-                throw;
-            }
+
+        friend bool operator!=(const counting_allocator &lhs, const counting_allocator &rhs) noexcept {
+            return !(lhs == rhs);
         }
+    };
+
+    template<typename Allocator>
+    using allocator_t = counting_allocator<Allocator>;
+
+    static void argument_compared() noexcept {
+        if (current != nullptr)
+            ++current->costs.argument_comparisons;
     }
 
-    /**
-     * @brief Erase a point from the function
-     * Guarantees strong exception safety using the rollback method.
-     * Firstly it prepares itself to make changes using operations that may throw exceptions
-     * Then it performs modifications to the structure that may throw exceptions and in case of one performs a rollback
-     * Then it performs noexcept modifications
-     *
-     * @param a
-     */
-    void erase(A const &a) {
-        auto a_ptr = std::make_shared<A>(a);
-        auto point = function_map.find(a);
-        if (point == function_map.end())
-            return;
-        auto prev = point;
-        prev--;
-        auto next = point;
-        next++;
-        auto f_end = function_map.end();
-        auto m_end = maxima_set.end();
-        auto prev_max = maxima_set.end();
-        auto next_max = maxima_set.end();
-        auto inserted_prev_max = maxima_set.end();
-        auto inserted_next_max = maxima_set.end();
-        bool erase_prev_max = false;
-        bool erase_next_max = false;
-        auto dummy = point->second;
-        if (point != function_map.begin() && next != f_end) {
-            prev_max = maxima_set.find(prev);
-            next_max = maxima_set.find(next);
-            erase_next_max = *(next->second) < *(prev->second);
-            erase_prev_max = *(prev->second) < *(next->second);
-        }
-        auto max = maxima_set.find(make_pair(point->second, a_ptr));
-        try {
-            if (next != function_map.end())//noexcept
-                point->second = next->second;//noexcept modification
-            if (point != function_map.begin())//noexcept
-                point->second = prev->second;//noexcept modification
-            if (point != function_map.begin() && next != function_map.end() &&
-                *(prev->second) < *(next->second))//may throw comparator exception
-                point->second = next->second;//noexcept modification
-            inserted_prev_max = make_previous_maximum_if_is(point);//first modification that can throw an exception
-            inserted_next_max = make_next_maximum_if_is(point);//last modification that can throw an exception
-            function_map.erase(point);  //noexcept modification
-            if (max != maxima_set.end())//noexcept
-                maxima_set.erase(max);  //noexcept modification
-            if (erase_next_max && next_max != maxima_set.end())//noexcept
-                maxima_set.erase(next_max);//noexcept modification
-            if (erase_prev_max && prev_max != maxima_set.end())//noexcept
-                maxima_set.erase(prev_max);//noexcept modification
-        } catch (...) {
-            point->second = dummy;
-            rollback(f_end, m_end, inserted_next_max, inserted_prev_max);
-            throw;
-        }
+    static void maxima_compared() noexcept {
+        if (current != nullptr)
+            ++current->costs.maxima_comparisons;
     }
 
-    using size_type = size_t;
+    static void maxima_changed(std::size_t inserted, std::size_t removed) noexcept {
+        if (current != nullptr) {
+            current->costs.maxima_inserted += inserted;
+            current->costs.maxima_removed += removed;
+        }
+    }
 
-    size_type size() const noexcept {
-        return function_map.size();
+    static void rolled_back() noexcept {
+        if (current != nullptr)
+            ++current->costs.rollbacks;
     }
 
-    class point_type {
-    private:
-        friend class FunctionMaxima;
+private:
+    /* the costs of an operation running on this thread */
+    struct frame {
+        CountingInstrumentation *owner;
+        counters costs;
+    };
 
-        std::shared_ptr<A> argument_pointer;
-        std::shared_ptr<V> value_pointer;
+public:
 
-        point_type(const std::shared_ptr<A> argument_ptr, const std::shared_ptr<V> value_ptr) {
-            argument_pointer = argument_ptr;
-            value_pointer = value_ptr;
-        }
+    /**
+     * Counts into a frame of its own. The costs of an operation nested in another operation
+     * of the same instance are added to the outer one, which adds them to the totals when it ends.
+     */
+    template<typename Function>
+    class scope {
+    private:
+        CountingInstrumentation &instruments;
+        const char *operation;
+        const Function &function;
+        frame *previous;
+        frame counted;
+        bool sampled;
+        std::chrono::steady_clock::time_point start;
 
     public:
-        point_type() = delete;
+        scope(CountingInstrumentation &instruments, const char *operation, const Function &function) noexcept
+                : instruments(instruments), operation(operation), function(function), previous(current),
+                  counted{&instruments, counters()},
+                  sampled(instruments.on_sample &&
+                          (instruments.operations.fetch_add(1, std::memory_order_relaxed) + 1) %
+                          std::max<std::uint64_t>(instruments.sample_every, 1) == 0) {
+            current = &counted;
+            if (sampled)
+                start = std::chrono::steady_clock::now();
+        }
 
-        A const &arg() const noexcept {
-            return *argument_pointer;
+        scope(const scope &other) = delete;
+
+        scope &operator=(const scope &other) = delete;
+
+        ~scope() {
+            current = previous;
+            const counters &costs = counted.costs;
+            if (previous != nullptr && previous->owner == &instruments)
+                add(previous->costs, costs);
+            else
+                instruments.total.add(costs);
+            if (!sampled)
+                return;
+            auto latency = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                    std::chrono::steady_clock::now() - start);
+            instruments.on_sample(sample{operation, latency, costs, function.size(), function.indexed_maxima()});
         }
+    };
 
-        V const &value() const noexcept {
-            return *value_pointer;
+private:
+    struct atomic_counters {
+        std::atomic<std::uint64_t> argument_comparisons{0};
+        std::atomic<std::uint64_t> maxima_comparisons{0};
+        std::atomic<std::uint64_t> allocations{0};
+        std::atomic<std::uint64_t> maxima_inserted{0};
+        std::atomic<std::uint64_t> maxima_removed{0};
+        std::atomic<std::uint64_t> rollbacks{0};
+
+        void add(const counters &costs) noexcept {
+            argument_comparisons.fetch_add(costs.argument_comparisons, std::memory_order_relaxed);
+            maxima_comparisons.fetch_add(costs.maxima_comparisons, std::memory_order_relaxed);
+            allocations.fetch_add(costs.allocations, std::memory_order_relaxed);
+            maxima_inserted.fetch_add(costs.maxima_inserted, std::memory_order_relaxed);
+            maxima_removed.fetch_add(costs.maxima_removed, std::memory_order_relaxed);
+            rollbacks.fetch_add(costs.rollbacks, std::memory_order_relaxed);
         }
     };
 
+    static void add(counters &to, const counters &costs) noexcept {
+        to.argument_comparisons += costs.argument_comparisons;
+        to.maxima_comparisons += costs.maxima_comparisons;
+        to.allocations += costs.allocations;
+        to.maxima_inserted += costs.maxima_inserted;
+        to.maxima_removed += costs.maxima_removed;
+        to.rollbacks += costs.rollbacks;
+    }
+
+    atomic_counters total;
+    std::atomic<std::uint64_t> operations{0};
+
+    inline static std::atomic<std::uint64_t> unscoped{0};
+    inline static thread_local frame *current = nullptr;
+};
+
+/**
+ * Ordered set of unique elements with the std::set interface used by the storages, kept as a treap
+ * whose nodes also count the elements of their subtrees, so nth and rank take O(log n).
+ * Priorities come from a per-set generator and do not depend on the elements.
+ * Lookups accept any key Compare can compare with T. Insertions compare before they change anything
+ * (strong exception safety), erasing and the rebalancing rotations compare nothing and are noexcept.
+ * Nodes never move, iterators stay valid until their element is erased.
+ * Nodes come from Allocator rebound to the node type, which follows the rules of the standard containers.
+ * A Weighted set also gives every element a weight (0 when inserted, see reweigh) and sums the weights
+ * of the subtrees, so it finds the element covering a given unit of the total weight in O(log n).
+ */
+template<typename T, typename Compare, typename Allocator = std::allocator<T>, bool Weighted = false>
+class OrderStatisticSet {
 private:
+    struct weights {
+        std::size_t weight;
+        std::size_t total;//of the subtree
+    };
 
-    class shared_ptr_wrapper {
-    private:
-        std::shared_ptr<point_type> stored_pointer;
-    public:
-        shared_ptr_wrapper(std::shared_ptr<point_type> pointer) : stored_pointer(pointer) {}
+    struct no_weights {
+    };
+
+    struct node_base : std::conditional_t<Weighted, weights, no_weights> {
+        node_base *parent;
+        node_base *left;
+        node_base *right;
+        std::size_t size;//0 only for the header
+        std::uint32_t priority;
+    };
 
-        shared_ptr_wrapper() : stored_pointer(nullptr) {}
+    struct node : node_base {
+        T value;
 
-        const std::shared_ptr<point_type> get_pointed_value() {
-            return stored_pointer;
-        }
+        node(T &&v, std::uint32_t priority) : node_base{{}, nullptr, nullptr, nullptr, 1, priority}, value(std::move(v)) {}
+
+        node(const T &v, std::uint32_t priority) : node_base{{}, nullptr, nullptr, nullptr, 1, priority}, value(v) {}
     };
 
-public:
-    /**
-     * Guarantees strong exception safety, because const_iterator that
-     * is wrapped by this class is also guarantees strong exception safety
-     */
-    class iterator {
-    private:
-        using self_type = iterator;
-        using wrapped_iterator_t = typename values_map_t::const_iterator;
-        using wrapped_value_t = point_type;
-    public:
-        using iterator_category = std::bidirectional_iterator_tag;
-        using value_type = point_type;
-        using pointer = value_type *;
-        using reference = value_type &;
-        using difference_type = std::ptrdiff_t;
+    using node_allocator_t = typename std::allocator_traits<Allocator>::template rebind_alloc<node>;
+    using node_traits = std::allocator_traits<node_allocator_t>;
 
-        iterator() = delete;
+    /* header.parent is the root, header.left and header.right the leftmost and the rightmost node */
+    node_base header;
+    std::uint32_t seed = 0x9e3779b9u;
+    node_allocator_t allocator;
 
-        const point_type *operator->() {
-            point_type_to_return = shared_ptr_wrapper(
-                    std::make_shared<point_type>(point_type(wrapped_iterator->first, wrapped_iterator->second)));
-            return point_type_to_return.get_pointed_value().get();
-        }
+    static std::size_t size_of(const node_base *n) noexcept {
+        return n == nullptr ? 0 : n->size;
+    }
+
+    static std::size_t total_of(const node_base *n) noexcept {
+        return n == nullptr ? 0 : n->total;
+    }
+
+    /* recounts the size (and the total weight) of the subtree of n from its children */
+    static void update(node_base *n) noexcept {
+        n->size = 1 + size_of(n->left) + size_of(n->right);
+        if constexpr (Weighted)
+            n->total = n->weight + total_of(n->left) + total_of(n->right);
+    }
+
+    static T const &value_of(const node_base *n) noexcept {
+        return static_cast<const node *>(n)->value;
+    }
+
+    static node_base *leftmost(node_base *n) noexcept {
+        while (n->left != nullptr)
+            n = n->left;
+        return n;
+    }
+
+    static node_base *rightmost(node_base *n) noexcept {
+        while (n->right != nullptr)
+            n = n->right;
+        return n;
+    }
 
-        point_type const &operator*() {
-            point_type_to_return = shared_ptr_wrapper(
-                    std::make_shared<point_type>(point_type(wrapped_iterator->first, wrapped_iterator->second)));
-            return *(point_type_to_return.get_pointed_value());
+    static node_base *next(node_base *n) noexcept {
+        if (n->right != nullptr)
+            return leftmost(n->right);
+        node_base *p = n->parent;
+        while (p->size != 0 && n == p->right) {
+            n = p;
+            p = p->parent;
         }
+        return p;
+    }
 
-        self_type operator++() {
-            self_type i = *this;
-            wrapped_iterator++;
-            return i;
+    static node_base *prev(node_base *n) noexcept {
+        if (n->size == 0)
+            return n->right;
+        if (n->left != nullptr)
+            return rightmost(n->left);
+        node_base *p = n->parent;
+        while (n == p->left) {
+            n = p;
+            p = p->parent;
         }
+        return p;
+    }
 
-        self_type operator++(int) {
-            wrapped_iterator++;
-            return *this;
+    std::uint32_t next_priority() noexcept {
+        seed ^= seed << 13;
+        seed ^= seed >> 17;
+        seed ^= seed << 5;
+        return seed;
+    }
+
+    node_base *&link_to(node_base *n) noexcept {
+        node_base *p = n->parent;
+        if (p == &header)
+            return header.parent;
+        return p->left == n ? p->left : p->right;
+    }
+
+    /* lifts n above its parent, keeping the order and the subtree sizes */
+    void rotate_up(node_base *n) noexcept {
+        node_base *p = n->parent;
+        link_to(p) = n;
+        n->parent = p->parent;
+        if (p->left == n) {
+            p->left = n->right;
+            if (n->right != nullptr)
+                n->right->parent = p;
+            n->right = p;
+        } else {
+            p->right = n->left;
+            if (n->left != nullptr)
+                n->left->parent = p;
+            n->left = p;
         }
+        p->parent = n;
+        n->size = p->size;
+        if constexpr (Weighted)
+            n->total = p->total;
+        update(p);
+    }
 
-        self_type operator--() {
-            self_type i = *this;
-            wrapped_iterator--;
-            return i;
+    /* attaches a new leaf n as the left or the right child of parent (the header for an empty set) */
+    void link(node_base *parent, bool as_left, node_base *n) noexcept {
+        n->parent = parent;
+        if (parent == &header) {
+            header.parent = header.left = header.right = n;
+            return;
+        }
+        if (as_left) {
+            parent->left = n;
+            if (header.left == parent)
+                header.left = n;
+        } else {
+            parent->right = n;
+            if (header.right == parent)
+                header.right = n;
         }
+        for (node_base *p = parent; p != &header; p = p->parent) {
+            ++p->size;
+            if constexpr (Weighted)
+                p->total += n->weight;
+        }
+        while (n->parent != &header && n->parent->priority < n->priority)
+            rotate_up(n);
+    }
 
-        self_type operator--(int) {
-            wrapped_iterator--;
-            return *this;
+    /* detaches n without freeing it, returns the node following it; the set must be reset if it becomes empty */
+    node_base *unlink(node_base *n) noexcept {
+        node_base *following = next(n);
+        if (header.left == n)
+            header.left = following;
+        if (header.right == n)
+            header.right = prev(n);
+        while (n->left != nullptr && n->right != nullptr)
+            rotate_up(n->left->priority < n->right->priority ? n->right : n->left);
+        node_base *child = n->left != nullptr ? n->left : n->right;
+        if (child != nullptr)
+            child->parent = n->parent;
+        link_to(n) = child;
+        for (node_base *p = n->parent; p != &header; p = p->parent) {
+            --p->size;
+            if constexpr (Weighted)
+                p->total -= n->weight;
         }
+        return following;
+    }
 
-        self_type &operator=(const self_type &other) = default;
+    /* links the unlinked n right before b, where it must belong */
+    void link_before(node_base *n, node_base *b) noexcept {
+        n->left = nullptr;
+        n->right = nullptr;
+        n->size = 1;
+        if constexpr (Weighted)
+            n->total = n->weight;
+        if (b == &header)
+            link(empty() ? &header : header.right, false, n);
+        else if (b->left == nullptr)
+            link(b, true, n);
+        else
+            link(rightmost(b->left), false, n);
+    }
 
-        bool operator==(const self_type &rhs) const noexcept {
-            return wrapped_iterator == rhs.wrapped_iterator;
+    /* cuts the subtree of n into its first k nodes (left) and the rest (right), keeping the priorities in order */
+    static void split(node_base *n, std::size_t k, node_base *&left, node_base *&right) noexcept {
+        if (n == nullptr) {
+            left = right = nullptr;
+            return;
+        }
+        if (size_of(n->left) < k) {
+            split(n->right, k - size_of(n->left) - 1, n->right, right);
+            if (n->right != nullptr)
+                n->right->parent = n;
+            left = n;
+        } else {
+            split(n->left, k, left, n->left);
+            if (n->left != nullptr)
+                n->left->parent = n;
+            right = n;
+        }
+        update(n);
+    }
+
+    /* joins the subtrees l and r (every node of l before every node of r) by their priorities */
+    static node_base *join(node_base *l, node_base *r) noexcept {
+        if (l == nullptr)
+            return r;
+        if (r == nullptr)
+            return l;
+        if (r->priority < l->priority) {
+            l->right = join(l->right, r);
+            l->right->parent = l;
+            update(l);
+            return l;
         }
+        r->left = join(l, r->left);
+        r->left->parent = r;
+        update(r);
+        return r;
+    }
 
-        bool operator!=(const self_type &rhs) const noexcept {
-            return wrapped_iterator != rhs.wrapped_iterator;
+    /* makes root the root of the set */
+    void set_root(node_base *root) noexcept {
+        if (root == nullptr) {
+            reset();
+            return;
         }
+        header.parent = root;
+        root->parent = &header;
+        header.left = leftmost(root);
+        header.right = rightmost(root);
+    }
 
-    private:
-        friend class FunctionMaxima;
+    template<typename V>
+    node_base *make_node(V &&v, std::uint32_t priority) {
+        node *n = node_traits::allocate(allocator, 1);
+        try {
+            node_traits::construct(allocator, n, std::forward<V>(v), priority);
+        } catch (...) {
+            node_traits::deallocate(allocator, n, 1);
+            throw;
+        }
+        return n;
+    }
 
-        wrapped_iterator_t wrapped_iterator;
-        shared_ptr_wrapper point_type_to_return;
+    void drop_node(node_base *n) noexcept {
+        node *dropped = static_cast<node *>(n);
+        node_traits::destroy(allocator, dropped);
+        node_traits::deallocate(allocator, dropped, 1);
+    }
 
-        iterator(wrapped_iterator_t iterator_to_wrap) : wrapped_iterator(iterator_to_wrap) {
-            point_type_to_return = shared_ptr_wrapper();
+    void destroy(node_base *n) noexcept {
+        while (n != nullptr) {
+            destroy(n->right);
+            node_base *left = n->left;
+            drop_node(n);
+            n = left;
         }
-    };
+    }
 
-    iterator begin() const {
-        return iterator(function_map.begin());
+    node_base *clone(const node_base *n, node_base *parent) {
+        if (n == nullptr)
+            return nullptr;
+        node_base *copy = make_node(value_of(n), n->priority);
+        copy->parent = parent;
+        copy->size = n->size;
+        if constexpr (Weighted) {
+            copy->weight = n->weight;
+            copy->total = n->total;
+        }
+        try {
+            copy->left = clone(n->left, copy);
+            copy->right = clone(n->right, copy);
+        } catch (...) {
+            destroy(copy);
+            throw;
+        }
+        return copy;
     }
 
-    iterator end() const {
-        return iterator(function_map.end());
+    void reset() noexcept {
+        header.parent = nullptr;
+        header.left = header.right = &header;
     }
 
-    iterator find(A const &a) const {
-        return iterator(function_map.find(a));
+    template<typename V>
+    std::pair<node_base *, bool> insert_unique(V &&v) {
+        node_base *parent = &header;
+        node_base *not_greater = nullptr;//the last node on the path that is not greater than v
+        bool as_left = true;
+        for (node_base *n = header.parent; n != nullptr;) {
+            parent = n;
+            as_left = Compare()(v, value_of(n));
+            if (as_left) {
+                n = n->left;
+            } else {
+                not_greater = n;
+                n = n->right;
+            }
+        }
+        if (not_greater != nullptr && !Compare()(value_of(not_greater), v))
+            return std::make_pair(not_greater, false);
+        node_base *n = make_node(std::forward<V>(v), next_priority());
+        link(parent, as_left, n);
+        return std::make_pair(n, true);
     }
 
-    /**
-     * Guarantees strong exception safety, because const_iterator that
-     * is wrapped by this class is also guarantees strong exception safety
-     */
-    class mx_iterator {
+public:
+    class const_iterator {
     private:
-        using self_type = mx_iterator;
-        using wrapped_iterator_t = typename maxima_set_t::const_iterator;
-        using wrapped_value_t = point_type;
+        using self_type = const_iterator;
     public:
         using iterator_category = std::bidirectional_iterator_tag;
+        using value_type = T;
+        using pointer = const T *;
+        using reference = const T &;
         using difference_type = std::ptrdiff_t;
-        using pointer = self_type *;
-        using reference = self_type &;
-        using value_type = typename maxima_set_t::const_iterator;
-
-        mx_iterator() = delete;
 
-        const point_type *operator->() {
-            point_type_to_return = shared_ptr_wrapper(
-                    std::make_shared<point_type>(point_type(wrapped_iterator->second, wrapped_iterator->first)));
-            return point_type_to_return.get_pointed_value().get();
-        }
+        const_iterator() = default;
 
-        const point_type &operator*() {
-            point_type_to_return = shared_ptr_wrapper(
-                    std::make_shared<point_type>(point_type(wrapped_iterator->second, wrapped_iterator->first)));
-            return *(point_type_to_return.get_pointed_value());
+        reference operator*() const noexcept {
+            return value_of(n);
         }
 
-        self_type operator++() {
-            self_type i = *this;
-            wrapped_iterator++;
-            return i;
+        pointer operator->() const noexcept {
+            return &value_of(n);
         }
 
-        self_type operator++(int) {
-            wrapped_iterator++;
+        self_type &operator++() noexcept {
+            n = next(n);
             return *this;
         }
 
-        self_type operator--() {
+        self_type operator++(int) noexcept {
             self_type i = *this;
-            wrapped_iterator--;
+            n = next(n);
             return i;
         }
 
-        self_type operator--(int) {
-            wrapped_iterator--;
+        self_type &operator--() noexcept {
+            n = prev(n);
             return *this;
         }
 
-        self_type &operator=(const self_type &other) = default;
+        self_type operator--(int) noexcept {
+            self_type i = *this;
+            n = prev(n);
+            return i;
+        }
 
         bool operator==(const self_type &rhs) const noexcept {
-            return wrapped_iterator == rhs.wrapped_iterator;
+            return n == rhs.n;
         }
 
         bool operator!=(const self_type &rhs) const noexcept {
-            return wrapped_iterator != rhs.wrapped_iterator;
+            return n != rhs.n;
         }
 
     private:
-        friend class FunctionMaxima;
+        friend class OrderStatisticSet;
 
-        wrapped_iterator_t wrapped_iterator;
-        shared_ptr_wrapper point_type_to_return;
+        node_base *n = nullptr;
 
-        mx_iterator(wrapped_iterator_t iterator_to_wrap) : wrapped_iterator(iterator_to_wrap) {
-            point_type_to_return = shared_ptr_wrapper();
-        }
+        explicit const_iterator(const node_base *n) : n(const_cast<node_base *>(n)) {}
     };
 
-    mx_iterator mx_begin() const {
-        return mx_iterator(maxima_set.begin());
+    using iterator = const_iterator;
+    using size_type = std::size_t;
+    using allocator_type = Allocator;
+
+    OrderStatisticSet() : OrderStatisticSet(Allocator()) {}
+
+    explicit OrderStatisticSet(const Allocator &alloc) noexcept
+            : header{{}, nullptr, &header, &header, 0, 0}, allocator(alloc) {}
+
+    OrderStatisticSet(const OrderStatisticSet &other)
+            : OrderStatisticSet(other, std::allocator_traits<Allocator>::select_on_container_copy_construction(
+            other.get_allocator())) {}
+
+    OrderStatisticSet(const OrderStatisticSet &other, const Allocator &alloc) : OrderStatisticSet(alloc) {
+        header.parent = clone(other.header.parent, &header);
+        if (header.parent != nullptr) {
+            header.left = leftmost(header.parent);
+            header.right = rightmost(header.parent);
+        }
+    }
+
+    OrderStatisticSet &operator=(const OrderStatisticSet &other) = delete;
+
+    ~OrderStatisticSet() {
+        destroy(header.parent);
+    }
+
+    allocator_type get_allocator() const noexcept {
+        return allocator_type(allocator);
+    }
+
+    const_iterator begin() const noexcept {
+        return const_iterator(header.left);
+    }
+
+    const_iterator end() const noexcept {
+        return const_iterator(&header);
+    }
+
+    size_type size() const noexcept {
+        return size_of(header.parent);
+    }
+
+    bool empty() const noexcept {
+        return header.parent == nullptr;
+    }
+
+    template<typename Key>
+    const_iterator lower_bound(const Key &key) const {
+        const node_base *result = &header;
+        for (const node_base *n = header.parent; n != nullptr;) {
+            if (Compare()(value_of(n), key)) {
+                n = n->right;
+            } else {
+                result = n;
+                n = n->left;
+            }
+        }
+        return const_iterator(result);
+    }
+
+    template<typename Key>
+    const_iterator upper_bound(const Key &key) const {
+        const node_base *result = &header;
+        for (const node_base *n = header.parent; n != nullptr;) {
+            if (Compare()(key, value_of(n))) {
+                result = n;
+                n = n->left;
+            } else {
+                n = n->right;
+            }
+        }
+        return const_iterator(result);
+    }
+
+    template<typename Key>
+    const_iterator find(const Key &key) const {
+        const_iterator it = lower_bound(key);
+        if (it == end() || Compare()(key, *it))
+            return end();
+        return it;
+    }
+
+    /* k-th element in the order (counting from 0), end() if k >= size() */
+    const_iterator nth(size_type k) const noexcept {
+        const node_base *n = header.parent;
+        if (k >= size())
+            return end();
+        while (k != size_of(n->left)) {
+            if (k < size_of(n->left)) {
+                n = n->left;
+            } else {
+                k -= size_of(n->left) + 1;
+                n = n->right;
+            }
+        }
+        return const_iterator(n);
+    }
+
+    /* number of elements preceding it, size() for end() */
+    size_type rank(const_iterator it) const noexcept {
+        const node_base *n = it.n;
+        if (n == &header)
+            return size();
+        size_type result = size_of(n->left);
+        for (; n->parent != &header; n = n->parent) {
+            if (n->parent->right == n)
+                result += size_of(n->parent->left) + 1;
+        }
+        return result;
+    }
+
+    /* sum of the weights of the elements (Weighted sets only) */
+    size_type total_weight() const noexcept {
+        return total_of(header.parent);
+    }
+
+    /* weight of the element of it, 0 for end() */
+    static size_type weight(const_iterator it) noexcept {
+        return it.n->weight;
+    }
+
+    /* changes the weight of the element of it in O(log n) */
+    void reweigh(const_iterator it, size_type w) noexcept {
+        node_base *n = it.n;
+        for (node_base *p = n; p != &header; p = p->parent)
+            p->total = p->total - n->weight + w;
+        n->weight = w;
+    }
+
+    /**
+     * The element covering the k-th unit (counting from 0) of the total weight, with the elements in order,
+     * and the offset of that unit in its weight; end() if k >= total_weight()
+     */
+    std::pair<const_iterator, size_type> nth_weighted(size_type k) const noexcept {
+        const node_base *n = header.parent;
+        if (k >= total_weight())
+            return std::make_pair(end(), size_type(0));
+        for (;;) {
+            if (k < total_of(n->left)) {
+                n = n->left;
+                continue;
+            }
+            k -= total_of(n->left);
+            if (k < n->weight)
+                return std::make_pair(const_iterator(n), k);
+            k -= n->weight;
+            n = n->right;
+        }
+    }
+
+    /* sum of the weights of the elements preceding it, total_weight() for end() */
+    size_type rank_weighted(const_iterator it) const noexcept {
+        const node_base *n = it.n;
+        if (n == &header)
+            return total_weight();
+        size_type result = total_of(n->left);
+        for (; n->parent != &header; n = n->parent) {
+            if (n->parent->right == n)
+                result += total_of(n->parent->left) + n->parent->weight;
+        }
+        return result;
+    }
+
+    std::pair<const_iterator, bool> insert(const T &v) {
+        auto inserted = insert_unique(v);
+        return std::make_pair(const_iterator(inserted.first), inserted.second);
+    }
+
+    std::pair<const_iterator, bool> insert(T &&v) {
+        auto inserted = insert_unique(std::move(v));
+        return std::make_pair(const_iterator(inserted.first), inserted.second);
+    }
+
+    /* constant number of comparisons if v belongs right before hint, otherwise like insert(v) */
+    const_iterator insert(const_iterator hint, T &&v) {
+        node_base *h = hint.n;
+        if (h == &header || Compare()(v, value_of(h))) {
+            node_base *before = h == header.left ? nullptr : prev(h);
+            if (before == nullptr || Compare()(value_of(before), v)) {
+                node_base *n = make_node(std::move(v), next_priority());
+                if (h != &header && h->left == nullptr)
+                    link(h, true, n);
+                else
+                    link(before == nullptr ? &header : before, false, n);
+                return const_iterator(n);
+            }
+        }
+        return insert(std::move(v)).first;
+    }
+
+    const_iterator insert(const_iterator hint, const T &v) {
+        T copy(v);
+        return insert(hint, std::move(copy));
+    }
+
+    /* inserts v even if equal elements are present, after them */
+    const_iterator insert_equal(T &&v) {
+        node_base *parent = &header;
+        bool as_left = true;
+        for (node_base *n = header.parent; n != nullptr;) {
+            parent = n;
+            as_left = Compare()(v, value_of(n));
+            n = as_left ? n->left : n->right;
+        }
+        node_base *n = make_node(std::move(v), next_priority());
+        link(parent, as_left, n);
+        return const_iterator(n);
+    }
+
+    const_iterator erase(const_iterator it) noexcept {
+        node_base *n = it.n;
+        node_base *following = unlink(n);
+        drop_node(n);
+        if (header.parent == nullptr)
+            reset();
+        return const_iterator(following);
+    }
+
+    /**
+     * Moves the element of it to to (whose allocator must be equal) right before before, where it must belong.
+     * O(log n), compares nothing, iterators to the element stay valid.
+     */
+    void transfer(const_iterator it, OrderStatisticSet &to, const_iterator before) noexcept {
+        detach(it);
+        to.link_before(it.n, before.n);
+    }
+
+    /**
+     * Unlinks the element of it without destroying it and returns the element that followed it.
+     * The element keeps its weight; it either goes back with reattach or is destroyed with drop.
+     */
+    const_iterator detach(const_iterator it) noexcept {
+        node_base *following = unlink(it.n);
+        if (header.parent == nullptr)
+            reset();
+        return const_iterator(following);
+    }
+
+    /* links the detached element of it back right before before, where it must belong; compares nothing */
+    void reattach(const_iterator it, const_iterator before) noexcept {
+        link_before(it.n, before.n);
+    }
+
+    /* destroys the detached element of it */
+    void drop(const_iterator it) noexcept {
+        drop_node(it.n);
+    }
+
+    /* erases the elements before last at once: O(log n) to cut them off and O(1) to free each of them */
+    void erase_prefix(const_iterator last) noexcept {
+        size_type k = rank(last);
+        if (k == 0)
+            return;
+        node_base *erased;
+        node_base *kept;
+        split(header.parent, k, erased, kept);
+        destroy(erased);
+        if (kept == nullptr) {
+            reset();
+            return;
+        }
+        header.parent = kept;
+        kept->parent = &header;
+        header.left = last.n;
+    }
+
+    /* moves the elements from first on to the empty rest, whose allocator must be equal, in O(log n) */
+    void split_off(const_iterator first, OrderStatisticSet &rest) noexcept {
+        node_base *kept;
+        node_base *moved;
+        split(header.parent, rank(first), kept, moved);
+        set_root(kept);
+        rest.set_root(moved);
+    }
+
+    /**
+     * Moves all elements of other (whose allocator must be equal) right before gap,
+     * they must be greater than the elements before gap and less than the rest. O(log n), compares nothing.
+     */
+    void splice(const_iterator gap, OrderStatisticSet &other) noexcept {
+        node_base *before;
+        node_base *after;
+        split(header.parent, rank(gap), before, after);
+        set_root(join(join(before, other.header.parent), after));
+        other.reset();
+    }
+
+    /**
+     * Forgets its elements without destroying them and takes over the given nodes instead, in their order,
+     * which must be the order of the set. The nodes come from this set or from sets with an equal allocator,
+     * which must forget them as well (adopt them elsewhere or adopt no nodes). O(n), compares nothing:
+     * the nodes keep their priorities and are linked as the treap of those priorities.
+     */
+    void adopt(const std::vector<const_iterator> &nodes) noexcept {
+        reset();
+        node_base *last = &header;//bottom of the right spine, nodes above it are in the spine
+        auto finish = [](node_base *n) noexcept { update(n); };
+        for (auto it : nodes) {
+            node_base *n = it.n;
+            node_base *below = nullptr;
+            while (last != &header && last->priority < n->priority) {
+                finish(last);
+                below = last;
+                last = last->parent;
+            }
+            n->left = below;
+            n->right = nullptr;
+            if (below != nullptr)
+                below->parent = n;
+            n->parent = last;
+            if (last == &header)
+                header.parent = n;
+            else
+                last->right = n;
+            last = n;
+        }
+        for (; last != &header; last = last->parent)
+            finish(last);
+        if (nodes.empty())
+            return;
+        header.left = nodes.front().n;
+        header.right = nodes.back().n;
+    }
+
+    /* unless the allocators propagate on swap, they must be equal */
+    void swap(OrderStatisticSet &other) noexcept {
+        if constexpr (node_traits::propagate_on_container_swap::value)
+            std::swap(allocator, other.allocator);
+        std::swap(header.parent, other.header.parent);
+        std::swap(header.left, other.header.left);
+        std::swap(header.right, other.header.right);
+        std::swap(seed, other.seed);
+        if (header.parent == nullptr)
+            reset();
+        else
+            header.parent->parent = &header;
+        if (other.header.parent == nullptr)
+            other.reset();
+        else
+            other.header.parent->parent = &other.header;
+    }
+};
+
+/* number of levels of a balanced tree of size elements: the cost of a search or a relink relative to a visit */
+inline std::size_t balanced_depth(std::size_t size) noexcept {
+    std::size_t levels = 0;
+    for (; size != 0; size >>= 1)
+        ++levels;
+    return levels;
+}
+
+/* number of tasks for n elements on up to threads threads (0: all hardware threads), at least grain elements each */
+inline std::size_t parallel_tasks(std::size_t n, std::size_t threads, std::size_t grain = std::size_t(1) << 15) {
+    if (threads == 0)
+        threads = std::max(1u, std::thread::hardware_concurrency());
+    return std::max<std::size_t>(1, std::min(threads, n / grain));
+}
+
+/**
+ * Runs task(0), ..., task(tasks - 1), each but the first on a thread of its own, the first on the calling thread,
+ * and waits for all of them. The first exception thrown by a task or by starting a thread is rethrown
+ * once no task runs.
+ */
+template<typename Task>
+void run_parallel(std::size_t tasks, Task const &task) {
+    std::vector<std::exception_ptr> errors(tasks);
+    std::vector<std::thread> workers;
+    workers.reserve(tasks);
+    auto guarded = [&task, &errors](std::size_t i) noexcept {
+        try {
+            task(i);
+        } catch (...) {
+            errors[i] = std::current_exception();
+        }
+    };
+    std::exception_ptr failed_start;
+    try {
+        for (std::size_t i = 1; i < tasks; ++i)
+            workers.emplace_back(guarded, i);
+    } catch (...) {
+        failed_start = std::current_exception();
+    }
+    if (!failed_start)
+        guarded(0);
+    for (auto &worker : workers)
+        worker.join();
+    if (failed_start)
+        std::rethrow_exception(failed_start);
+    for (auto &error : errors)
+        if (error)
+            std::rethrow_exception(error);
+}
+
+/* stable sort of v in tasks chunks sorted in parallel, then merged pairwise, every round of merges in parallel */
+template<typename T, typename Less>
+void parallel_stable_sort(std::vector<T> &v, Less const &less, std::size_t tasks) {
+    std::vector<std::size_t> bounds(tasks + 1);
+    for (std::size_t i = 0; i <= tasks; ++i)
+        bounds[i] = v.size() * i / tasks;
+    run_parallel(tasks, [&](std::size_t i) {
+        std::stable_sort(v.begin() + bounds[i], v.begin() + bounds[i + 1], less);
+    });
+    while (bounds.size() > 2) {
+        run_parallel((bounds.size() - 1) / 2, [&](std::size_t i) {
+            std::inplace_merge(v.begin() + bounds[2 * i], v.begin() + bounds[2 * i + 1], v.begin() + bounds[2 * i + 2],
+                               less);
+        });
+        std::vector<std::size_t> merged;
+        for (std::size_t i = 0; i < bounds.size(); i += 2)
+            merged.push_back(bounds[i]);
+        if (merged.back() != v.size())
+            merged.push_back(v.size());
+        bounds.swap(merged);
+    }
+}
+
+/**
+ * Order of the maxima in the maxima indices of the storages: decreasing values, increasing arguments among
+ * equal values. For arithmetic types all three comparisons are made and combined without a branch,
+ * which is cheaper than a mispredicted branch on every other comparison of random values.
+ */
+template<typename A, typename V>
+bool maxima_order_less(V const &lhs_value, A const &lhs_arg, V const &rhs_value, A const &rhs_arg) {
+    if constexpr (std::is_arithmetic<A>::value && std::is_arithmetic<V>::value) {
+        return (rhs_value < lhs_value) | (!(lhs_value < rhs_value) & (lhs_arg < rhs_arg));
+    } else {
+        if (rhs_value < lhs_value)
+            return true;
+        if (lhs_value < rhs_value)
+            return false;
+        return lhs_arg < rhs_arg;
+    }
+}
+
+/**
+ * Maxima index shared by the storages, which keeps the maxima in runs: maxima at consecutive points with equal
+ * values, so a plateau of any length is a single element. An element holds the Entry of the first maximum
+ * of its run (its head) and the Tail standing for the last one, its length is its weight in an OrderStatisticSet
+ * of the elements in the maxima order (Compare, the head stands for the run as all its maxima share a value
+ * and have consecutive arguments). A second OrderStatisticSet of iterators of the same elements ordered
+ * by the arguments of their heads (ArgumentOf) answers queries about the maxima in a range of arguments.
+ * Every element remembers its place in the second set and the second set keeps iterators of the first,
+ * so erasing compares nothing and is noexcept.
+ * Runs change by insert, resize, rekey and erase, which are journaled until commit or rollback: erased elements
+ * are only detached and rekeyed ones are moved without being reallocated, so rollback (noexcept) restores
+ * the index as of the last commit and commit frees the erased ones.
+ * Each of them gives strong exception safety. The other modifications need an empty journal.
+ * Both sets allocate with Allocator, which must compare equal for the indices that are swapped,
+ * the journal uses the default heap and keeps its capacity.
+ */
+template<typename A, typename Entry, typename Tail, typename Compare, typename ArgumentOf,
+        typename Allocator = std::allocator<Entry>, typename Instrumentation = NoInstrumentation>
+class MaximaIndex {
+public:
+    struct element;
+
+private:
+    struct elementComparator {
+        using is_transparent = std::true_type;
+
+        bool operator()(const element &lhs, const element &rhs) const {
+            return Compare()(lhs.entry, rhs.entry);
+        }
+
+        template<typename Key>
+        bool operator()(const element &lhs, const Key &rhs) const {
+            return Compare()(lhs.entry, rhs);
+        }
+
+        template<typename Key>
+        bool operator()(const Key &lhs, const element &rhs) const {
+            return Compare()(lhs, rhs.entry);
+        }
+
+    };
+
+    using by_value_t = OrderStatisticSet<element, elementComparator, Allocator, true>;
+    using by_value_position_t = typename by_value_t::const_iterator;
+
+    struct argumentComparator {
+        using is_transparent = std::true_type;
+
+        bool operator()(by_value_position_t lhs, by_value_position_t rhs) const {
+            Instrumentation::argument_compared();
+            return ArgumentOf()(lhs->entry) < ArgumentOf()(rhs->entry);
+        }
+
+        bool operator()(by_value_position_t lhs, const A &rhs) const {
+            Instrumentation::argument_compared();
+            return ArgumentOf()(lhs->entry) < rhs;
+        }
+
+        bool operator()(const A &lhs, by_value_position_t rhs) const {
+            Instrumentation::argument_compared();
+            return lhs < ArgumentOf()(rhs->entry);
+        }
+
+    };
+
+    using by_argument_t = OrderStatisticSet<by_value_position_t, argumentComparator, Allocator>;
+
+public:
+    struct element {
+        mutable Entry entry;//changed only while the element is detached, see rekey
+        mutable Tail tail;
+        mutable typename by_argument_t::const_iterator by_argument;
+    };
+
+    /* a run given to assign */
+    struct run {
+        Entry entry;
+        Tail tail;
+        std::size_t length;
+    };
+
+private:
+    /* a journaled change: erased elements are detached right before the elements given */
+    struct change {
+        enum kind_t : unsigned char {
+            inserted, erased, resized, rekeyed
+        } kind;
+        by_value_position_t max;
+        by_value_position_t value_before;
+        typename by_argument_t::const_iterator argument_before;
+        std::size_t length;//the previous one of a resized or rekeyed element
+    };
+
+    by_value_t by_value;
+    by_argument_t by_argument;
+    std::vector<change> journal;
+    std::vector<Tail> replaced_tails;//of the resized and rekeyed elements, in the order of the journal
+    std::vector<Entry> replaced_entries;//of the rekeyed elements, in the order of the journal
+
+    typename by_value_t::const_iterator index_argument(typename by_value_t::const_iterator inserted) {
+        try {
+            inserted->by_argument = by_argument.insert_equal(by_value_position_t(inserted));
+        } catch (...) {
+            by_value.erase(inserted);
+            throw;
+        }
+        return inserted;
+    }
+
+    template<typename T>
+    static void reserve_one(std::vector<T> &v) {
+        if (v.size() == v.capacity())
+            v.reserve(2 * v.size() + 4);
+    }
+
+public:
+    using iterator = typename by_value_t::const_iterator;
+    using const_iterator = iterator;
+    using argument_iterator = typename by_argument_t::const_iterator;
+
+    explicit MaximaIndex(const Allocator &alloc) : by_value(alloc), by_argument(alloc) {}
+
+    MaximaIndex(const MaximaIndex &other, const Allocator &alloc) : MaximaIndex(alloc) {
+        for (auto max = other.by_value.begin(); max != other.by_value.end(); ++max)
+            append(max->entry, max->tail, length(max));
+    }
+
+    MaximaIndex &operator=(const MaximaIndex &other) = delete;
+
+    Allocator get_allocator() const noexcept {
+        return by_value.get_allocator();
+    }
+
+    iterator begin() const noexcept {
+        return by_value.begin();
+    }
+
+    iterator end() const noexcept {
+        return by_value.end();
+    }
+
+    /* number of maxima */
+    std::size_t size() const noexcept {
+        return by_value.total_weight();
+    }
+
+    /* number of runs */
+    std::size_t runs() const noexcept {
+        return by_value.size();
+    }
+
+    /* number of maxima of the run of max, 0 for end() */
+    static std::size_t length(iterator max) noexcept {
+        return by_value_t::weight(max);
+    }
+
+    template<typename Key>
+    iterator find(const Key &key) const {
+        return by_value.find(key);
+    }
+
+    template<typename Key>
+    iterator lower_bound(const Key &key) const {
+        return by_value.lower_bound(key);
+    }
+
+    /* the run of the k-th maximum and the offset of that maximum in it, end() if k >= size() */
+    std::pair<iterator, std::size_t> nth(std::size_t k) const noexcept {
+        return by_value.nth_weighted(k);
+    }
+
+    /* number of maxima in the runs before max */
+    std::size_t rank(iterator max) const noexcept {
+        return by_value.rank_weighted(max);
+    }
+
+    /* appends a run ordered after all the others, not journaled */
+    iterator append(Entry entry, Tail tail, std::size_t length) {
+        auto appended = index_argument(by_value.insert(by_value.end(), element{std::move(entry), std::move(tail), {}}));
+        by_value.reweigh(appended, length);
+        return appended;
+    }
+
+    /* inserts a new run, whose entry must not be in the index yet */
+    iterator insert(Entry entry, Tail tail, std::size_t length) {
+        reserve_one(journal);
+        auto inserted = by_value.insert(element{std::move(entry), std::move(tail), {}});
+        assert(inserted.second);
+        index_argument(inserted.first);
+        by_value.reweigh(inserted.first, length);
+        journal.push_back(change{change::inserted, inserted.first, {}, {}, 0});
+        return inserted.first;
+    }
+
+    /* gives the run of max a new last maximum and length */
+    void resize(iterator max, Tail tail, std::size_t length) {
+        reserve_one(journal);
+        reserve_one(replaced_tails);
+        replaced_tails.push_back(std::move(max->tail));
+        max->tail = std::move(tail);
+        journal.push_back(change{change::resized, max, {}, {}, by_value_t::weight(max)});
+        by_value.reweigh(max, length);
+    }
+
+    /**
+     * Gives the run of max a new head, last maximum and length, as erase and insert would, but moves its element
+     * to the place of the new entry (which must not be in the index yet) instead of allocating another one.
+     */
+    void rekey(iterator max, Entry entry, Tail tail, std::size_t length) {
+        reserve_one(journal);
+        reserve_one(replaced_tails);
+        reserve_one(replaced_entries);
+        auto value_at = by_value.upper_bound(entry);
+        auto argument_at = by_argument.upper_bound(ArgumentOf()(entry));
+        if (value_at == max)
+            ++value_at;
+        if (argument_at == max->by_argument)
+            ++argument_at;
+        auto argument_before = by_argument.detach(max->by_argument);
+        auto value_before = by_value.detach(max);
+        replaced_entries.push_back(std::move(max->entry));
+        replaced_tails.push_back(std::move(max->tail));
+        max->entry = std::move(entry);
+        max->tail = std::move(tail);
+        by_value.reattach(max, value_at);
+        by_argument.reattach(max->by_argument, argument_at);
+        journal.push_back(change{change::rekeyed, max, value_before, argument_before, by_value_t::weight(max)});
+        by_value.reweigh(max, length);
+    }
+
+    void erase(iterator max) {
+        reserve_one(journal);
+        auto argument_before = by_argument.detach(max->by_argument);
+        auto value_before = by_value.detach(max);
+        journal.push_back(change{change::erased, max, value_before, argument_before, 0});
+    }
+
+    /**
+     * Ends the journal, keeping its changes: settle(element) (noexcept) is called for every inserted
+     * or rekeyed element, then the erased ones are destroyed.
+     */
+    template<typename Settle>
+    void commit(Settle settle) noexcept {
+        for (auto &c : journal) {
+            if (c.kind == change::inserted || c.kind == change::rekeyed)
+                settle(*c.max);
+        }
+        for (auto &c : journal) {
+            if (c.kind == change::erased) {
+                by_argument.drop(c.max->by_argument);
+                by_value.drop(c.max);
+            }
+        }
+        journal.clear();
+        replaced_tails.clear();
+        replaced_entries.clear();
+    }
+
+    void commit() noexcept {
+        commit([](const element &) noexcept {});
+    }
+
+    /* undoes the journaled changes, in the reverse order */
+    void rollback() noexcept {
+        for (auto c = journal.rbegin(); c != journal.rend(); ++c) {
+            switch (c->kind) {
+                case change::inserted:
+                    by_argument.erase(c->max->by_argument);
+                    by_value.erase(c->max);
+                    break;
+                case change::erased:
+                    by_value.reattach(c->max, c->value_before);
+                    by_argument.reattach(c->max->by_argument, c->argument_before);
+                    break;
+                case change::resized:
+                    by_value.reweigh(c->max, c->length);
+                    c->max->tail = std::move(replaced_tails.back());
+                    replaced_tails.pop_back();
+                    break;
+                case change::rekeyed:
+                    by_argument.detach(c->max->by_argument);
+                    by_value.detach(c->max);
+                    c->max->entry = std::move(replaced_entries.back());
+                    c->max->tail = std::move(replaced_tails.back());
+                    replaced_entries.pop_back();
+                    replaced_tails.pop_back();
+                    by_value.reattach(c->max, c->value_before);
+                    by_argument.reattach(c->max->by_argument, c->argument_before);
+                    by_value.reweigh(c->max, c->length);
+                    break;
+            }
+        }
+        journal.clear();
+    }
+
+    /* merges the run right, which must follow the run left by argument, into left; not journaled */
+    void join(iterator left, iterator right) noexcept {
+        left->tail = std::move(right->tail);
+        by_value.reweigh(left, length(left) + length(right));
+        by_argument.erase(right->by_argument);
+        by_value.erase(right);
+    }
+
+    /**
+     * Replaces the elements with the runs of the maxima given by increasing argument (as positions maxima,
+     * which are in one run when next(maxima[i]) == maxima[i + 1]); entry(position) and tail(position) make
+     * the entries and the tails. The runs are sorted once in the maxima order (unless order, the indices
+     * of the maxima in that order, is given), so both sets are only appended to, never inserted into
+     * in the middle. The new index is built aside and swapped in: strong exception safety.
+     */
+    template<typename Position, typename MakeEntry, typename MakeTail>
+    void assign(const std::vector<Position> &maxima, std::vector<std::size_t> order, MakeEntry entry, MakeTail tail) {
+        std::vector<run> runs;
+        std::vector<std::size_t> run_of(maxima.size());
+        for (std::size_t i = 0; i < maxima.size(); ++i) {
+            if (i > 0 && std::next(maxima[i - 1]) == maxima[i]) {
+                runs.back().tail = tail(maxima[i]);
+                ++runs.back().length;
+            } else {
+                runs.push_back(run{entry(maxima[i]), tail(maxima[i]), 1});
+            }
+            run_of[i] = runs.size() - 1;
+        }
+        std::vector<std::size_t> run_order;
+        run_order.reserve(runs.size());
+        for (auto i : order) {
+            if (i == 0 || run_of[i - 1] != run_of[i])
+                run_order.push_back(run_of[i]);
+        }
+        assign(std::move(runs), std::move(run_order));
+    }
+
+    /* replaces the elements with runs given by increasing argument, the same way */
+    void assign(std::vector<run> runs, std::vector<std::size_t> order = {}) {
+        if (order.empty()) {
+            order.resize(runs.size());
+            for (std::size_t i = 0; i < order.size(); ++i)
+                order[i] = i;
+            std::sort(order.begin(), order.end(), [&runs](std::size_t lhs, std::size_t rhs) {
+                return Compare()(runs[lhs].entry, runs[rhs].entry);
+            });
+        }
+        MaximaIndex built(get_allocator());
+        std::vector<by_value_position_t> by_increasing_argument(runs.size());
+        for (auto i : order) {
+            auto max = built.by_value.insert(built.by_value.end(),
+                                             element{std::move(runs[i].entry), std::move(runs[i].tail), {}});
+            built.by_value.reweigh(max, runs[i].length);
+            by_increasing_argument[i] = max;
+        }
+        for (auto max : by_increasing_argument)
+            max->by_argument = built.by_argument.insert(built.by_argument.end(), max);
+        swap(built);
+    }
+
+    /* erases the runs before last in the argument order, returns the number of their maxima */
+    std::size_t erase_before(argument_iterator last) noexcept {
+        std::size_t erased = 0;
+        for (auto max = by_argument.begin(); max != last; ++max) {
+            erased += length(*max);
+            by_value.erase(*max);
+        }
+        by_argument.erase_prefix(last);
+        return erased;
+    }
+
+    /**
+     * Moves the runs whose heads have arguments not less than a to the empty rest (with an equal allocator),
+     * no run may reach a from before it. The elements are not copied: the argument order is cut in O(log m),
+     * and the nodes of the smaller part (k of them) are moved in the maxima order they already have,
+     * O(k log m) without comparisons, unless a linear partition of the maxima order is cheaper.
+     * Strong exception safety.
+     */
+    void split_off(A const &a, MaximaIndex &rest) {
+        //These lines may throw an exception
+        auto first = by_argument.lower_bound(a);
+        std::size_t kept = by_argument.rank(first);
+        bool move_rest = by_argument.size() - kept <= kept;
+        std::size_t k = move_rest ? by_argument.size() - kept : kept;
+        if (k * balanced_depth(by_value.size()) > by_value.size()) {
+            std::vector<iterator> kept_maxima;
+            std::vector<iterator> moved_maxima;
+            kept_maxima.reserve(kept);
+            moved_maxima.reserve(by_value.size() - kept);
+            for (auto max = by_value.begin(); max != by_value.end(); ++max)
+                (ArgumentOf()(max->entry) < a ? kept_maxima : moved_maxima).push_back(max);
+            //These lines are noexcept
+            by_argument.split_off(first, rest.by_argument);
+            by_value.adopt(kept_maxima);
+            rest.by_value.adopt(moved_maxima);
+            return;
+        }
+        std::vector<std::pair<std::size_t, iterator>> moved;//with their ranks in the maxima order
+        moved.reserve(k);
+        for (auto max = move_rest ? first : by_argument.begin(); max != (move_rest ? by_argument.end() : first); ++max)
+            moved.emplace_back(by_value.rank(*max), *max);
+        std::sort(moved.begin(), moved.end(), [](auto const &lhs, auto const &rhs) noexcept {
+            return lhs.first < rhs.first;
+        });
+        //These lines are noexcept
+        by_argument.split_off(first, rest.by_argument);
+        for (auto &max : moved)
+            by_value.transfer(max.second, rest.by_value, rest.by_value.end());
+        if (!move_rest)
+            by_value.swap(rest.by_value);
+    }
+
+    /**
+     * Moves all runs of other (with an equal allocator) into this index. Their arguments must lie
+     * between the runs of this index, runs meeting at the seams stay apart (see join). The elements
+     * are not copied: the argument orders are joined in O(log m) and the nodes of the smaller index
+     * (k of them) are moved into the larger one at the places found for them by O(k log m) comparisons,
+     * unless merging both maxima orders linearly is cheaper. Strong exception safety.
+     */
+    void splice(MaximaIndex &other) {
+        if (other.by_value.empty())
+            return;
+        //These lines may throw an exception
+        auto gap = by_argument.lower_bound(*other.by_argument.begin());
+        bool into_this = other.by_value.size() <= by_value.size();
+        by_value_t &from = into_this ? other.by_value : by_value;
+        by_value_t &to = into_this ? by_value : other.by_value;
+        if (from.size() * balanced_depth(to.size()) > from.size() + to.size()) {
+            std::vector<iterator> merged;
+            merged.reserve(from.size() + to.size());
+            auto lhs = by_value.begin();
+            auto rhs = other.by_value.begin();
+            while (lhs != by_value.end() || rhs != other.by_value.end()) {
+                if (rhs == other.by_value.end() || (lhs != by_value.end() && Compare()(lhs->entry, rhs->entry)))
+                    merged.push_back(lhs++);
+                else
+                    merged.push_back(rhs++);
+            }
+            //These lines are noexcept
+            by_value.adopt(merged);
+            other.by_value.adopt({});
+            by_argument.splice(gap, other.by_argument);
+            return;
+        }
+        std::vector<std::pair<iterator, iterator>> moved;//with the element of to they go before
+        moved.reserve(from.size());
+        for (auto max = from.begin(); max != from.end(); ++max)
+            moved.emplace_back(max, to.lower_bound(*max));
+        //These lines are noexcept
+        for (auto &max : moved)
+            from.transfer(max.first, to, max.second);
+        if (!into_this)
+            by_value.swap(other.by_value);
+        by_argument.splice(gap, other.by_argument);
+    }
+
+    void swap(MaximaIndex &other) noexcept {
+        by_value.swap(other.by_value);
+        by_argument.swap(other.by_argument);
+        journal.swap(other.journal);
+        replaced_tails.swap(other.replaced_tails);
+        replaced_entries.swap(other.replaced_entries);
+    }
+
+    argument_iterator argument_begin() const noexcept {
+        return by_argument.begin();
+    }
+
+    argument_iterator argument_lower_bound(A const &a) const {
+        return by_argument.lower_bound(a);
+    }
+
+    argument_iterator argument_upper_bound(A const &a) const {
+        return by_argument.upper_bound(a);
+    }
+
+    argument_iterator argument_end() const noexcept {
+        return by_argument.end();
+    }
+};
+
+/**
+ * Position of a single maximum in a MaximaIndex Index of runs whose entries keep the position of their
+ * first point (head) and whose tails are the positions of their last point, in a storage with stable
+ * positions (Position): the run, the offset of the maximum in it and the position of its point.
+ * Moving within a run steps over the points, moving past its ends goes to the neighbouring runs.
+ */
+template<typename Index, typename Position>
+class StableRunPosition {
+public:
+    StableRunPosition() = default;
+
+    StableRunPosition(typename Index::iterator run, std::size_t offset, Position point) noexcept
+            : run_(run), offset_(offset), point_(point) {}
+
+    typename Index::iterator run() const noexcept {
+        return run_;
+    }
+
+    std::size_t offset() const noexcept {
+        return offset_;
+    }
+
+    Position point() const noexcept {
+        return point_;
+    }
+
+    StableRunPosition &operator++() noexcept {
+        if (offset_ + 1 < Index::length(run_)) {
+            ++offset_;
+            ++point_;
+        } else {
+            ++run_;
+            offset_ = 0;
+            if (Index::length(run_) != 0)
+                point_ = run_->entry.head;
+        }
+        return *this;
+    }
+
+    StableRunPosition &operator--() noexcept {
+        if (offset_ > 0) {
+            --offset_;
+            --point_;
+        } else {
+            --run_;
+            offset_ = Index::length(run_) - 1;
+            point_ = run_->tail;
+        }
+        return *this;
+    }
+
+    bool operator==(const StableRunPosition &rhs) const noexcept {
+        return run_ == rhs.run_ && offset_ == rhs.offset_;
+    }
+
+    bool operator!=(const StableRunPosition &rhs) const noexcept {
+        return !(*this == rhs);
+    }
+
+private:
+    typename Index::iterator run_;
+    std::size_t offset_ = 0;
+    Position point_;
+};
+
+/* the same for the maxima in the argument order: the run in that order and the position of the point */
+template<typename Index, typename Position>
+class StableRunArgumentPosition {
+public:
+    StableRunArgumentPosition() = default;
+
+    StableRunArgumentPosition(typename Index::argument_iterator run, Position point,
+                              typename Index::argument_iterator end) noexcept : run_(run), point_(point), end_(end) {}
+
+    Position point() const noexcept {
+        return point_;
+    }
+
+    StableRunArgumentPosition &operator++() noexcept {
+        if (point_ != (*run_)->tail) {
+            ++point_;
+        } else {
+            ++run_;
+            point_ = run_ != end_ ? (*run_)->entry.head : Position();
+        }
+        return *this;
+    }
+
+    StableRunArgumentPosition &operator--() noexcept {
+        if (run_ != end_ && point_ != (*run_)->entry.head) {
+            --point_;
+        } else {
+            --run_;
+            point_ = (*run_)->tail;
+        }
+        return *this;
+    }
+
+    bool operator==(const StableRunArgumentPosition &rhs) const noexcept {
+        return run_ == rhs.run_ && point_ == rhs.point_;
+    }
+
+    bool operator!=(const StableRunArgumentPosition &rhs) const noexcept {
+        return !(*this == rhs);
+    }
+
+private:
+    typename Index::argument_iterator run_;
+    Position point_;
+    typename Index::argument_iterator end_;
+};
+
+/**
+ * Persistent ordered set of unique elements kept as an AVL tree of shared immutable nodes.
+ * A modification copies only the path to the modified place (O(log n) new nodes) and shares the rest
+ * with older versions, so copying the set is O(1) and a copy never sees later modifications of the original.
+ * Nodes are freed by reference counting once no version uses them.
+ * Like in OrderStatisticSet, nodes count the elements of their subtrees for nth and rank.
+ * Every modification builds the new version aside and publishes it with a noexcept root swap
+ * (strong exception safety). Iterators keep the version they walk alive.
+ * Nodes are made with std::allocate_shared from Allocator and remember it, so versions made with
+ * different allocators may share nodes and be swapped freely, as long as every allocator outlives the nodes.
+ */
+template<typename T, typename Compare, typename Allocator = std::allocator<T>>
+class PersistentSet {
+private:
+    struct node;
+    using link_t = std::shared_ptr<const node>;
+    using node_allocator_t = typename std::allocator_traits<Allocator>::template rebind_alloc<node>;
+
+    /* levels of the path to the current node an iterator keeps, see const_iterator */
+    static constexpr int cached_levels = 8;
+
+    static std::size_t size_of(const link_t &t) noexcept {
+        return t ? t->size : 0;
+    }
+
+    static int height_of(const link_t &t) noexcept {
+        return t ? t->height : 0;
+    }
+
+    struct node {
+        link_t left;
+        link_t right;
+        T value;
+        std::size_t size;
+        int height;
+
+        node(link_t l, const T &v, link_t r)
+                : left(std::move(l)), right(std::move(r)), value(v),
+                  size(1 + size_of(left) + size_of(right)), height(1 + std::max(height_of(left), height_of(right))) {}
+    };
+
+    node_allocator_t allocator;
+    link_t root;
+
+    link_t make(link_t l, const T &v, link_t r) const {
+        return std::allocate_shared<node>(allocator, std::move(l), v, std::move(r));
+    }
+
+    /* joins l, v and r whose heights differ by at most 2 into a balanced tree */
+    link_t balance(link_t l, const T &v, link_t r) const {
+        int hl = height_of(l);
+        int hr = height_of(r);
+        if (hl > hr + 1) {
+            if (height_of(l->left) >= height_of(l->right))
+                return make(l->left, l->value, make(l->right, v, std::move(r)));
+            return make(make(l->left, l->value, l->right->left), l->right->value,
+                        make(l->right->right, v, std::move(r)));
+        }
+        if (hr > hl + 1) {
+            if (height_of(r->right) >= height_of(r->left))
+                return make(make(std::move(l), v, r->left), r->value, r->right);
+            return make(make(std::move(l), v, r->left->left), r->left->value,
+                        make(r->left->right, r->value, r->right));
+        }
+        return make(std::move(l), v, std::move(r));
+    }
+
+    /* returns t itself if nothing changes: v is already there and replace is not set */
+    link_t insert(const link_t &t, const T &v, bool replace, bool &found) const {
+        if (!t)
+            return make(nullptr, v, nullptr);
+        if (Compare()(v, t->value)) {
+            link_t l = insert(t->left, v, replace, found);
+            return l == t->left ? t : balance(std::move(l), t->value, t->right);
+        }
+        if (Compare()(t->value, v)) {
+            link_t r = insert(t->right, v, replace, found);
+            return r == t->right ? t : balance(t->left, t->value, std::move(r));
+        }
+        found = true;
+        return replace ? make(t->left, v, t->right) : t;
+    }
+
+    link_t erase_min(const link_t &t, const node *&min) const {
+        if (!t->left) {
+            min = t.get();
+            return t->right;
+        }
+        link_t l = erase_min(t->left, min);
+        return balance(std::move(l), t->value, t->right);
+    }
+
+    template<typename Key>
+    link_t erase(const link_t &t, const Key &key, bool &found) const {
+        if (!t)
+            return t;
+        if (Compare()(key, t->value)) {
+            link_t l = erase(t->left, key, found);
+            return found ? balance(std::move(l), t->value, t->right) : t;
+        }
+        if (Compare()(t->value, key)) {
+            link_t r = erase(t->right, key, found);
+            return found ? balance(t->left, t->value, std::move(r)) : t;
+        }
+        found = true;
+        if (!t->left)
+            return t->right;
+        if (!t->right)
+            return t->left;
+        const node *min = nullptr;
+        link_t r = erase_min(t->right, min);
+        return balance(t->left, min->value, std::move(r));
+    }
+
+    /* l, v and r (in this order) of any heights joined into one balanced tree */
+    link_t join(link_t l, const T &v, link_t r) const {
+        if (height_of(l) > height_of(r) + 1)
+            return balance(l->left, l->value, join(l->right, v, std::move(r)));
+        if (height_of(r) > height_of(l) + 1)
+            return balance(join(std::move(l), v, r->left), r->value, r->right);
+        return make(std::move(l), v, std::move(r));
+    }
+
+    /* the first k elements of t, O(log n) new nodes */
+    link_t take_front(const link_t &t, std::size_t k) const {
+        if (k == size_of(t))
+            return t;
+        std::size_t left = size_of(t->left);
+        if (k <= left)
+            return take_front(t->left, k);
+        return join(t->left, t->value, take_front(t->right, k - left - 1));
+    }
+
+    /* l followed by r */
+    link_t concat(const link_t &l, const link_t &r) const {
+        if (!r)
+            return l;
+        const node *min = nullptr;
+        link_t rest = erase_min(r, min);
+        return join(l, min->value, std::move(rest));
+    }
+
+    /* t without its first k elements, O(log n) new nodes */
+    link_t drop_front(const link_t &t, std::size_t k) const {
+        if (k == 0)
+            return t;
+        std::size_t left = size_of(t->left);
+        if (k > left)
+            return drop_front(t->right, k - left - 1);
+        return join(drop_front(t->left, k), t->value, t->right);
+    }
+
+    template<typename It>
+    link_t build(It first, std::size_t n) const {
+        if (n == 0)
+            return nullptr;
+        link_t l = build(first, n / 2);
+        std::advance(first, n / 2);
+        const T &middle = *first;
+        link_t r = build(++first, n - n / 2 - 1);
+        return make(std::move(l), middle, std::move(r));
+    }
+
+public:
+    /**
+     * Keeps the version it walks, its rank in it and the lowest cached_levels nodes of the path
+     * from the root to the current node (in a ring), so copying it is cheap. A step that climbs
+     * above the cached levels finds the path again from the root by rank, which happens once
+     * per 2^cached_levels steps of a walk, so a walk stays O(1) amortized per step. Never compares.
+     */
+    class const_iterator {
+    private:
+        using self_type = const_iterator;
+    public:
+        using iterator_category = std::bidirectional_iterator_tag;
+        using value_type = T;
+        using pointer = const T *;
+        using reference = const T &;
+        using difference_type = std::ptrdiff_t;
+
+        const_iterator() = default;
+
+        reference operator*() const noexcept {
+            return path[top]->value;
+        }
+
+        pointer operator->() const noexcept {
+            return &path[top]->value;
+        }
+
+        self_type &operator++() noexcept {
+            const node *n = path[top];
+            ++index;
+            if (n->right) {
+                push(n->right.get());
+                descend_left();
+                return *this;
+            }
+            const node *child;
+            do {
+                child = pop();
+            } while (depth > 0 && path[top]->right.get() == child);
+            if (depth == 0 && child != version.get())
+                seek(index);//climbed above the cached levels
+            return *this;
+        }
+
+        self_type operator++(int) noexcept {
+            self_type i = *this;
+            ++*this;
+            return i;
+        }
+
+        self_type &operator--() noexcept {
+            if (depth == 0) {
+                seek(size_of(version) - 1);
+                return *this;
+            }
+            const node *n = path[top];
+            --index;
+            if (n->left) {
+                push(n->left.get());
+                descend_right();
+                return *this;
+            }
+            const node *child;
+            do {
+                child = pop();
+            } while (depth > 0 && path[top]->left.get() == child);
+            if (depth == 0 && child != version.get())
+                seek(index);
+            return *this;
+        }
+
+        self_type operator--(int) noexcept {
+            self_type i = *this;
+            --*this;
+            return i;
+        }
+
+        bool operator==(const self_type &rhs) const noexcept {
+            return current() == rhs.current();
+        }
+
+        bool operator!=(const self_type &rhs) const noexcept {
+            return current() != rhs.current();
+        }
+
+    private:
+        friend class PersistentSet;
+
+        link_t version;
+        std::size_t index = 0;//rank of the current node, the size of version at the end
+        int depth = 0;//cached levels, 0 at the end
+        int top = 0;//path[top] is the current node
+        const node *path[cached_levels];
+
+        explicit const_iterator(link_t version) noexcept : version(std::move(version)), index(size_of(this->version)) {}
+
+        const node *current() const noexcept {
+            return depth == 0 ? nullptr : path[top];
+        }
+
+        void push(const node *n) noexcept {
+            top = (top + 1) % cached_levels;
+            path[top] = n;
+            if (depth < cached_levels)
+                ++depth;
+        }
+
+        const node *pop() noexcept {
+            const node *n = path[top];
+            top = (top + cached_levels - 1) % cached_levels;
+            --depth;
+            return n;
+        }
+
+        /* the k-th node of version found from the root, the end if k >= its size */
+        void seek(std::size_t k) noexcept {
+            depth = 0;
+            index = std::min(k, size_of(version));
+            if (k >= size_of(version))
+                return;
+            const node *n = version.get();
+            push(n);
+            while (k != size_of(n->left)) {
+                if (k < size_of(n->left)) {
+                    n = n->left.get();
+                } else {
+                    k -= size_of(n->left) + 1;
+                    n = n->right.get();
+                }
+                push(n);
+            }
+        }
+
+        void descend_left() noexcept {
+            while (path[top]->left)
+                push(path[top]->left.get());
+        }
+
+        void descend_right() noexcept {
+            while (path[top]->right)
+                push(path[top]->right.get());
+        }
+    };
+
+    using iterator = const_iterator;
+    using size_type = std::size_t;
+    using allocator_type = Allocator;
+
+    PersistentSet() : PersistentSet(Allocator()) {}
+
+    explicit PersistentSet(const Allocator &alloc) noexcept : allocator(alloc) {}
+
+    PersistentSet(const PersistentSet &other)
+            : PersistentSet(other, std::allocator_traits<Allocator>::select_on_container_copy_construction(
+            other.get_allocator())) {}
+
+    /* O(1), the copy shares all nodes with other and makes its new nodes with alloc */
+    PersistentSet(const PersistentSet &other, const Allocator &alloc) noexcept : allocator(alloc), root(other.root) {}
+
+    PersistentSet &operator=(const PersistentSet &other) = delete;
+
+    allocator_type get_allocator() const noexcept {
+        return allocator_type(allocator);
+    }
+
+    const_iterator begin() const noexcept {
+        const_iterator it(root);
+        it.seek(0);
+        return it;
+    }
+
+    const_iterator end() const noexcept {
+        return const_iterator(root);
+    }
+
+    size_type size() const noexcept {
+        return size_of(root);
+    }
+
+    bool empty() const noexcept {
+        return !root;
+    }
+
+    template<typename Key>
+    const_iterator lower_bound(const Key &key) const {
+        size_type rank = 0;
+        size_type found = size();
+        for (const node *n = root.get(); n != nullptr;) {
+            if (Compare()(n->value, key)) {
+                rank += size_of(n->left) + 1;
+                n = n->right.get();
+            } else {
+                found = rank + size_of(n->left);
+                n = n->left.get();
+            }
+        }
+        return nth(found);
+    }
+
+    template<typename Key>
+    const_iterator upper_bound(const Key &key) const {
+        size_type rank = 0;
+        size_type found = size();
+        for (const node *n = root.get(); n != nullptr;) {
+            if (Compare()(key, n->value)) {
+                found = rank + size_of(n->left);
+                n = n->left.get();
+            } else {
+                rank += size_of(n->left) + 1;
+                n = n->right.get();
+            }
+        }
+        return nth(found);
+    }
+
+    template<typename Key>
+    const_iterator find(const Key &key) const {
+        const_iterator it = lower_bound(key);
+        if (it == end() || Compare()(key, *it))
+            return end();
+        return it;
+    }
+
+    /* k-th element in the order (counting from 0), end() if k >= size() */
+    const_iterator nth(size_type k) const noexcept {
+        const_iterator it(root);
+        it.seek(k);
+        return it;
+    }
+
+    /* number of elements preceding it, size() for end(), O(1) */
+    size_type rank(const const_iterator &it) const noexcept {
+        return it.depth == 0 ? size() : it.index;
+    }
+
+    std::pair<const_iterator, bool> insert(const T &v) {
+        bool found = false;
+        link_t next = insert(root, v, false, found);
+        root.swap(next);
+        return std::make_pair(lower_bound(v), !found);
+    }
+
+    /* replaces the element equal to v, returns false (and changes nothing) if there is none */
+    bool replace(const T &v) {
+        if (find(v) == end())
+            return false;
+        bool found = false;
+        link_t next = insert(root, v, true, found);
+        root.swap(next);
+        return true;
+    }
+
+    /* returns the number of erased elements */
+    template<typename Key>
+    size_type erase(const Key &key) {
+        bool found = false;
+        link_t next = erase(root, key, found);
+        root.swap(next);
+        return found ? 1 : 0;
+    }
+
+    /* moves the elements from first on to the empty rest, in O(log n) */
+    void split_off(const const_iterator &first, PersistentSet &rest) {
+        std::size_t k = rank(first);
+        link_t kept = take_front(root, k);
+        link_t moved = drop_front(root, k);
+        root.swap(kept);
+        rest.root.swap(moved);
+    }
+
+    /* moves all elements of other right before gap, they must fit there in the order, in O(log n) */
+    void splice(const const_iterator &gap, PersistentSet &other) {
+        std::size_t k = rank(gap);
+        link_t spliced = concat(concat(take_front(root, k), other.root), drop_front(root, k));
+        root.swap(spliced);
+        other.root.reset();
+    }
+
+    /* erases the elements before last, in O(log n) */
+    void erase_prefix(const const_iterator &last) {
+        link_t next = drop_front(root, rank(last));
+        root.swap(next);
+    }
+
+    /* replaces the contents with elements sorted in the order of the set, in O(n) */
+    void assign(const std::vector<T> &sorted) {
+        link_t next = build(sorted.begin(), sorted.size());
+        root.swap(next);
+    }
+
+    void swap(PersistentSet &other) noexcept {
+        root.swap(other.root);
+    }
+};
+
+template<typename A, typename V, typename Allocator, typename Instrumentation>
+class MapStorage::shared_storage {
+public:
+    static constexpr bool persistent = false;
+
+    class point_type {
+    private:
+        friend class shared_storage;
+
+        std::shared_ptr<A> argument_pointer;
+        mutable std::shared_ptr<V> value_pointer;//does not take part in ordering of the points
+
+        point_type(const std::shared_ptr<A> argument_ptr, const std::shared_ptr<V> value_ptr) {
+            argument_pointer = argument_ptr;
+            value_pointer = value_ptr;
+        }
+
+    public:
+        point_type() = delete;
+
+        A const &arg() const noexcept {
+            return *argument_pointer;
+        }
+
+        V const &value() const noexcept {
+            return *value_pointer;
+        }
+    };
+
+private:
+    struct argumentComparator {
+        using is_transparent = std::true_type;
+
+        bool operator()(const point_type &lhs, const point_type &rhs) const {
+            Instrumentation::argument_compared();
+            return *(lhs.argument_pointer) < *(rhs.argument_pointer);
+        }
+
+        bool operator()(const point_type &lhs, const A &rhs) const {
+            Instrumentation::argument_compared();
+            return *(lhs.argument_pointer) < rhs;
+        }
+
+        bool operator()(const A &lhs, const point_type &rhs) const {
+            Instrumentation::argument_compared();
+            return lhs < *(rhs.argument_pointer);
+        }
+
+    };
+
+    using values_map_t = OrderStatisticSet<point_type, argumentComparator, Allocator>;
+
+    /**
+     * A run of maxima: the position of its first point (head) and its value, the value of the head
+     * or a staged value waiting for commit, which keeps its address when the head takes it over
+     */
+    struct maxima_set_value_t {
+        V const *value;
+        typename values_map_t::const_iterator head;
+    };
+
+    struct maximaSetComparator {
+        bool operator()(const maxima_set_value_t &lhs, const maxima_set_value_t &rhs) const {
+            Instrumentation::maxima_compared();
+            return maxima_order_less(*(lhs.value), *(lhs.head->argument_pointer),
+                                     *(rhs.value), *(rhs.head->argument_pointer));
+        }
+
+        bool operator()(const maxima_set_value_t &lhs, const point_type &rhs) const {
+            Instrumentation::maxima_compared();
+            return maxima_order_less(*(lhs.value), *(lhs.head->argument_pointer),
+                                     *(rhs.value_pointer), *(rhs.argument_pointer));
+        }
+
+        bool operator()(const point_type &lhs, const maxima_set_value_t &rhs) const {
+            Instrumentation::maxima_compared();
+            return maxima_order_less(*(lhs.value_pointer), *(lhs.argument_pointer),
+                                     *(rhs.value), *(rhs.head->argument_pointer));
+        }
+
+    };
+
+    struct maximumArgument {
+        A const &operator()(const maxima_set_value_t &max) const noexcept {
+            return *(max.head->argument_pointer);
+        }
+    };
+
+    using maxima_set_t = MaximaIndex<A, maxima_set_value_t, typename values_map_t::const_iterator,
+            maximaSetComparator, maximumArgument, Allocator, Instrumentation>;
+    values_map_t function_map;
+    maxima_set_t maxima_set;
+
+    template<typename T, typename U = T>
+    std::shared_ptr<T> make_pointer(U &&u) const {
+        using pointer_allocator_t = typename std::allocator_traits<Allocator>::template rebind_alloc<T>;
+        return std::allocate_shared<T>(pointer_allocator_t(get_allocator()), std::forward<U>(u));
+    }
+
+public:
+    using position = typename values_map_t::const_iterator;
+    using mx_position = StableRunPosition<maxima_set_t, position>;
+    using mx_argument_position = StableRunArgumentPosition<maxima_set_t, position>;
+    using staged_value = std::shared_ptr<V>;
+
+    /* the maxima index keeps runs of maxima, see NodeStorage */
+    static constexpr bool run_length = true;
+    using mx_run = typename maxima_set_t::iterator;
+    using mx_run_cursor = typename maxima_set_t::argument_iterator;
+    using mx_tail = position;
+
+    shared_storage() : shared_storage(Allocator()) {}
+
+    explicit shared_storage(const Allocator &alloc) : function_map(alloc), maxima_set(alloc) {}
+
+    shared_storage(const shared_storage &other)
+            : shared_storage(other, std::allocator_traits<Allocator>::select_on_container_copy_construction(
+            other.get_allocator())) {}
+
+    /**
+     * Shares the arguments and the values with other when both allocators are equal. Otherwise copies them
+     * with alloc, so the copy does not depend on the allocator of other. The maxima index is rebuilt
+     * on the copied points, found by their ranks without comparisons.
+     */
+    shared_storage(const shared_storage &other, const Allocator &alloc) : function_map(alloc), maxima_set(alloc) {
+        if (alloc == other.get_allocator()) {
+            values_map_t points(other.function_map, alloc);
+            function_map.swap(points);
+        } else {
+            for (auto &point : other.function_map)
+                push_back(point.arg(), point.value());
+        }
+        for (auto run = other.maxima_set.begin(); run != other.maxima_set.end(); ++run) {
+            auto head = function_map.nth(other.function_map.rank(run->entry.head));
+            maxima_set.append(maxima_set_value_t{head->value_pointer.get(), head},
+                              function_map.nth(other.function_map.rank(run->tail)), maxima_set_t::length(run));
+        }
+    }
+
+    shared_storage &operator=(const shared_storage &other) = delete;
+
+    Allocator get_allocator() const noexcept {
+        return function_map.get_allocator();
+    }
+
+    static A const &arg(position p) noexcept {
+        return *(p->argument_pointer);
+    }
+
+    static V const &value(position p) noexcept {
+        return *(p->value_pointer);
+    }
+
+    static point_type const &point(position p) noexcept {
+        return *p;
+    }
+
+    static point_type const &mx_point(const mx_position &m) noexcept {
+        return *m.point();
+    }
+
+    static point_type const &mx_argument_point(const mx_argument_position &m) noexcept {
+        return *m.point();
+    }
+
+    static V const &staged(const staged_value &s) noexcept {
+        return *s;
+    }
+
+    /* copy of the point at p with the staged value s */
+    static point_type staged_point(position p, const staged_value &s) {
+        return point_type(p->argument_pointer, s);
+    }
+
+    position begin() const noexcept {
+        return function_map.begin();
+    }
+
+    position end() const noexcept {
+        return function_map.end();
+    }
+
+    position find(A const &a) const {
+        return function_map.find(a);
+    }
+
+    position lower_bound(A const &a) const {
+        return function_map.lower_bound(a);
+    }
+
+    std::size_t size() const noexcept {
+        return function_map.size();
+    }
+
+    position nth(std::size_t k) const noexcept {
+        return function_map.nth(k);
+    }
+
+    std::size_t rank(A const &a) const {
+        return function_map.rank(function_map.lower_bound(a));
+    }
+
+    mx_position mx_begin() const noexcept {
+        auto run = maxima_set.begin();
+        return mx_position(run, 0, run != maxima_set.end() ? run->entry.head : position());
+    }
+
+    mx_position mx_end() const noexcept {
+        return mx_position(maxima_set.end(), 0, position());
+    }
+
+    std::size_t mx_size() const noexcept {
+        return maxima_set.size();
+    }
+
+    mx_position mx_nth(std::size_t k) const noexcept {
+        auto at = maxima_set.nth(k);
+        if (at.first == maxima_set.end())
+            return mx_end();
+        position point = at.first->entry.head;
+        if (at.second != 0)
+            point = function_map.nth(function_map.rank(point) + at.second);
+        return mx_position(at.first, at.second, point);
+    }
+
+    /* the maxima of the runs ordered before p and the maxima before p in the run of equal value reaching p */
+    std::size_t mx_rank(point_type const &p) const {
+        auto run = maxima_set.lower_bound(p);
+        if (run == maxima_set.begin())
+            return 0;
+        --run;
+        std::size_t before = maxima_set.rank(run);
+        if (p.value() < *(run->entry.value) || arg(run->tail) < p.arg())
+            return before + maxima_set_t::length(run);
+        return before + function_map.rank(function_map.lower_bound(p.arg())) - function_map.rank(run->entry.head);
+    }
+
+    mx_argument_position mx_argument_lower_bound(A const &a) const {
+        auto run = maxima_set.argument_upper_bound(a);
+        if (run != maxima_set.argument_begin()) {
+            auto reaching = std::prev(run);
+            if (!(arg((*reaching)->tail) < a))
+                return mx_argument_position(reaching, function_map.lower_bound(a), maxima_set.argument_end());
+        }
+        return mx_argument_at(run);
+    }
+
+    mx_argument_position mx_argument_upper_bound(A const &a) const {
+        auto run = maxima_set.argument_upper_bound(a);
+        if (run != maxima_set.argument_begin()) {
+            auto reaching = std::prev(run);
+            if (a < arg((*reaching)->tail))
+                return mx_argument_position(reaching, function_map.upper_bound(a), maxima_set.argument_end());
+        }
+        return mx_argument_at(run);
+    }
+
+    mx_argument_position mx_argument_begin() const noexcept {
+        return mx_argument_at(maxima_set.argument_begin());
+    }
+
+    /* the first maximum of the run at run in the argument order */
+    mx_argument_position mx_argument_at(mx_run_cursor run) const noexcept {
+        return mx_argument_position(run, run != maxima_set.argument_end() ? (*run)->entry.head : position(),
+                                    maxima_set.argument_end());
+    }
+
+    mx_run mx_run_end() const noexcept {
+        return maxima_set.end();
+    }
+
+    mx_run_cursor mx_runs_end() const noexcept {
+        return maxima_set.argument_end();
+    }
+
+    /* the first run in the argument order that does not end before p */
+    mx_run_cursor mx_runs_from(position p) const {
+        auto run = maxima_set.argument_upper_bound(arg(p));
+        if (run != maxima_set.argument_begin() && !mx_run_ends_before(*std::prev(run), p))
+            --run;
+        return run;
+    }
+
+    /* the run whose first maximum in the argument order is not before a */
+    mx_run_cursor mx_runs_starting_from(A const &a) const {
+        return maxima_set.argument_lower_bound(a);
+    }
+
+    static bool mx_run_ends_before(mx_run run, position p) {
+        Instrumentation::argument_compared();
+        return arg(run->tail) < arg(p);
+    }
+
+    static bool mx_run_starts_after(mx_run run, position p) {
+        Instrumentation::argument_compared();
+        return arg(p) < arg(run->entry.head);
+    }
+
+    /* p is a point of the run */
+    static bool mx_run_starts_at(mx_run run, position p) noexcept {
+        return run->entry.head == p;
+    }
+
+    static std::size_t mx_run_length(mx_run run) noexcept {
+        return maxima_set_t::length(run);
+    }
+
+    static A const &mx_run_last_argument(mx_run run) noexcept {
+        return arg(run->tail);
+    }
+
+    /* number of maxima of the run after its point p */
+    std::size_t mx_run_members_after(mx_run run, position p) const noexcept {
+        return function_map.rank(run->tail) - function_map.rank(p);
+    }
+
+    static mx_tail mx_run_tail(mx_run run) noexcept {
+        return run->tail;
+    }
+
+    static mx_tail mx_tail_at(position p) noexcept {
+        return p;
+    }
+
+    /* a run from p to tail, with the value s (unless it is null) */
+    void mx_run_insert(position p, const staged_value *s, mx_tail tail, std::size_t length) {
+        maxima_set.insert(maxima_set_value_t{s != nullptr ? s->get() : p->value_pointer.get(), p}, tail, length);
+    }
+
+    /* reuses a run that is erased otherwise for a new run at p, see MaximaIndex::rekey */
+    void mx_run_rekey(mx_run run, position p, const staged_value *s, mx_tail tail, std::size_t length) {
+        maxima_set.rekey(run, maxima_set_value_t{s != nullptr ? s->get() : p->value_pointer.get(), p}, tail, length);
+    }
+
+    void mx_run_resize(mx_run run, mx_tail tail, std::size_t length) {
+        maxima_set.resize(run, tail, length);
+    }
+
+    void mx_run_erase(mx_run run) {
+        maxima_set.erase(run);
+    }
+
+    void mx_commit() noexcept {
+        maxima_set.commit();
+    }
+
+    void mx_rollback() noexcept {
+        maxima_set.rollback();
+    }
+
+    void mx_join(mx_run left, mx_run right) noexcept {
+        maxima_set.join(left, right);
+    }
+
+    /* the run containing the maximum at p */
+    mx_run mx_run_at(position p) const {
+        auto run = mx_runs_from(p);
+        if (run == maxima_set.argument_end() || mx_run_starts_after(*run, p))
+            return maxima_set.end();
+        return *run;
+    }
+
+    /* the last maximum of the run of first */
+    mx_position mx_run_last(const mx_position &first) const noexcept {
+        auto run = first.run();
+        return mx_position(run, maxima_set_t::length(run) - 1, run->tail);
+    }
+
+    /* the number of maxima in the run of first */
+    static std::size_t mx_run_size(const mx_position &first) noexcept {
+        return maxima_set_t::length(first.run());
+    }
+
+    template<typename AA, typename VV>
+    position insert(position hint, AA &&a, VV &&v) {
+        auto a_ptr = make_pointer<A>(std::forward<AA>(a));
+        auto v_ptr = make_pointer<V>(std::forward<VV>(v));
+        return function_map.insert(hint, point_type(std::move(a_ptr), std::move(v_ptr)));
+    }
+
+    /* a must be greater than every argument already stored */
+    template<typename AA, typename VV>
+    position push_back(AA &&a, VV &&v) {
+        return insert(function_map.end(), std::forward<AA>(a), std::forward<VV>(v));
+    }
+
+    void erase(position p) noexcept {
+        function_map.erase(p);
+    }
+
+    /* erases the points before last at once */
+    void erase_prefix(position last) noexcept {
+        function_map.erase_prefix(last);
+    }
+
+    /**
+     * Moves the points from first on and their maxima to the empty rest (with an equal allocator),
+     * relinking the nodes. Strong exception safety, maxima positions stay valid.
+     */
+    void split_off(position first, shared_storage &rest) {
+        if (first != function_map.end())
+            maxima_set.split_off(arg(first), rest.maxima_set);
+        function_map.split_off(first, rest.function_map);
+    }
+
+    /**
+     * Moves all points of other (with an equal allocator) and their maxima right before gap, relinking
+     * the nodes. The arguments of other must lie between the arguments around gap. Strong exception safety,
+     * positions of both storages stay valid.
+     */
+    void splice(position gap, shared_storage &other) {
+        maxima_set.splice(other.maxima_set);
+        function_map.splice(gap, other.function_map);
+    }
+
+    /* replaces the maxima index with maxima given by increasing argument, see MaximaIndex::assign */
+    void mx_assign(const std::vector<position> &maxima, std::vector<std::size_t> order = {}) {
+        maxima_set.assign(maxima, std::move(order), [](position p) noexcept {
+            return maxima_set_value_t{p->value_pointer.get(), p};
+        }, [](position p) noexcept {
+            return p;
+        });
+    }
+
+    /* erases the runs before last in the argument order, returns the number of their maxima */
+    std::size_t mx_erase_before(mx_run_cursor last) noexcept {
+        return maxima_set.erase_before(last);
+    }
+
+    template<typename VV>
+    staged_value stage(VV &&v) const {
+        return make_pointer<V>(std::forward<VV>(v));
+    }
+
+    void commit(position p, staged_value &s) noexcept {
+        p->value_pointer = std::move(s);
+    }
+
+    void swap(shared_storage &other) noexcept {
+        function_map.swap(other.function_map);
+        maxima_set.swap(other.maxima_set);
+    }
+};
+
+template<typename Key, typename A, typename V, std::size_t SmallSize = 32>
+class FunctionMaximaStore;
+
+template<typename A, typename V, typename Allocator, typename Instrumentation>
+class NodeStorage::storage {
+    static_assert(std::is_nothrow_move_assignable<V>::value, "NodeStorage requires nothrow move assignable values");
+
+public:
+    static constexpr bool persistent = false;
+
+    class point_type {
+    private:
+        friend class storage;
+
+        template<typename, typename, typename, std::size_t>
+        friend class FunctionMaximaStore;//keeps the points of small series, see FunctionMaximaStore
+
+        A argument;
+        mutable V val;//does not take part in ordering of the points
+
+        template<typename AA, typename VV>
+        point_type(AA &&a, VV &&v) : argument(std::forward<AA>(a)), val(std::forward<VV>(v)) {}
+
+    public:
+        point_type() = delete;
+
+        A const &arg() const noexcept {
+            return argument;
+        }
+
+        V const &value() const noexcept {
+            return val;
+        }
+    };
+
+private:
+    struct argumentComparator {
+        using is_transparent = std::true_type;
+
+        bool operator()(const point_type &lhs, const point_type &rhs) const {
+            Instrumentation::argument_compared();
+            return lhs.argument < rhs.argument;
+        }
+
+        bool operator()(const point_type &lhs, const A &rhs) const {
+            Instrumentation::argument_compared();
+            return lhs.argument < rhs;
+        }
+
+        bool operator()(const A &lhs, const point_type &rhs) const {
+            Instrumentation::argument_compared();
+            return lhs < rhs.argument;
+        }
+
+    };
+
+    using values_map_t = OrderStatisticSet<point_type, argumentComparator, Allocator>;
+
+    /**
+     * A run of maxima: the position of its first point (head) and its value, which points at the value
+     * of the head, except for a staged value waiting for commit
+     */
+    struct maxima_set_value_t {
+        mutable V const *value;
+        typename values_map_t::const_iterator head;
+    };
+
+    /* a value and an argument to look up in the maxima order */
+    struct maxima_key_t {
+        V const &value;
+        A const &argument;
+    };
+
+    struct maximaSetComparator {
+        bool operator()(const maxima_set_value_t &lhs, const maxima_set_value_t &rhs) const {
+            Instrumentation::maxima_compared();
+            return maxima_order_less(*(lhs.value), lhs.head->argument, *(rhs.value), rhs.head->argument);
+        }
+
+        bool operator()(const maxima_set_value_t &lhs, const maxima_key_t &rhs) const {
+            Instrumentation::maxima_compared();
+            return maxima_order_less(*(lhs.value), lhs.head->argument, rhs.value, rhs.argument);
+        }
+
+        bool operator()(const maxima_key_t &lhs, const maxima_set_value_t &rhs) const {
+            Instrumentation::maxima_compared();
+            return maxima_order_less(lhs.value, lhs.argument, *(rhs.value), rhs.head->argument);
+        }
+
+    };
+
+    struct maximumArgument {
+        A const &operator()(const maxima_set_value_t &max) const noexcept {
+            return max.head->argument;
+        }
+    };
+
+    using maxima_set_t = MaximaIndex<A, maxima_set_value_t, typename values_map_t::const_iterator,
+            maximaSetComparator, maximumArgument, Allocator, Instrumentation>;
+    values_map_t function_map;
+    maxima_set_t maxima_set;
+
+    /* the position in other of the point at p of a copy */
+    static typename values_map_t::const_iterator counterpart(const values_map_t &copy, const values_map_t &other,
+                                                             typename values_map_t::const_iterator p) noexcept {
+        return other.nth(copy.rank(p));
+    }
+
+public:
+    using position = typename values_map_t::const_iterator;
+    using mx_position = StableRunPosition<maxima_set_t, position>;
+    using mx_argument_position = StableRunArgumentPosition<maxima_set_t, position>;
+    using staged_value = V;
+
+    /* the maxima index keeps runs of maxima, see mx_run */
+    static constexpr bool run_length = true;
+    using mx_run = typename maxima_set_t::iterator;
+    using mx_run_cursor = typename maxima_set_t::argument_iterator;
+    using mx_tail = position;
+
+    storage() : storage(Allocator()) {}
+
+    explicit storage(const Allocator &alloc) : function_map(alloc), maxima_set(alloc) {}
+
+    storage(const storage &other)
+            : storage(other, std::allocator_traits<Allocator>::select_on_container_copy_construction(
+            other.get_allocator())) {}
+
+    /**
+     * Copies the points and then rebuilds the maxima index so that it refers to the copied nodes,
+     * found by their ranks without comparisons.
+     * The runs are visited in index order, so every one of them is appended at the end of the new index.
+     */
+    storage(const storage &other, const Allocator &alloc) : function_map(other.function_map, alloc), maxima_set(alloc) {
+        for (auto run = other.maxima_set.begin(); run != other.maxima_set.end(); ++run) {
+            auto head = counterpart(other.function_map, function_map, run->entry.head);
+            maxima_set.append(maxima_set_value_t{&head->val, head},
+                              counterpart(other.function_map, function_map, run->tail), maxima_set_t::length(run));
+        }
+    }
+
+    storage &operator=(const storage &other) = delete;
+
+    Allocator get_allocator() const noexcept {
+        return function_map.get_allocator();
+    }
+
+    static A const &arg(position p) noexcept {
+        return p->argument;
+    }
+
+    static V const &value(position p) noexcept {
+        return p->val;
+    }
+
+    static point_type const &point(position p) noexcept {
+        return *p;
+    }
+
+    static point_type const &mx_point(const mx_position &m) noexcept {
+        return *m.point();
+    }
+
+    static point_type const &mx_argument_point(const mx_argument_position &m) noexcept {
+        return *m.point();
+    }
+
+    static V const &staged(const staged_value &s) noexcept {
+        return s;
+    }
+
+    /* copy of the point at p with the staged value s */
+    static point_type staged_point(position p, const staged_value &s) {
+        return point_type(p->argument, s);
+    }
+
+    position begin() const noexcept {
+        return function_map.begin();
+    }
+
+    position end() const noexcept {
+        return function_map.end();
+    }
+
+    position find(A const &a) const {
+        return function_map.find(a);
+    }
+
+    position lower_bound(A const &a) const {
+        return function_map.lower_bound(a);
+    }
+
+    std::size_t size() const noexcept {
+        return function_map.size();
+    }
+
+    position nth(std::size_t k) const noexcept {
+        return function_map.nth(k);
+    }
+
+    std::size_t rank(A const &a) const {
+        return function_map.rank(function_map.lower_bound(a));
+    }
+
+    mx_position mx_begin() const noexcept {
+        auto run = maxima_set.begin();
+        return mx_position(run, 0, run != maxima_set.end() ? run->entry.head : position());
+    }
+
+    mx_position mx_end() const noexcept {
+        return mx_position(maxima_set.end(), 0, position());
+    }
+
+    std::size_t mx_size() const noexcept {
+        return maxima_set.size();
+    }
+
+    mx_position mx_nth(std::size_t k) const noexcept {
+        auto at = maxima_set.nth(k);
+        if (at.first == maxima_set.end())
+            return mx_end();
+        position point = at.first->entry.head;
+        if (at.second != 0)
+            point = function_map.nth(function_map.rank(point) + at.second);
+        return mx_position(at.first, at.second, point);
+    }
+
+    /* the maxima of the runs ordered before p and the maxima before p in the run of equal value reaching p */
+    std::size_t mx_rank(point_type const &p) const {
+        auto run = maxima_set.lower_bound(maxima_key_t{p.val, p.argument});
+        if (run == maxima_set.begin())
+            return maxima_set.rank(run);
+        --run;
+        std::size_t before = maxima_set.rank(run);
+        if (p.val < *(run->entry.value) || run->tail->argument < p.argument)
+            return before + maxima_set_t::length(run);
+        return before + function_map.rank(function_map.lower_bound(p.argument)) - function_map.rank(run->entry.head);
+    }
+
+    mx_argument_position mx_argument_lower_bound(A const &a) const {
+        auto run = maxima_set.argument_upper_bound(a);
+        if (run != maxima_set.argument_begin()) {
+            auto reaching = std::prev(run);
+            if (!((*reaching)->tail->argument < a))
+                return mx_argument_position(reaching, function_map.lower_bound(a), maxima_set.argument_end());
+        }
+        return mx_argument_at(run);
+    }
+
+    mx_argument_position mx_argument_upper_bound(A const &a) const {
+        auto run = maxima_set.argument_upper_bound(a);
+        if (run != maxima_set.argument_begin()) {
+            auto reaching = std::prev(run);
+            if (a < (*reaching)->tail->argument)
+                return mx_argument_position(reaching, function_map.upper_bound(a), maxima_set.argument_end());
+        }
+        return mx_argument_at(run);
+    }
+
+    mx_argument_position mx_argument_begin() const noexcept {
+        return mx_argument_at(maxima_set.argument_begin());
+    }
+
+    /* the first maximum of the run at run in the argument order */
+    mx_argument_position mx_argument_at(mx_run_cursor run) const noexcept {
+        return mx_argument_position(run, run != maxima_set.argument_end() ? (*run)->entry.head : position(),
+                                    maxima_set.argument_end());
+    }
+
+    /**
+     * Runs of maxima. FunctionMaxima rebuilds the runs around the points it modifies from what it finds
+     * with a cursor over the runs in the argument order (mx_run_cursor), starting at the first run that
+     * reaches a point (mx_runs_from), and then replaces them with mx_run_insert / mx_run_resize / mx_run_erase,
+     * which are journaled until mx_commit or mx_rollback, see MaximaIndex. mx_join merges the runs meeting
+     * at the seam of a splice after the commit.
+     */
+    mx_run mx_run_end() const noexcept {
+        return maxima_set.end();
+    }
+
+    mx_run_cursor mx_runs_end() const noexcept {
+        return maxima_set.argument_end();
+    }
+
+    /* the first run in the argument order that does not end before p */
+    mx_run_cursor mx_runs_from(position p) const {
+        auto run = maxima_set.argument_upper_bound(p->argument);
+        if (run != maxima_set.argument_begin() && !mx_run_ends_before(*std::prev(run), p))
+            --run;
+        return run;
+    }
+
+    /* the run whose first maximum in the argument order is not before a */
+    mx_run_cursor mx_runs_starting_from(A const &a) const {
+        return maxima_set.argument_lower_bound(a);
+    }
+
+    static bool mx_run_ends_before(mx_run run, position p) {
+        Instrumentation::argument_compared();
+        return run->tail->argument < p->argument;
+    }
+
+    static bool mx_run_starts_after(mx_run run, position p) {
+        Instrumentation::argument_compared();
+        return p->argument < run->entry.head->argument;
+    }
+
+    /* p is a point of the run */
+    static bool mx_run_starts_at(mx_run run, position p) noexcept {
+        return run->entry.head == p;
+    }
+
+    static std::size_t mx_run_length(mx_run run) noexcept {
+        return maxima_set_t::length(run);
+    }
+
+    static A const &mx_run_last_argument(mx_run run) noexcept {
+        return run->tail->argument;
+    }
+
+    /* number of maxima of the run after its point p */
+    std::size_t mx_run_members_after(mx_run run, position p) const noexcept {
+        return function_map.rank(run->tail) - function_map.rank(p);
+    }
+
+    static mx_tail mx_run_tail(mx_run run) noexcept {
+        return run->tail;
+    }
+
+    static mx_tail mx_tail_at(position p) noexcept {
+        return p;
+    }
+
+    /* a run from p to tail, the entry refers to s (unless it is null) until mx_commit */
+    void mx_run_insert(position p, const staged_value *s, mx_tail tail, std::size_t length) {
+        maxima_set.insert(maxima_set_value_t{s != nullptr ? s : &p->val, p}, tail, length);
+    }
+
+    /* reuses a run that is erased otherwise for a new run at p, see MaximaIndex::rekey */
+    void mx_run_rekey(mx_run run, position p, const staged_value *s, mx_tail tail, std::size_t length) {
+        maxima_set.rekey(run, maxima_set_value_t{s != nullptr ? s : &p->val, p}, tail, length);
+    }
+
+    void mx_run_resize(mx_run run, mx_tail tail, std::size_t length) {
+        maxima_set.resize(run, tail, length);
+    }
+
+    void mx_run_erase(mx_run run) {
+        maxima_set.erase(run);
+    }
+
+    /* runs inserted with a staged value refer to the value of their head from now on */
+    void mx_commit() noexcept {
+        maxima_set.commit([](const typename maxima_set_t::element &run) noexcept {
+            run.entry.value = &run.entry.head->val;
+        });
+    }
+
+    void mx_rollback() noexcept {
+        maxima_set.rollback();
+    }
+
+    void mx_join(mx_run left, mx_run right) noexcept {
+        maxima_set.join(left, right);
+    }
+
+    /* the run containing the maximum at p */
+    mx_run mx_run_at(position p) const {
+        auto run = mx_runs_from(p);
+        if (run == maxima_set.argument_end() || mx_run_starts_after(*run, p))
+            return maxima_set.end();
+        return *run;
+    }
+
+    /* the last maximum of the run of first */
+    mx_position mx_run_last(const mx_position &first) const noexcept {
+        auto run = first.run();
+        return mx_position(run, maxima_set_t::length(run) - 1, run->tail);
+    }
+
+    /* the number of maxima in the run of first */
+    static std::size_t mx_run_size(const mx_position &first) noexcept {
+        return maxima_set_t::length(first.run());
+    }
+
+    template<typename AA, typename VV>
+    position insert(position hint, AA &&a, VV &&v) {
+        return function_map.insert(hint, point_type(std::forward<AA>(a), std::forward<VV>(v)));
+    }
+
+    /* a must be greater than every argument already stored */
+    template<typename AA, typename VV>
+    position push_back(AA &&a, VV &&v) {
+        return insert(function_map.end(), std::forward<AA>(a), std::forward<VV>(v));
+    }
+
+    void erase(position p) noexcept {
+        function_map.erase(p);
+    }
+
+    /* erases the points before last at once */
+    void erase_prefix(position last) noexcept {
+        function_map.erase_prefix(last);
+    }
+
+    /**
+     * Moves the points from first on and their maxima to the empty rest (with an equal allocator),
+     * relinking the nodes. Strong exception safety, maxima positions stay valid.
+     */
+    void split_off(position first, storage &rest) {
+        if (first != function_map.end())
+            maxima_set.split_off(arg(first), rest.maxima_set);
+        function_map.split_off(first, rest.function_map);
+    }
+
+    /**
+     * Moves all points of other (with an equal allocator) and their maxima right before gap, relinking
+     * the nodes. The arguments of other must lie between the arguments around gap. Strong exception safety,
+     * positions of both storages stay valid.
+     */
+    void splice(position gap, storage &other) {
+        maxima_set.splice(other.maxima_set);
+        function_map.splice(gap, other.function_map);
+    }
+
+    /* replaces the maxima index with maxima given by increasing argument, see MaximaIndex::assign */
+    void mx_assign(const std::vector<position> &maxima, std::vector<std::size_t> order = {}) {
+        maxima_set.assign(maxima, std::move(order), [](position p) noexcept {
+            return maxima_set_value_t{&p->val, p};
+        }, [](position p) noexcept {
+            return p;
+        });
+    }
+
+    /* erases the runs before last in the argument order, returns the number of their maxima */
+    std::size_t mx_erase_before(mx_run_cursor last) noexcept {
+        return maxima_set.erase_before(last);
+    }
+
+    template<typename VV>
+    staged_value stage(VV &&v) const {
+        return std::forward<VV>(v);
+    }
+
+    void commit(position p, staged_value &s) noexcept {
+        p->val = std::move(s);
+    }
+
+    void swap(storage &other) noexcept {
+        function_map.swap(other.function_map);
+        maxima_set.swap(other.maxima_set);
+    }
+};
+
+template<bool ShiftingPositions, std::size_t BlockSize>
+template<typename A, typename V, typename Allocator, typename Instrumentation>
+class FlatStorage<ShiftingPositions, BlockSize>::storage {
+    static_assert(std::is_nothrow_move_constructible<A>::value && std::is_nothrow_move_assignable<A>::value,
+                  "FlatStorage requires nothrow movable arguments");
+    static_assert(std::is_nothrow_move_constructible<V>::value && std::is_nothrow_move_assignable<V>::value,
+                  "FlatStorage requires nothrow movable values");
+
+public:
+    static constexpr bool persistent = false;
+
+    class point_type {
+    private:
+        friend class storage;
+
+        A argument;
+        V val;
+
+        template<typename AA, typename VV>
+        point_type(AA &&a, VV &&v) : argument(std::forward<AA>(a)), val(std::forward<VV>(v)) {}
+
+    public:
+        point_type() = delete;
+
+        A const &arg() const noexcept {
+            return argument;
+        }
+
+        V const &value() const noexcept {
+            return val;
+        }
+    };
+
+private:
+    template<typename T>
+    using allocator_for_t = typename std::allocator_traits<Allocator>::template rebind_alloc<T>;
+    using block_t = std::vector<point_type, allocator_for_t<point_type>>;
+    using blocks_t = std::vector<block_t, allocator_for_t<block_t>>;
+    //the noexcept erasures and commits shift points within their blocks
+    static_assert(std::is_nothrow_move_constructible<point_type>::value &&
+                  std::is_nothrow_move_assignable<point_type>::value, "FlatStorage points must be nothrow movable");
+
+    struct maxima_key_t {
+        V const &value;
+        A const &argument;
+    };
+
+    struct maximaSetComparator {
+        using is_transparent = std::true_type;
+
+        static bool compare(V const &lhs_value, A const &lhs_arg, V const &rhs_value, A const &rhs_arg) {
+            Instrumentation::maxima_compared();
+            return maxima_order_less(lhs_value, lhs_arg, rhs_value, rhs_arg);
+        }
+
+        bool operator()(const point_type &lhs, const point_type &rhs) const {
+            return compare(lhs.val, lhs.argument, rhs.val, rhs.argument);
+        }
+
+        bool operator()(const point_type &lhs, const maxima_key_t &rhs) const {
+            return compare(lhs.val, lhs.argument, rhs.value, rhs.argument);
+        }
+
+        bool operator()(const maxima_key_t &lhs, const point_type &rhs) const {
+            return compare(lhs.value, lhs.argument, rhs.val, rhs.argument);
+        }
+
+    };
+
+    struct maximumArgument {
+        A const &operator()(const point_type &max) const noexcept {
+            return max.argument;
+        }
+    };
+
+    /* runs of maxima are kept as copies of their first points and the arguments of their last points */
+    using maxima_set_t = MaximaIndex<A, point_type, A, maximaSetComparator, maximumArgument, Allocator, Instrumentation>;
+
+    blocks_t blocks;
+    std::vector<A, allocator_for_t<A>> fences;//fences[i] is not greater than any argument stored in blocks[i + 1]
+    std::size_t points = 0;
+    maxima_set_t maxima_set;
+
+    std::size_t route(A const &a) const {
+        auto fence = std::upper_bound(fences.begin(), fences.end(), a, [](A const &x, A const &f) {
+            Instrumentation::argument_compared();
+            return x < f;
+        });
+        return static_cast<std::size_t>(fence - fences.begin());
+    }
+
+    /* makes room for one more element without giving up the geometric growth of the vector */
+    template<typename Vector>
+    static void reserve_one(Vector &vector) {
+        if (vector.size() == vector.capacity())
+            vector.reserve(2 * vector.size() + 1);
+    }
+
+    block_t make_block() const {
+        block_t block(get_allocator());
+        block.reserve(BlockSize);
+        return block;
+    }
+
+    /*
+     * Blocks are shifted by swapping: the move assignment of a block is not noexcept for every allocator
+     * (e.g. std::pmr), while swapping blocks with equal allocators only exchanges their buffers.
+     * insert_block needs room for one more block (see reserve_one).
+     */
+    void insert_block(std::size_t at, block_t &&block) noexcept {
+        blocks.push_back(std::move(block));
+        std::rotate(blocks.begin() + static_cast<std::ptrdiff_t>(at), blocks.end() - 1, blocks.end());
+    }
+
+    void erase_blocks(std::size_t first, std::size_t last) noexcept {
+        std::rotate(blocks.begin() + static_cast<std::ptrdiff_t>(first), blocks.begin() + static_cast<std::ptrdiff_t>(last),
+                    blocks.end());
+        for (std::size_t i = first; i < last; ++i)
+            blocks.pop_back();
+    }
+
+    /* merges blocks[left + 1] into blocks[left], unless that would need an allocation (then they stay apart) */
+    void merge_blocks(std::size_t left) noexcept {
+        auto &lhs = blocks[left];
+        auto &rhs = blocks[left + 1];
+        if (lhs.capacity() < lhs.size() + rhs.size())
+            return;
+        lhs.insert(lhs.end(), std::make_move_iterator(rhs.begin()), std::make_move_iterator(rhs.end()));
+        fences.erase(fences.begin() + left);
+        erase_blocks(left + 1, left + 2);
+    }
+
+public:
+    class position {
+    private:
+        friend class storage;
+
+        blocks_t const *blocks;
+        std::size_t block;
+        std::size_t offset;
+
+        position(blocks_t const *blocks, std::size_t block, std::size_t offset)
+                : blocks(blocks), block(block), offset(offset) {}
+
+    public:
+        using iterator_category = std::bidirectional_iterator_tag;
+        using value_type = point_type;
+        using pointer = const point_type *;
+        using reference = const point_type &;
+        using difference_type = std::ptrdiff_t;
+
+        position() : blocks(nullptr), block(0), offset(0) {}
+
+        point_type const &operator*() const noexcept {
+            return (*blocks)[block][offset];
+        }
+
+        point_type const *operator->() const noexcept {
+            return &(*blocks)[block][offset];
+        }
+
+        position &operator++() noexcept {
+            if (++offset == (*blocks)[block].size()) {
+                ++block;
+                offset = 0;
+            }
+            return *this;
+        }
+
+        position operator++(int) noexcept {
+            position p = *this;
+            ++*this;
+            return p;
+        }
+
+        position &operator--() noexcept {
+            if (offset == 0) {
+                --block;
+                offset = (*blocks)[block].size();
+            }
+            --offset;
+            return *this;
+        }
+
+        position operator--(int) noexcept {
+            position p = *this;
+            --*this;
+            return p;
+        }
+
+        bool operator==(const position &rhs) const noexcept {
+            return block == rhs.block && offset == rhs.offset;
+        }
+
+        bool operator!=(const position &rhs) const noexcept {
+            return !(*this == rhs);
+        }
+    };
+
+    /**
+     * Position of a single maximum: its run, its offset in the run and (for a maximum after the first one
+     * of its run) its position in the storage, which is looked up when the position enters a run.
+     * Valid until the storage is modified.
+     */
+    class mx_position {
+    private:
+        friend class storage;
+
+        storage const *owner = nullptr;
+        typename maxima_set_t::iterator run;
+        std::size_t offset = 0;
+        position point;
+
+        mx_position(storage const *owner, typename maxima_set_t::iterator run, std::size_t offset, position point)
+                : owner(owner), run(run), offset(offset), point(point) {}
+
+    public:
+        mx_position() = default;
+
+        mx_position &operator++() {
+            if (offset + 1 < maxima_set_t::length(run)) {
+                point = offset == 0 ? std::next(owner->lower_bound(run->entry.argument)) : std::next(point);
+                ++offset;
+            } else {
+                ++run;
+                offset = 0;
+            }
+            return *this;
+        }
+
+        mx_position &operator--() {
+            if (offset > 1) {
+                --point;
+                --offset;
+            } else if (offset == 1) {
+                offset = 0;
+            } else {
+                --run;
+                offset = maxima_set_t::length(run) - 1;
+                if (offset > 0)
+                    point = owner->lower_bound(run->tail);
+            }
+            return *this;
+        }
+
+        bool operator==(const mx_position &rhs) const noexcept {
+            return run == rhs.run && offset == rhs.offset;
+        }
+
+        bool operator!=(const mx_position &rhs) const noexcept {
+            return !(*this == rhs);
+        }
+    };
+
+    /* position of a single maximum in the argument order: its run in that order and its position in the storage */
+    class mx_argument_position {
+    private:
+        friend class storage;
+
+        storage const *owner = nullptr;
+        typename maxima_set_t::argument_iterator run;
+        position point;
+
+        mx_argument_position(storage const *owner, typename maxima_set_t::argument_iterator run, position point)
+                : owner(owner), run(run), point(point) {}
+
+    public:
+        mx_argument_position() = default;
+
+        mx_argument_position &operator++() {
+            if (point->argument < (*run)->tail) {
+                ++point;
+            } else {
+                ++run;
+                point = run != owner->maxima_set.argument_end() ? owner->lower_bound((*run)->entry.argument)
+                                                                : owner->end();
+            }
+            return *this;
+        }
+
+        mx_argument_position &operator--() {
+            if (run != owner->maxima_set.argument_end() && (*run)->entry.argument < point->argument) {
+                --point;
+            } else {
+                --run;
+                point = owner->lower_bound((*run)->tail);
+            }
+            return *this;
+        }
+
+        bool operator==(const mx_argument_position &rhs) const noexcept {
+            return run == rhs.run && point == rhs.point;
+        }
+
+        bool operator!=(const mx_argument_position &rhs) const noexcept {
+            return !(*this == rhs);
+        }
+    };
+
+    using staged_value = V;
+
+    /* the maxima index keeps runs of maxima, see NodeStorage */
+    static constexpr bool run_length = true;
+    using mx_run = typename maxima_set_t::iterator;
+    using mx_run_cursor = typename maxima_set_t::argument_iterator;
+    using mx_tail = A;
+
+    storage() : storage(Allocator()) {}
+
+    explicit storage(const Allocator &alloc) : blocks(alloc), fences(alloc), maxima_set(alloc) {}
+
+    storage(const storage &other)
+            : storage(other, std::allocator_traits<Allocator>::select_on_container_copy_construction(
+            other.get_allocator())) {}
+
+    /* every copied block gets the full BlockSize capacity, so merge_blocks never allocates */
+    storage(const storage &other, const Allocator &alloc)
+            : blocks(alloc), fences(other.fences, alloc), points(other.points), maxima_set(other.maxima_set, alloc) {
+        blocks.reserve(other.blocks.size());
+        for (auto const &block : other.blocks) {
+            blocks.push_back(make_block());
+            blocks.back().insert(blocks.back().end(), block.begin(), block.end());
+        }
+    }
+
+    storage &operator=(const storage &other) = delete;
+
+    Allocator get_allocator() const noexcept {
+        return fences.get_allocator();
+    }
+
+    static A const &arg(position p) noexcept {
+        return p->argument;
+    }
+
+    static V const &value(position p) noexcept {
+        return p->val;
+    }
+
+    static point_type const &point(position p) noexcept {
+        return *p;
+    }
+
+    static point_type const &mx_point(const mx_position &m) noexcept {
+        return m.offset == 0 ? m.run->entry : *m.point;
+    }
+
+    static point_type const &mx_argument_point(const mx_argument_position &m) noexcept {
+        return *m.point;
+    }
+
+    static V const &staged(const staged_value &s) noexcept {
+        return s;
+    }
+
+    /* copy of the point at p with the staged value s */
+    static point_type staged_point(position p, const staged_value &s) {
+        return point_type(p->argument, s);
+    }
+
+    position begin() const noexcept {
+        return position(&blocks, 0, 0);
+    }
+
+    position end() const noexcept {
+        return position(&blocks, blocks.size(), 0);
+    }
+
+    position lower_bound(A const &a) const {
+        if (blocks.empty())
+            return end();
+        std::size_t b = route(a);
+        auto &block = blocks[b];
+        auto lower = std::lower_bound(block.begin(), block.end(), a, [](const point_type &p, A const &x) {
+            Instrumentation::argument_compared();
+            return p.argument < x;
+        });
+        if (lower == block.end())
+            return position(&blocks, b + 1, 0);
+        return position(&blocks, b, static_cast<std::size_t>(lower - block.begin()));
+    }
+
+    position find(A const &a) const {
+        auto lower = lower_bound(a);
+        if (lower != end() && !(a < lower->argument))
+            return lower;
+        return end();
+    }
+
+    std::size_t size() const noexcept {
+        return points;
+    }
+
+    /* walks the sizes of the blocks: O(n / BlockSize) */
+    position nth(std::size_t k) const noexcept {
+        if (k >= points)
+            return end();
+        std::size_t b = 0;
+        while (k >= blocks[b].size()) {
+            k -= blocks[b].size();
+            ++b;
+        }
+        return position(&blocks, b, k);
+    }
+
+    /* walks the sizes of the blocks: O(log n + n / BlockSize) */
+    std::size_t rank(A const &a) const {
+        auto lower = lower_bound(a);
+        std::size_t result = lower.offset;
+        for (std::size_t b = 0; b < lower.block; ++b)
+            result += blocks[b].size();
+        return result;
+    }
+
+    /* number of points from p to q (not before p), walks the sizes of the blocks between them */
+    std::size_t distance(position p, position q) const noexcept {
+        if (p.block == q.block)
+            return q.offset - p.offset;
+        std::size_t result = blocks[p.block].size() - p.offset + q.offset;
+        for (std::size_t b = p.block + 1; b < q.block; ++b)
+            result += blocks[b].size();
+        return result;
+    }
+
+    /* the position k points after p, walks the sizes of the blocks */
+    position advance(position p, std::size_t k) const noexcept {
+        std::size_t b = p.block;
+        k += p.offset;
+        while (b < blocks.size() && k >= blocks[b].size()) {
+            k -= blocks[b].size();
+            ++b;
+        }
+        return position(&blocks, b, k);
+    }
+
+    mx_position mx_begin() const noexcept {
+        return mx_position(this, maxima_set.begin(), 0, position());
+    }
+
+    mx_position mx_end() const noexcept {
+        return mx_position(this, maxima_set.end(), 0, position());
+    }
+
+    std::size_t mx_size() const noexcept {
+        return maxima_set.size();
+    }
+
+    mx_position mx_nth(std::size_t k) const {
+        auto at = maxima_set.nth(k);
+        if (at.second == 0)
+            return mx_position(this, at.first, 0, position());
+        return mx_position(this, at.first, at.second, advance(lower_bound(at.first->entry.argument), at.second));
+    }
+
+    /* the maxima of the runs ordered before p and the maxima before p in the run of equal value reaching p */
+    std::size_t mx_rank(point_type const &p) const {
+        auto run = maxima_set.lower_bound(maxima_key_t{p.val, p.argument});
+        if (run == maxima_set.begin())
+            return 0;
+        --run;
+        std::size_t before = maxima_set.rank(run);
+        if (p.val < run->entry.val || run->tail < p.argument)
+            return before + maxima_set_t::length(run);
+        return before + distance(lower_bound(run->entry.argument), lower_bound(p.argument));
+    }
+
+    mx_argument_position mx_argument_lower_bound(A const &a) const {
+        auto run = maxima_set.argument_upper_bound(a);
+        if (run != maxima_set.argument_begin()) {
+            auto reaching = std::prev(run);
+            if (!((*reaching)->tail < a))
+                return mx_argument_position(this, reaching, lower_bound(a));
+        }
+        return mx_argument_at(run);
+    }
+
+    mx_argument_position mx_argument_upper_bound(A const &a) const {
+        auto run = maxima_set.argument_upper_bound(a);
+        if (run != maxima_set.argument_begin()) {
+            auto reaching = std::prev(run);
+            if (a < (*reaching)->tail) {
+                auto upper = lower_bound(a);
+                if (upper != end() && !(a < upper->argument))
+                    ++upper;
+                return mx_argument_position(this, reaching, upper);
+            }
+        }
+        return mx_argument_at(run);
+    }
+
+    mx_argument_position mx_argument_begin() const {
+        return mx_argument_at(maxima_set.argument_begin());
+    }
+
+    /* the first maximum of the run at run in the argument order */
+    mx_argument_position mx_argument_at(mx_run_cursor run) const {
+        return mx_argument_position(this, run, run != maxima_set.argument_end() ? lower_bound((*run)->entry.argument)
+                                                                               : end());
+    }
+
+    mx_run mx_run_end() const noexcept {
+        return maxima_set.end();
+    }
+
+    mx_run_cursor mx_runs_end() const noexcept {
+        return maxima_set.argument_end();
+    }
+
+    /* the first run in the argument order that does not end before p */
+    mx_run_cursor mx_runs_from(position p) const {
+        auto run = maxima_set.argument_upper_bound(p->argument);
+        if (run != maxima_set.argument_begin() && !mx_run_ends_before(*std::prev(run), p))
+            --run;
+        return run;
+    }
+
+    /* the run whose first maximum in the argument order is not before a */
+    mx_run_cursor mx_runs_starting_from(A const &a) const {
+        return maxima_set.argument_lower_bound(a);
+    }
+
+    static bool mx_run_ends_before(mx_run run, position p) {
+        Instrumentation::argument_compared();
+        return run->tail < p->argument;
+    }
+
+    static bool mx_run_starts_after(mx_run run, position p) {
+        Instrumentation::argument_compared();
+        return p->argument < run->entry.argument;
+    }
+
+    /* p is a point of the run */
+    static bool mx_run_starts_at(mx_run run, position p) {
+        Instrumentation::argument_compared();
+        return !(run->entry.argument < p->argument);
+    }
+
+    static std::size_t mx_run_length(mx_run run) noexcept {
+        return maxima_set_t::length(run);
+    }
+
+    static A const &mx_run_last_argument(mx_run run) noexcept {
+        return run->tail;
+    }
+
+    /* number of maxima of the run after its point p */
+    std::size_t mx_run_members_after(mx_run run, position p) const {
+        return distance(p, lower_bound(run->tail));
+    }
+
+    static mx_tail mx_run_tail(mx_run run) {
+        return run->tail;
+    }
+
+    static mx_tail mx_tail_at(position p) {
+        return p->argument;
+    }
+
+    /* a run from p to the point with the argument tail, with the value s (unless it is null) */
+    void mx_run_insert(position p, const staged_value *s, mx_tail tail, std::size_t length) {
+        maxima_set.insert(s != nullptr ? point_type(p->argument, *s) : *p, std::move(tail), length);
+    }
+
+    /* reuses a run that is erased otherwise for a new run at p, see MaximaIndex::rekey */
+    void mx_run_rekey(mx_run run, position p, const staged_value *s, mx_tail tail, std::size_t length) {
+        maxima_set.rekey(run, s != nullptr ? point_type(p->argument, *s) : *p, std::move(tail), length);
+    }
+
+    void mx_run_resize(mx_run run, mx_tail tail, std::size_t length) {
+        maxima_set.resize(run, std::move(tail), length);
+    }
+
+    void mx_run_erase(mx_run run) {
+        maxima_set.erase(run);
+    }
+
+    void mx_commit() noexcept {
+        maxima_set.commit();
+    }
+
+    void mx_rollback() noexcept {
+        maxima_set.rollback();
+    }
+
+    void mx_join(mx_run left, mx_run right) noexcept {
+        maxima_set.join(left, right);
+    }
+
+    /* the run containing the maximum at p */
+    mx_run mx_run_at(position p) const {
+        auto run = mx_runs_from(p);
+        if (run == maxima_set.argument_end() || mx_run_starts_after(*run, p))
+            return maxima_set.end();
+        return *run;
+    }
+
+    /* the last maximum of the run of first */
+    mx_position mx_run_last(const mx_position &first) const {
+        auto run = first.run;
+        std::size_t offset = maxima_set_t::length(run) - 1;
+        return mx_position(this, run, offset, offset == 0 ? position() : lower_bound(run->tail));
+    }
+
+    /* the number of maxima in the run of first */
+    static std::size_t mx_run_size(const mx_position &first) noexcept {
+        return maxima_set_t::length(first.run);
+    }
+
+    /**
+     * @brief Inserts a point at the place pointed by hint (a result of lower_bound for the same argument)
+     * Strong exception safety: everything that may throw (copies, allocations) happens before
+     * the blocks are touched, the rest only moves points around.
+     */
+    template<typename AA, typename VV>
+    position insert(position hint, AA &&a, VV &&v) {
+        point_type fresh(std::forward<AA>(a), std::forward<VV>(v));
+        if (blocks.empty()) {
+            block_t block = make_block();
+            block.push_back(std::move(fresh));
+            blocks.push_back(std::move(block));
+            ++points;
+            return begin();
+        }
+        std::size_t b = hint.block;
+        std::size_t offset = hint.offset;
+        if (b == blocks.size() || (offset == 0 && b > 0 && fresh.argument < fences[b - 1])) {
+            --b;
+            offset = blocks[b].size();
+        }
+        if (blocks[b].size() == BlockSize) {
+            //the block is split at the new point, so the points before it stay where they were
+            block_t upper = make_block();                  //These lines may throw an exception
+            reserve_one(fences);                           //
+            reserve_one(blocks);                           //
+            if (offset == BlockSize) {                     //
+                A fence(fresh.argument);                   //
+                upper.push_back(std::move(fresh));              //These lines are noexcept
+                fences.insert(fences.begin() + b, std::move(fence));
+                insert_block(b + 1, std::move(upper));
+                ++points;
+                return position(&blocks, b + 1, 0);
+            }
+            A fence(blocks[b][offset].argument);           //
+            auto &lower = blocks[b];                            //These lines are noexcept
+            upper.insert(upper.end(), std::make_move_iterator(lower.begin() + offset),
+                         std::make_move_iterator(lower.end()));
+            lower.erase(lower.begin() + offset, lower.end());
+            fences.insert(fences.begin() + b, std::move(fence));
+            insert_block(b + 1, std::move(upper));
+        }
+        auto &block = blocks[b];
+        block.insert(block.begin() + offset, std::move(fresh));
+        ++points;
+        return position(&blocks, b, offset);
+    }
+
+    /**
+     * @brief Appends a point greater than every point already stored
+     * Fills the last block up to BlockSize instead of splitting it.
+     */
+    template<typename AA, typename VV>
+    position push_back(AA &&a, VV &&v) {
+        point_type fresh(std::forward<AA>(a), std::forward<VV>(v));
+        if (blocks.empty() || blocks.back().size() == BlockSize) {
+            block_t block = make_block();                  //These lines may throw an exception
+            reserve_one(blocks);                           //
+            if (!blocks.empty()) {                         //
+                reserve_one(fences);                       //
+                fences.push_back(fresh.argument);          //
+            }
+            block.push_back(std::move(fresh));              //These lines are noexcept
+            blocks.push_back(std::move(block));             //
+        } else {
+            blocks.back().push_back(std::move(fresh));
+        }
+        ++points;
+        return position(&blocks, blocks.size() - 1, blocks.back().size() - 1);
+    }
+
+    void erase(position p) noexcept {
+        std::size_t b = p.block;
+        auto &block = blocks[b];
+        block.erase(block.begin() + p.offset);
+        --points;
+        if (block.empty()) {
+            if (blocks.size() == 1) {
+                blocks.clear();
+                return;
+            }
+            fences.erase(fences.begin() + (b == 0 ? 0 : b - 1));
+            erase_blocks(b, b + 1);
+        } else if (block.size() < BlockSize / 4 && b + 1 < blocks.size() &&
+                   block.size() + blocks[b + 1].size() <= BlockSize / 2) {
+            merge_blocks(b);//only the following points move
+        }
+    }
+
+    /* erases the points before last: the blocks before the block of last are dropped as a whole */
+    void erase_prefix(position last) noexcept {
+        std::size_t b = last.block;
+        if (b == blocks.size()) {
+            blocks.clear();
+            fences.clear();
+            points = 0;
+            return;
+        }
+        for (std::size_t i = 0; i < b; ++i)
+            points -= blocks[i].size();
+        points -= last.offset;
+        auto &block = blocks[b];
+        block.erase(block.begin(), block.begin() + last.offset);
+        fences.erase(fences.begin(), fences.begin() + b);
+        erase_blocks(0, b);
+        if (blocks[0].size() < BlockSize / 4 && blocks.size() > 1 &&
+            blocks[0].size() + blocks[1].size() <= BlockSize / 2)
+            merge_blocks(0);
+    }
+
+    /**
+     * Moves the points from first on and their maxima to the empty rest (with an equal allocator).
+     * Whole blocks are moved, only the points after first in its block move to a new block.
+     * Strong exception safety, maxima positions stay valid.
+     */
+    void split_off(position first, storage &rest) {
+        if (first == end())
+            return;
+        std::size_t b = first.block;
+        bool cut = first.offset != 0;
+        blocks_t moved_blocks(get_allocator());                         //These lines may throw an exception
+        moved_blocks.reserve(blocks.size() - b);                        //
+        std::vector<A, allocator_for_t<A>> moved_fences(get_allocator());
+        moved_fences.reserve(blocks.size() - b);                        //
+        block_t upper = cut ? make_block() : block_t(get_allocator());  //
+        maxima_set.split_off(first->argument, rest.maxima_set);         //
+        std::size_t kept = first.offset;                                    //These lines are noexcept
+        for (std::size_t i = 0; i < b; ++i)
+            kept += blocks[i].size();
+        if (cut) {
+            auto &lower = blocks[b];
+            upper.insert(upper.end(), std::make_move_iterator(lower.begin() + first.offset),
+                         std::make_move_iterator(lower.end()));
+            lower.erase(lower.begin() + first.offset, lower.end());
+            moved_blocks.push_back(std::move(upper));
+        }
+        for (std::size_t i = b + cut; i < blocks.size(); ++i)
+            moved_blocks.push_back(std::move(blocks[i]));
+        for (std::size_t i = b; i < fences.size(); ++i)
+            moved_fences.push_back(std::move(fences[i]));
+        blocks.erase(blocks.begin() + static_cast<std::ptrdiff_t>(b + cut), blocks.end());
+        std::size_t kept_fences = blocks.empty() ? 0 : blocks.size() - 1;
+        fences.erase(fences.begin() + static_cast<std::ptrdiff_t>(kept_fences), fences.end());
+        rest.blocks.swap(moved_blocks);
+        rest.fences.swap(moved_fences);
+        rest.points = points - kept;
+        points = kept;
+    }
+
+    /**
+     * Moves all points of other (with an equal allocator) and their maxima right before gap.
+     * The arguments of other must lie between the arguments around gap. The blocks of other are moved
+     * as a whole, only the block of gap is divided. Strong exception safety, maxima positions stay valid.
+     */
+    void splice(position gap, storage &other) {
+        if (other.points == 0)
+            return;
+        std::size_t b = gap.block;
+        bool cut = gap.offset != 0;
+        std::size_t before = b + cut;//blocks which end up before the blocks of other
+        std::size_t capacity = blocks.size() + other.blocks.size() + cut;
+        blocks_t spliced(get_allocator());                                          //These lines may throw
+        spliced.reserve(capacity);                                                  //
+        std::vector<A, allocator_for_t<A>> spliced_fences(get_allocator());         //
+        spliced_fences.reserve(capacity);                                           //
+        block_t upper = cut ? make_block() : block_t(get_allocator());              //
+        std::optional<A> front_fence;                                               //
+        std::optional<A> back_fence;                                                //
+        if (before > 0)                                                             //
+            front_fence.emplace(other.blocks.front().front().argument);             //
+        if (b < blocks.size())                                                      //
+            back_fence.emplace(blocks[b][gap.offset].argument);                     //
+        maxima_set.splice(other.maxima_set);                                        //
+        for (std::size_t i = 0; i < b; ++i)                                             //These lines are noexcept
+            spliced.push_back(std::move(blocks[i]));
+        if (cut) {
+            auto &lower = blocks[b];
+            upper.insert(upper.end(), std::make_move_iterator(lower.begin() + gap.offset),
+                         std::make_move_iterator(lower.end()));
+            lower.erase(lower.begin() + gap.offset, lower.end());
+            spliced.push_back(std::move(lower));
+        }
+        for (auto &block : other.blocks)
+            spliced.push_back(std::move(block));
+        if (cut)
+            spliced.push_back(std::move(upper));
+        for (std::size_t i = before; i < blocks.size(); ++i)
+            spliced.push_back(std::move(blocks[i]));
+        for (std::size_t i = 0; i + 1 < before; ++i)
+            spliced_fences.push_back(std::move(fences[i]));
+        if (front_fence)
+            spliced_fences.push_back(std::move(*front_fence));
+        for (auto &fence : other.fences)
+            spliced_fences.push_back(std::move(fence));
+        if (back_fence)
+            spliced_fences.push_back(std::move(*back_fence));
+        for (std::size_t i = b; i < fences.size(); ++i)
+            spliced_fences.push_back(std::move(fences[i]));
+        blocks.swap(spliced);
+        fences.swap(spliced_fences);
+        points += other.points;
+        other.blocks.clear();
+        other.fences.clear();
+        other.points = 0;
+    }
+
+    /* replaces the maxima index with maxima given by increasing argument, see MaximaIndex::assign */
+    void mx_assign(const std::vector<position> &maxima, std::vector<std::size_t> order = {}) {
+        maxima_set.assign(maxima, std::move(order), [](position p) {
+            return *p;
+        }, [](position p) {
+            return p->argument;
+        });
+    }
+
+    /* erases the runs before last in the argument order, returns the number of their maxima */
+    std::size_t mx_erase_before(mx_run_cursor last) noexcept {
+        return maxima_set.erase_before(last);
+    }
+
+    template<typename VV>
+    staged_value stage(VV &&v) const {
+        return std::forward<VV>(v);
+    }
+
+    void commit(position p, staged_value &s) noexcept {
+        blocks[p.block][p.offset].val = std::move(s);
+    }
+
+    void swap(storage &other) noexcept {
+        blocks.swap(other.blocks);
+        fences.swap(other.fences);
+        std::swap(points, other.points);
+        maxima_set.swap(other.maxima_set);
+    }
+};
+
+template<typename A, typename V, typename Allocator, typename Instrumentation>
+class PersistentStorage::storage {
+public:
+    static constexpr bool persistent = true;
+
+    class point_type {
+    private:
+        friend class storage;
+
+        std::shared_ptr<const A> argument_pointer;
+        std::shared_ptr<const V> value_pointer;//does not take part in ordering of the points
+
+        point_type(std::shared_ptr<const A> argument_ptr, std::shared_ptr<const V> value_ptr)
+                : argument_pointer(std::move(argument_ptr)), value_pointer(std::move(value_ptr)) {}
+
+    public:
+        point_type() = delete;
+
+        A const &arg() const noexcept {
+            return *argument_pointer;
+        }
+
+        V const &value() const noexcept {
+            return *value_pointer;
+        }
+    };
+
+private:
+    struct argumentComparator {
+        using is_transparent = std::true_type;
+
+        bool operator()(const point_type &lhs, const point_type &rhs) const {
+            Instrumentation::argument_compared();
+            return *(lhs.argument_pointer) < *(rhs.argument_pointer);
+        }
+
+        bool operator()(const point_type &lhs, const A &rhs) const {
+            Instrumentation::argument_compared();
+            return *(lhs.argument_pointer) < rhs;
+        }
+
+        bool operator()(const A &lhs, const point_type &rhs) const {
+            Instrumentation::argument_compared();
+            return lhs < *(rhs.argument_pointer);
+        }
+
+    };
+
+    struct maximaSetComparator {
+        bool operator()(const point_type &lhs, const point_type &rhs) const {
+            Instrumentation::maxima_compared();
+            return maxima_order_less(*(lhs.value_pointer), *(lhs.argument_pointer),
+                                     *(rhs.value_pointer), *(rhs.argument_pointer));
+        }
+
+    };
+
+    /* while a value is being replaced the old and the new maximum of a point coexist, the value tells them apart */
+    struct maximumArgumentComparator {
+        using is_transparent = std::true_type;
+
+        bool operator()(const point_type &lhs, const point_type &rhs) const {
+            Instrumentation::argument_compared();
+            if (*(lhs.argument_pointer) < *(rhs.argument_pointer))
+                return true;
+            if (*(rhs.argument_pointer) < *(lhs.argument_pointer))
+                return false;
+            return *(rhs.value_pointer) < *(lhs.value_pointer);
+        }
+
+        bool operator()(const point_type &lhs, const A &rhs) const {
+            Instrumentation::argument_compared();
+            return *(lhs.argument_pointer) < rhs;
+        }
+
+        bool operator()(const A &lhs, const point_type &rhs) const {
+            Instrumentation::argument_compared();
+            return lhs < *(rhs.argument_pointer);
+        }
+
+    };
+
+    using values_map_t = PersistentSet<point_type, argumentComparator, Allocator>;
+    using maxima_set_t = PersistentSet<point_type, maximaSetComparator, Allocator>;
+    using maxima_arguments_t = PersistentSet<point_type, maximumArgumentComparator, Allocator>;
+    values_map_t function_map;
+    maxima_set_t maxima_set;
+    maxima_arguments_t maxima_arguments;
+
+    template<typename T, typename U = T>
+    std::shared_ptr<const T> make_pointer(U &&u) const {
+        using pointer_allocator_t = typename std::allocator_traits<Allocator>::template rebind_alloc<T>;
+        return std::allocate_shared<T>(pointer_allocator_t(get_allocator()), std::forward<U>(u));
+    }
+
+    typename maxima_set_t::const_iterator add_maximum(const point_type &max) {
+        maxima_arguments_t arguments(maxima_arguments, maxima_arguments.get_allocator());
+        arguments.insert(max);
+        auto inserted = maxima_set.insert(max).first;
+        maxima_arguments.swap(arguments);
+        return inserted;
+    }
+
+public:
+    using position = typename values_map_t::const_iterator;
+    using mx_position = typename maxima_set_t::const_iterator;
+    using mx_argument_position = typename maxima_arguments_t::const_iterator;
+    using staged_value = std::shared_ptr<const V>;
+
+    /* the maxima index keeps every maximum on its own, so the cursors of mx_erase_before are its positions */
+    static constexpr bool run_length = false;
+    using mx_run = mx_position;
+    using mx_run_cursor = mx_argument_position;
+
+    storage() : storage(Allocator()) {}
+
+    explicit storage(const Allocator &alloc) : function_map(alloc), maxima_set(alloc), maxima_arguments(alloc) {}
+
+    storage(const storage &other)
+            : storage(other, std::allocator_traits<Allocator>::select_on_container_copy_construction(
+            other.get_allocator())) {}
+
+    /* O(1), the copy shares all nodes, arguments and values with other */
+    storage(const storage &other, const Allocator &alloc)
+            : function_map(other.function_map, alloc), maxima_set(other.maxima_set, alloc),
+              maxima_arguments(other.maxima_arguments, alloc) {}
+
+    storage &operator=(const storage &other) = delete;
+
+    Allocator get_allocator() const noexcept {
+        return function_map.get_allocator();
+    }
+
+    static A const &arg(const position &p) noexcept {
+        return *(p->argument_pointer);
+    }
+
+    static V const &value(const position &p) noexcept {
+        return *(p->value_pointer);
+    }
+
+    static point_type const &point(const position &p) noexcept {
+        return *p;
+    }
+
+    static point_type const &mx_point(const mx_position &m) noexcept {
+        return *m;
+    }
+
+    static point_type const &mx_argument_point(const mx_argument_position &m) noexcept {
+        return *m;
+    }
+
+    static V const &staged(const staged_value &s) noexcept {
+        return *s;
+    }
+
+    /* copy of the point at p with the staged value s */
+    static point_type staged_point(const position &p, const staged_value &s) {
+        return point_type(p->argument_pointer, s);
+    }
+
+    position begin() const noexcept {
+        return function_map.begin();
+    }
+
+    position end() const noexcept {
+        return function_map.end();
+    }
+
+    position find(A const &a) const {
+        return function_map.find(a);
+    }
+
+    position lower_bound(A const &a) const {
+        return function_map.lower_bound(a);
+    }
+
+    std::size_t size() const noexcept {
+        return function_map.size();
+    }
+
+    position nth(std::size_t k) const noexcept {
+        return function_map.nth(k);
+    }
+
+    std::size_t rank(A const &a) const {
+        return function_map.rank(function_map.lower_bound(a));
+    }
+
+    mx_position mx_begin() const noexcept {
+        return maxima_set.begin();
+    }
+
+    mx_position mx_end() const noexcept {
+        return maxima_set.end();
+    }
+
+    mx_position mx_find(const position &p) const {
+        return maxima_set.find(*p);
+    }
+
+    std::size_t mx_size() const noexcept {
+        return maxima_set.size();
+    }
+
+    mx_position mx_nth(std::size_t k) const noexcept {
+        return maxima_set.nth(k);
+    }
+
+    std::size_t mx_rank(point_type const &p) const {
+        return maxima_set.rank(maxima_set.lower_bound(p));
+    }
+
+    mx_argument_position mx_argument_lower_bound(A const &a) const {
+        return maxima_arguments.lower_bound(a);
+    }
+
+    mx_argument_position mx_argument_upper_bound(A const &a) const {
+        return maxima_arguments.upper_bound(a);
+    }
+
+    mx_argument_position mx_argument_begin() const noexcept {
+        return maxima_arguments.begin();
+    }
+
+    template<typename AA, typename VV>
+    position insert(const position &, AA &&a, VV &&v) {
+        return function_map.insert(point_type(make_pointer<A>(std::forward<AA>(a)),
+                                              make_pointer<V>(std::forward<VV>(v)))).first;
+    }
+
+    template<typename AA, typename VV>
+    position push_back(AA &&a, VV &&v) {
+        return insert(end(), std::forward<AA>(a), std::forward<VV>(v));
+    }
+
+    void erase(const position &p) {
+        function_map.erase(*p);
+    }
+
+    void erase_prefix(const position &last) {
+        function_map.erase_prefix(last);
+    }
+
+    /**
+     * Moves the points from first on and their maxima to the empty rest, sharing all of them.
+     * O(log n) for the points and the maxima by argument. The maxima order loses the k maxima of the smaller
+     * part one by one, O(k log m), unless rebuilding both parts in O(m) is cheaper.
+     */
+    void split_off(const position &first, storage &rest) {
+        if (first == end())
+            return;
+        A const &a = arg(first);
+        maxima_arguments_t kept_arguments(maxima_arguments, get_allocator());
+        maxima_arguments_t moved_arguments(get_allocator());
+        kept_arguments.split_off(kept_arguments.lower_bound(a), moved_arguments);
+        maxima_set_t kept_maxima(get_allocator());
+        maxima_set_t moved_maxima(get_allocator());
+        bool move_rest = moved_arguments.size() <= kept_arguments.size();
+        auto &smaller = move_rest ? moved_arguments : kept_arguments;
+        if (smaller.size() * balanced_depth(maxima_set.size()) > maxima_set.size()) {
+            std::vector<point_type> kept;
+            std::vector<point_type> moved;
+            for (auto &max : maxima_set) {
+                Instrumentation::argument_compared();
+                (*(max.argument_pointer) < a ? kept : moved).push_back(max);
+            }
+            kept_maxima.assign(kept);
+            moved_maxima.assign(moved);
+        } else {
+            std::vector<point_type> taken(smaller.begin(), smaller.end());
+            maxima_set_t left(maxima_set, get_allocator());
+            for (auto &max : taken)
+                left.erase(max);
+            std::sort(taken.begin(), taken.end(), maximaSetComparator());
+            (move_rest ? kept_maxima : moved_maxima).swap(left);
+            (move_rest ? moved_maxima : kept_maxima).assign(taken);
+        }
+        values_map_t kept_points(function_map, get_allocator());
+        values_map_t moved_points(get_allocator());
+        kept_points.split_off(first, moved_points);
+        function_map.swap(kept_points);
+        maxima_set.swap(kept_maxima);
+        maxima_arguments.swap(kept_arguments);
+        rest.function_map.swap(moved_points);
+        rest.maxima_set.swap(moved_maxima);
+        rest.maxima_arguments.swap(moved_arguments);
+    }
+
+    /**
+     * Moves all points of other and their maxima right before gap, sharing all of them.
+     * The arguments of other must lie between the arguments around gap.
+     * O(log n) for the points and the maxima by argument. The k maxima of the smaller storage are inserted
+     * into the maxima order of the larger one, O(k log m), unless merging both in O(m) is cheaper.
+     */
+    void splice(const position &gap, storage &other) {
+        if (other.size() == 0)
+            return;
+        bool into_this = other.maxima_set.size() <= maxima_set.size();
+        maxima_set_t &smaller = into_this ? other.maxima_set : maxima_set;
+        maxima_set_t merged_maxima(into_this ? maxima_set : other.maxima_set, get_allocator());
+        if (smaller.size() * balanced_depth(merged_maxima.size()) > smaller.size() + merged_maxima.size()) {
+            std::vector<point_type> merged;
+            merged.reserve(maxima_set.size() + other.maxima_set.size());
+            std::merge(maxima_set.begin(), maxima_set.end(), other.maxima_set.begin(), other.maxima_set.end(),
+                       std::back_inserter(merged), maximaSetComparator());
+            maxima_set_t(get_allocator()).swap(merged_maxima);
+            merged_maxima.assign(merged);
+        } else {
+            for (auto &max : smaller)
+                merged_maxima.insert(max);
+        }
+        maxima_arguments_t arguments(maxima_arguments, get_allocator());
+        maxima_arguments_t other_arguments(other.maxima_arguments, get_allocator());
+        arguments.splice(arguments.lower_bound(arg(other.begin())), other_arguments);
+        values_map_t points(function_map, get_allocator());
+        values_map_t other_points(other.function_map, get_allocator());
+        points.splice(gap, other_points);
+        function_map.swap(points);
+        maxima_set.swap(merged_maxima);
+        maxima_arguments.swap(arguments);
+        storage emptied(other.get_allocator());
+        other.swap(emptied);
+    }
+
+    mx_position mx_insert(const position &p) {
+        return add_maximum(*p);
+    }
+
+    mx_position mx_insert(const position &p, const staged_value &s) {
+        return add_maximum(point_type(p->argument_pointer, s));
+    }
+
+    /* replaces the maxima index with maxima given by increasing argument, see MaximaIndex::assign */
+    void mx_assign(const std::vector<position> &maxima, const std::vector<std::size_t> &order = {}) {
+        std::vector<point_type> entries;
+        entries.reserve(maxima.size());
+        for (auto &p : maxima)
+            entries.push_back(*p);
+        maxima_arguments_t arguments(get_allocator());
+        arguments.assign(entries);
+        if (order.empty()) {
+            std::sort(entries.begin(), entries.end(), maximaSetComparator());
+        } else {
+            std::vector<point_type> ordered;
+            ordered.reserve(entries.size());
+            for (auto i : order)
+                ordered.push_back(entries[i]);
+            entries.swap(ordered);
+        }
+        maxima_set.assign(entries);
+        maxima_arguments.swap(arguments);
+    }
+
+    void mx_erase(const mx_position &m) {
+        maxima_arguments_t arguments(maxima_arguments, maxima_arguments.get_allocator());
+        arguments.erase(*m);
+        maxima_set.erase(*m);
+        maxima_arguments.swap(arguments);
+    }
+
+    /* the first maximum in the argument order whose argument is not less than a */
+    mx_run_cursor mx_runs_starting_from(A const &a) const {
+        return maxima_arguments.lower_bound(a);
+    }
+
+    /* erases the maxima before last in the argument order, returns their number */
+    std::size_t mx_erase_before(const mx_argument_position &last) {
+        maxima_set_t maxima(maxima_set, maxima_set.get_allocator());
+        std::size_t erased = 0;
+        for (auto max = maxima_arguments.begin(); max != last; ++max, ++erased)
+            maxima.erase(*max);
+        maxima_arguments.erase_prefix(last);
+        maxima_set.swap(maxima);
+        return erased;
+    }
+
+    template<typename VV>
+    staged_value stage(VV &&v) const {
+        return make_pointer<V>(std::forward<VV>(v));
+    }
+
+    /* every modification of the index is done at once, there is no journal to end */
+    void mx_commit() noexcept {
+    }
+
+    void mx_rollback() noexcept {
+    }
+
+    void commit(const position &p, staged_value &s) {
+        function_map.replace(point_type(p->argument_pointer, std::move(s)));
+    }
+
+    void swap(storage &other) noexcept {
+        function_map.swap(other.function_map);
+        maxima_set.swap(other.maxima_set);
+        maxima_arguments.swap(other.maxima_arguments);
+    }
+};
+
+/**
+ * Codec of FunctionMaxima::save and load for trivially copyable types, it writes the bytes of T as they are,
+ * so a file may be read only where T has the same representation. A codec of any other type provides
+ * the same write(out, t) and read(in) members; read throws InvalidArg if the stream ends.
+ */
+template<typename T>
+struct BinaryCodec {
+    static_assert(std::is_trivially_copyable<T>::value, "BinaryCodec requires a trivially copyable type");
+
+    void write(std::ostream &out, const T &t) const {
+        out.write(reinterpret_cast<const char *>(&t), sizeof(T));
+    }
+
+    /* T need not be default constructible */
+    T read(std::istream &in) const {
+        alignas(T) unsigned char bytes[sizeof(T)];
+        if (!in.read(reinterpret_cast<char *>(bytes), sizeof(T)))
+            throw InvArg;
+        return *std::launder(reinterpret_cast<const T *>(bytes));
+    }
+};
+
+/**
+ * Layout of the files written by FunctionMaxima::save: magic, version, the number of points n, n points
+ * (argument and value written by the codecs) by increasing argument, the number of maxima m and the indices
+ * of the m maxima among the points, in the order of the maxima index. Numbers take 8 bytes, little endian.
+ */
+struct MaximaFormat {
+    static constexpr char magic[4] = {'F', 'M', 'X', '1'};
+
+    static void write_number(std::ostream &out, std::uint64_t n) {
+        char bytes[8];
+        for (auto &byte : bytes) {
+            byte = static_cast<char>(n & 0xff);
+            n >>= 8;
+        }
+        out.write(bytes, sizeof(bytes));
+    }
+
+    static std::uint64_t read_number(std::istream &in) {
+        unsigned char bytes[8];
+        if (!in.read(reinterpret_cast<char *>(bytes), sizeof(bytes)))
+            throw InvArg;
+        std::uint64_t n = 0;
+        for (int i = 7; i >= 0; --i)
+            n = (n << 8) | bytes[i];
+        return n;
+    }
+};
+
+/**
+ * Reads a file written by FunctionMaxima::save one point at a time, so the points may be processed
+ * (or loaded, see FunctionMaxima::load) without a copy of the whole file in memory.
+ * Throws InvalidArg if the stream is not in the format or ends early; the points are not validated.
+ */
+template<typename A, typename V, typename ArgumentCodec = BinaryCodec<A>, typename ValueCodec = BinaryCodec<V>>
+class FunctionMaximaReader {
+private:
+    std::istream &in;
+    ArgumentCodec argument_codec;
+    ValueCodec value_codec;
+    std::uint64_t points;
+    std::uint64_t remaining;
+
+public:
+    explicit FunctionMaximaReader(std::istream &input, ArgumentCodec arguments = ArgumentCodec(),
+                                  ValueCodec values = ValueCodec())
+            : in(input), argument_codec(std::move(arguments)), value_codec(std::move(values)) {
+        char magic[sizeof(MaximaFormat::magic)];
+        if (!in.read(magic, sizeof(magic)) || !std::equal(magic, magic + sizeof(magic), MaximaFormat::magic))
+            throw InvArg;
+        points = remaining = MaximaFormat::read_number(in);
+    }
+
+    /* number of points in the file */
+    std::uint64_t size() const noexcept {
+        return points;
+    }
+
+    /* the next point by increasing argument, nullopt after the last one */
+    std::optional<std::pair<A, V>> next() {
+        if (remaining == 0)
+            return std::nullopt;
+        A a = argument_codec.read(in);
+        V v = value_codec.read(in);
+        --remaining;
+        return std::optional<std::pair<A, V>>(std::in_place, std::move(a), std::move(v));
+    }
+
+    /* indices of the maxima among the points in the order of the maxima index, the points left are skipped */
+    std::vector<std::size_t> maxima() {
+        while (next()) {}
+        std::uint64_t count = MaximaFormat::read_number(in);
+        if (count > points)
+            throw InvArg;
+        std::vector<std::size_t> order;
+        for (std::uint64_t k = 0; k < count; ++k) {
+            std::uint64_t index = MaximaFormat::read_number(in);
+            if (index >= points)
+                throw InvArg;
+            order.push_back(static_cast<std::size_t>(index));
+        }
+        return order;
+    }
+};
+
+/**
+ * Immutable function with its maxima, made by FunctionMaxima::freeze for functions which are only queried.
+ * Arguments and values are kept in two contiguous arrays sorted by argument, the maxima in an array
+ * of their indices in the order of mx_begin() (decreasing values, increasing arguments among equal ones).
+ * Lookups are binary searches without a data dependent branch. Copies share the arrays.
+ * With trivially copyable A and V the arrays may be written by write_image and used in place,
+ * e.g. from a memory-mapped file, by map_image.
+ * point_type and the iterators have the interface of the ones of FunctionMaxima, but as the points
+ * are made on the fly, the iterators return them by value: code reading both kinds of functions
+ * takes the points by const reference (or by value).
+ */
+template<typename A, typename V>
+class FrozenFunctionMaxima {
+public:
+    using size_type = size_t;
+
+    class point_type {
+    private:
+        friend class FrozenFunctionMaxima;
+
+        A const *argument;
+        V const *val;
+
+        point_type(A const *a, V const *v) noexcept : argument(a), val(v) {}
+
+    public:
+        point_type() = delete;
+
+        A const &arg() const noexcept {
+            return *argument;
+        }
+
+        V const &value() const noexcept {
+            return *val;
+        }
+    };
+
+    /* returned by operator-> of the iterators, keeps the point made on the fly */
+    class point_pointer {
+    private:
+        point_type point;
+
+    public:
+        explicit point_pointer(point_type p) noexcept : point(p) {}
+
+        const point_type *operator->() const noexcept {
+            return &point;
+        }
+    };
+
+private:
+    struct arrays {
+        std::vector<A> arguments;
+        std::vector<V> values;
+        std::vector<std::uint64_t> maxima;
+    };
+
+    static constexpr char image_magic[8] = {'F', 'M', 'X', 'I', 'M', 'G', '1', '\0'};
+    static constexpr std::size_t image_alignment = alignof(std::max_align_t);
+    static constexpr std::size_t image_header = sizeof(image_magic) + 4 * sizeof(std::uint64_t);
+
+    std::shared_ptr<const void> owner;//nullptr for a mapped image
+    A const *arguments = nullptr;
+    V const *values = nullptr;
+    std::uint64_t const *maxima = nullptr;
+    size_type points = 0;
+    size_type maxima_count = 0;
+
+    template<typename, typename, typename, typename, typename>
+    friend class FunctionMaxima;
+
+    FrozenFunctionMaxima(std::vector<A> sorted_arguments, std::vector<V> sorted_values,
+                         std::vector<std::uint64_t> maxima_order) {
+        auto frozen = std::make_shared<arrays>(arrays{std::move(sorted_arguments), std::move(sorted_values),
+                                                      std::move(maxima_order)});
+        arguments = frozen->arguments.data();
+        values = frozen->values.data();
+        maxima = frozen->maxima.data();
+        points = frozen->arguments.size();
+        maxima_count = frozen->maxima.size();
+        owner = std::move(frozen);
+    }
+
+    static std::size_t padded(std::size_t bytes) noexcept {
+        return (bytes + image_alignment - 1) / image_alignment * image_alignment;
+    }
+
+    /* index of the first argument not less than a: every step halves the range with a conditional move */
+    size_type lower_index(A const &a) const {
+        if (points == 0)
+            return 0;
+        A const *base = arguments;
+        size_type n = points;
+        while (n > 1) {
+            size_type half = n / 2;
+            base = base[half - 1] < a ? base + half : base;
+            n -= half;
+        }
+        return static_cast<size_type>(base - arguments) + (*base < a);
+    }
+
+    size_type find_index(A const &a) const {
+        size_type i = lower_index(a);
+        return i != points && !(a < arguments[i]) ? i : points;
+    }
+
+public:
+    FrozenFunctionMaxima() = default;
+
+    /**
+     * Dereferences to a point_type made on the fly (the image keeps no point objects), so it is
+     * only an input iterator for the standard algorithms, although it can also step back with --.
+     */
+    class iterator {
+    private:
+        using self_type = iterator;
+    public:
+        using iterator_category = std::input_iterator_tag;
+        using value_type = point_type;
+        using pointer = point_pointer;
+        using reference = point_type;
+        using difference_type = std::ptrdiff_t;
+
+        iterator() = default;
+
+        pointer operator->() const noexcept {
+            return pointer(**this);
+        }
+
+        reference operator*() const noexcept {
+            return point_type(arguments + index, values + index);
+        }
+
+        self_type &operator++() {
+            ++index;
+            return *this;
+        }
+
+        self_type operator++(int) {
+            self_type i = *this;
+            ++index;
+            return i;
+        }
+
+        self_type &operator--() {
+            --index;
+            return *this;
+        }
+
+        self_type operator--(int) {
+            self_type i = *this;
+            --index;
+            return i;
+        }
+
+        bool operator==(const self_type &rhs) const noexcept {
+            return index == rhs.index && arguments == rhs.arguments;
+        }
+
+        bool operator!=(const self_type &rhs) const noexcept {
+            return !(*this == rhs);
+        }
+
+    private:
+        friend class FrozenFunctionMaxima;
+
+        A const *arguments = nullptr;
+        V const *values = nullptr;
+        size_type index = 0;
+
+        iterator(A const *a, V const *v, size_type i) noexcept : arguments(a), values(v), index(i) {}
+    };
+
+    /* an input iterator like iterator */
+    class mx_iterator {
+    private:
+        using self_type = mx_iterator;
+    public:
+        using iterator_category = std::input_iterator_tag;
+        using value_type = point_type;
+        using pointer = point_pointer;
+        using reference = point_type;
+        using difference_type = std::ptrdiff_t;
+
+        mx_iterator() = default;
+
+        pointer operator->() const noexcept {
+            return pointer(**this);
+        }
+
+        reference operator*() const noexcept {
+            auto index = static_cast<size_type>(maxima[k]);
+            return point_type(arguments + index, values + index);
+        }
+
+        self_type &operator++() {
+            ++k;
+            return *this;
+        }
+
+        self_type operator++(int) {
+            self_type i = *this;
+            ++k;
+            return i;
+        }
+
+        self_type &operator--() {
+            --k;
+            return *this;
+        }
+
+        self_type operator--(int) {
+            self_type i = *this;
+            --k;
+            return i;
+        }
+
+        bool operator==(const self_type &rhs) const noexcept {
+            return k == rhs.k && maxima == rhs.maxima;
+        }
+
+        bool operator!=(const self_type &rhs) const noexcept {
+            return !(*this == rhs);
+        }
+
+    private:
+        friend class FrozenFunctionMaxima;
+
+        A const *arguments = nullptr;
+        V const *values = nullptr;
+        std::uint64_t const *maxima = nullptr;
+        size_type k = 0;
+
+        mx_iterator(A const *a, V const *v, std::uint64_t const *m, size_type i) noexcept
+                : arguments(a), values(v), maxima(m), k(i) {}
+    };
+
+    size_type size() const noexcept {
+        return points;
+    }
+
+    iterator begin() const noexcept {
+        return iterator(arguments, values, 0);
+    }
+
+    iterator end() const noexcept {
+        return iterator(arguments, values, points);
+    }
+
+    iterator find(A const &a) const {
+        return iterator(arguments, values, find_index(a));
+    }
+
+    /**
+     * @brief Value at a, throws InvalidArg if a is not in the domain
+     */
+    V const &value_at(A const &a) const {
+        size_type i = find_index(a);
+        if (i == points)
+            throw InvArg;
+        return values[i];
+    }
+
+    /**
+     * @brief Point with the k-th smallest argument (counting from 0), end() if k >= size()
+     */
+    iterator nth(size_type k) const noexcept {
+        return iterator(arguments, values, k < points ? k : points);
+    }
+
+    /**
+     * @brief Number of points with arguments smaller than a
+     */
+    size_type rank(A const &a) const {
+        return lower_index(a);
+    }
+
+    size_type mx_size() const noexcept {
+        return maxima_count;
+    }
+
+    mx_iterator mx_begin() const noexcept {
+        return mx_iterator(arguments, values, maxima, 0);
+    }
+
+    mx_iterator mx_end() const noexcept {
+        return mx_iterator(arguments, values, maxima, maxima_count);
+    }
+
+    /**
+     * @brief k-th maximum in the order of mx_begin() (counting from 0), mx_end() if k >= mx_size()
+     */
+    mx_iterator mx_nth(size_type k) const noexcept {
+        return mx_iterator(arguments, values, maxima, k < maxima_count ? k : maxima_count);
+    }
+
+    /**
+     * @brief Writes the arrays as an image map_image can use in place: a header (magic, the numbers of points
+     * and maxima, sizeof(A), sizeof(V)) followed by the arrays of arguments, values and maxima indices,
+     * each starting at a multiple of alignof(std::max_align_t). Numbers are in the byte order of the machine.
+     */
+    void write_image(std::ostream &out) const {
+        static_assert(std::is_trivially_copyable<A>::value && std::is_trivially_copyable<V>::value,
+                      "images require trivially copyable arguments and values");
+        static_assert(alignof(A) <= image_alignment && alignof(V) <= image_alignment, "overaligned types");
+        std::uint64_t numbers[4] = {points, maxima_count, sizeof(A), sizeof(V)};
+        char header[image_header];
+        std::memcpy(header, image_magic, sizeof(image_magic));
+        std::memcpy(header + sizeof(image_magic), numbers, sizeof(numbers));
+        const char zeros[image_alignment] = {};
+        auto write_padded = [&out, &zeros](const void *data, std::size_t bytes) {
+            out.write(static_cast<const char *>(data), static_cast<std::streamsize>(bytes));
+            out.write(zeros, static_cast<std::streamsize>(padded(bytes) - bytes));
+        };
+        write_padded(header, sizeof(header));
+        write_padded(arguments, points * sizeof(A));
+        write_padded(values, points * sizeof(V));
+        write_padded(maxima, maxima_count * sizeof(std::uint64_t));
+    }
+
+    /**
+     * @brief Function using an image written by write_image in place, without copying it
+     * The image must be aligned to alignof(std::max_align_t) and outlive the function and its copies.
+     * Only its layout and the maxima indices are checked (in O(mx_size())), the points are trusted,
+     * as reading all of them would defeat mapping the image lazily. Throws InvalidArg if the check fails.
+     */
+    static FrozenFunctionMaxima map_image(const void *image, std::size_t bytes) {
+        static_assert(std::is_trivially_copyable<A>::value && std::is_trivially_copyable<V>::value,
+                      "images require trivially copyable arguments and values");
+        static_assert(alignof(A) <= image_alignment && alignof(V) <= image_alignment, "overaligned types");
+        auto data = static_cast<const char *>(image);
+        if (reinterpret_cast<std::uintptr_t>(data) % image_alignment != 0 || bytes < padded(image_header) ||
+            !std::equal(image_magic, image_magic + sizeof(image_magic), data))
+            throw InvArg;
+        std::uint64_t header[4];
+        std::memcpy(header, data + sizeof(image_magic), sizeof(header));
+        std::uint64_t n = header[0], m = header[1];
+        if (header[2] != sizeof(A) || header[3] != sizeof(V) || m > n || n > bytes / (sizeof(A) + sizeof(V)))
+            throw InvArg;
+        std::size_t argument_offset = padded(image_header);
+        std::size_t value_offset = argument_offset + padded(n * sizeof(A));
+        std::size_t maxima_offset = value_offset + padded(n * sizeof(V));
+        if (bytes != maxima_offset + padded(m * sizeof(std::uint64_t)))
+            throw InvArg;
+        FrozenFunctionMaxima frozen;
+        frozen.arguments = reinterpret_cast<A const *>(data + argument_offset);
+        frozen.values = reinterpret_cast<V const *>(data + value_offset);
+        frozen.maxima = reinterpret_cast<std::uint64_t const *>(data + maxima_offset);
+        frozen.points = static_cast<size_type>(n);
+        frozen.maxima_count = static_cast<size_type>(m);
+        for (size_type k = 0; k < frozen.maxima_count; ++k)
+            if (frozen.maxima[k] >= n)
+                throw InvArg;
+        return frozen;
+    }
+};
+
+/**
+ * Function A -> V with its local maxima. A point is a local maximum when its value
+ * is not smaller than the values of its neighbours (in the order of arguments).
+ * Storage selects the layout of points, see MapStorage, NodeStorage, FlatStorage and PersistentStorage.
+ * Allocator (rebound by the storage) makes every node, point and shared argument or value the function keeps,
+ * so a function may live on an arena or a pool, see PmrFunctionMaxima. Temporary buffers of bulk operations
+ * (assign, apply_batch) use the default heap. Like in the standard containers, a copy gets
+ * select_on_container_copy_construction of the allocator and assignment keeps the allocator of the target.
+ * Instrumentation observes the operations, see NoInstrumentation and CountingInstrumentation.
+ */
+template<typename A, typename V, typename Storage = MapStorage, typename Allocator = std::allocator<std::byte>,
+        typename Instrumentation = NoInstrumentation>
+class FunctionMaxima {
+private:
+    using storage_t = typename Storage::template storage<A, V,
+            typename Instrumentation::template allocator_t<Allocator>, Instrumentation>;
+    using position_t = typename storage_t::position;
+    using mx_position_t = typename storage_t::mx_position;
+    using mx_run_t = typename storage_t::mx_run;
+    using staged_value_t = typename storage_t::staged_value;
+    using scope_t = typename Instrumentation::template scope<FunctionMaxima>;
+    friend scope_t;
+
+    mutable storage_t store;//mutable only for the repair of a lazily maintained maxima index, see sync_maxima
+    mutable Instrumentation instruments;
+
+    static bool are_values_equal(V const &x, V const &y) {
+        return !(x < y) && !(y < x);
+    }
+
+    /* czy punkt o wartości x między sąsiadami left i right (nullptr gdy ich brak) jest maksimum ? */
+    static bool is_maximum(V const *left, V const &x, V const *right) {
+        return (left == nullptr || !(x < *left)) && (right == nullptr || !(x < *right));
+    }
+
+    V const *value_before(position_t point) const noexcept {
+        if (point == store.begin())
+            return nullptr;
+        --point;
+        return &storage_t::value(point);
+    }
+
+    V const *value_after(position_t point) const noexcept {
+        ++point;
+        if (point == store.end())
+            return nullptr;
+        return &storage_t::value(point);
+    }
+
+    /* undoes the journaled changes of the maxima index and erases the inserted point (unless it is end()) */
+    void rollback(position_t inserted) noexcept {
+        Instrumentation::rolled_back();
+        if constexpr (storage_t::persistent)
+            return;//the modified copy is dropped as a whole, see transaction
+        store.mx_rollback();
+        if (inserted != store.end())
+            store.erase(inserted);
+    }
+
+    struct storage_copy_t {
+    };
+    static constexpr storage_copy_t storage_copy{};
+
+    /* copies only the storage, as it is, for a transaction or a repair on a copy */
+    FunctionMaxima(storage_copy_t, const FunctionMaxima &other)
+            : store(other.store, other.get_allocator()), instruments(other.instruments) {}
+
+    std::size_t indexed_maxima() const noexcept {
+        return store.mx_size();
+    }
+
+    const FunctionMaxima &synced() const {
+        sync_maxima();
+        return *this;
+    }
+
+    /**
+     * Runs an update of a function in place. A persistent storage may throw from any modification,
+     * so the update runs on an O(1) copy which replaces the storage only if the whole update succeeds.
+     */
+    template<typename Update>
+    void transaction(Update &&update) {
+        if constexpr (storage_t::persistent) {
+            FunctionMaxima next(storage_copy, *this);
+            update(next);
+            store.swap(next.store);
+        } else {
+            update(*this);
+        }
+    }
+
+    /**
+     * Classifies every point of a storage at once and replaces its maxima index, appending the maxima
+     * in index order. With more than one thread (0: all hardware threads) and enough points, the points
+     * are classified in chunks and the maxima sorted in chunks on threads of their own; see rebuild_maxima.
+     */
+    static void build_maxima(storage_t &built, std::size_t threads = 1) {
+        std::size_t tasks = parallel_tasks(built.size(), threads);
+        if (tasks > 1)
+            return build_maxima_parallel(built, tasks);
+        std::vector<position_t> maxima;
+        auto f_end = built.end();
+        if constexpr (std::is_arithmetic<V>::value) {
+            std::vector<V> values;
+            values.reserve(built.size());
+            for (auto point = built.begin(); point != f_end; ++point)
+                values.push_back(storage_t::value(point));
+            std::vector<unsigned char> is_max(values.size());
+            mark_maxima(values.data(), values.size(), is_max.data(), 0, values.size());
+            std::size_t i = 0;
+            for (auto point = built.begin(); point != f_end; ++point, ++i)
+                if (is_max[i])
+                    maxima.push_back(point);
+        } else {
+            V const *prev_value = nullptr;
+            for (auto point = built.begin(); point != f_end;) {
+                auto next = point;
+                next++;
+                V const &value = storage_t::value(point);
+                if (is_maximum(prev_value, value, next == f_end ? nullptr : &storage_t::value(next)))
+                    maxima.push_back(point);
+                prev_value = &value;
+                point = next;
+            }
+        }
+        built.mx_assign(maxima);
+    }
+
+    /**
+     * is_max[i] = whether values[i] is a maximum of the n contiguous values, for i in [first, last).
+     * Every value is compared with both neighbours and the results are combined without a branch,
+     * so for arithmetic values the loop vectorizes.
+     */
+    static void mark_maxima(V const *values, std::size_t n, unsigned char *is_max, std::size_t first,
+                            std::size_t last) {
+        if (n < 2) {
+            std::fill(is_max + first, is_max + last, 1);
+            return;
+        }
+        if (first == 0)
+            is_max[0] = !(values[0] < values[1]);
+        for (std::size_t i = std::max<std::size_t>(first, 1); i < std::min(last, n - 1); ++i)
+            is_max[i] = !(values[i] < values[i - 1]) & !(values[i] < values[i + 1]);
+        if (last == n)
+            is_max[n - 1] = !(values[n - 1] < values[n - 2]);
+    }
+
+    /**
+     * build_maxima on tasks threads: the points are classified in tasks chunks (arithmetic values are first
+     * gathered into an array, also in chunks), the maxima are sorted in tasks chunks by decreasing value
+     * (ties keep the increasing arguments) and the chunks are merged pairwise. Only the walks over
+     * the storage and the appending to the index are sequential.
+     */
+    static void build_maxima_parallel(storage_t &built, std::size_t tasks) {
+        std::size_t n = built.size();
+        std::vector<position_t> points;
+        points.reserve(n);
+        for (auto point = built.begin(); point != built.end(); ++point)
+            points.push_back(point);
+        auto chunk = [n, tasks](std::size_t task) {
+            return std::make_pair(n * task / tasks, n * (task + 1) / tasks);
+        };
+        std::vector<unsigned char> is_max(n);
+        if constexpr (std::is_arithmetic<V>::value) {
+            std::vector<V> values(n);
+            run_parallel(tasks, [&](std::size_t task) {
+                for (std::size_t i = chunk(task).first; i < chunk(task).second; ++i)
+                    values[i] = storage_t::value(points[i]);
+            });
+            run_parallel(tasks, [&](std::size_t task) {
+                mark_maxima(values.data(), n, is_max.data(), chunk(task).first, chunk(task).second);
+            });
+        } else {
+            run_parallel(tasks, [&](std::size_t task) {
+                for (std::size_t i = chunk(task).first; i < chunk(task).second; ++i)
+                    is_max[i] = is_maximum(i == 0 ? nullptr : &storage_t::value(points[i - 1]),
+                                           storage_t::value(points[i]),
+                                           i + 1 == n ? nullptr : &storage_t::value(points[i + 1]));
+            });
+        }
+        std::vector<position_t> maxima;
+        for (std::size_t i = 0; i < n; ++i)
+            if (is_max[i])
+                maxima.push_back(points[i]);
+        std::vector<std::size_t> order(maxima.size());
+        for (std::size_t i = 0; i < order.size(); ++i)
+            order[i] = i;
+        parallel_stable_sort(order, [&maxima](std::size_t lhs, std::size_t rhs) {
+            return storage_t::value(maxima[rhs]) < storage_t::value(maxima[lhs]);
+        }, parallel_tasks(order.size(), tasks));
+        built.mx_assign(maxima, std::move(order));
+    }
+
+public:
+    /**
+     * Maxima removed and added by one operation, removals are meant to be applied first
+     * (a maximum whose value changes is removed with the old value and added with the new one).
+     */
+    struct maxima_delta {
+        std::vector<typename storage_t::point_type> removed;
+        std::vector<typename storage_t::point_type> added;
+    };
+
+    using subscriber_type = std::function<void(const maxima_delta &)>;
+    using subscription_id_type = std::size_t;
+
+private:
+    /* a point of a window whose maxima are relinked, see relink_maxima */
+    struct relinked_point_t {
+        position_t point;
+        staged_value_t const *staged;//the new value of the point, nullptr if it keeps its value
+        bool make_max;//whether the point is a maximum afterwards (found by relink_maxima for the anchors)
+        bool inserted;//the point is new, so it was no maximum
+        bool erased;//the point goes away, so it is no maximum afterwards
+        mx_run_t old_run;//the run the point belonged to, found by relink_maxima
+    };
+
+    static relinked_point_t relinked(position_t point, bool make_max, staged_value_t const *staged = nullptr) {
+        return relinked_point_t{point, staged, make_max, false, false, {}};
+    }
+
+    static V const &relinked_value(const relinked_point_t &p) noexcept {
+        return p.staged != nullptr ? storage_t::staged(*p.staged) : storage_t::value(p.point);
+    }
+
+    static std::size_t nothing_pending(A const &) noexcept {
+        return 0;
+    }
+
+    /**
+     * Brings the maxima index of target up to date over a window of n consecutive points (inserted
+     * and erased ones included), given whether each of them is a maximum afterwards. Outside of the window
+     * nothing changes its status; an anchor at an end of the window is a point outside of it whose status
+     * does not change either (the window then ends at a boundary: the end of the function, or a cut of split
+     * or splice that this window does not reach over). Returns the numbers of maxima made and unmade,
+     * records them in delta (unless it is null).
+     * With run-length storages the runs of the window are rebuilt: every group of consecutive maxima
+     * with equal values becomes one run, extended by the maxima an anchor's run has past the window
+     * (less the pending(a) points that are still to be inserted before the argument a of the last one)
+     * and reusing the runs that keep their first point; the other runs starting in the window are erased,
+     * or rekeyed for a new run of the window, so that moving the head of a run does not allocate.
+     * The changes are journaled, the caller ends the journal with mx_commit or mx_rollback.
+     */
+    template<typename Pending = std::size_t (*)(A const &)>
+    static std::pair<std::size_t, std::size_t>
+    relink_maxima(storage_t &target, relinked_point_t *window, std::size_t n, bool left_anchor, bool right_anchor,
+                  maxima_delta *delta, Pending pending = nothing_pending) {
+        std::size_t made = 0;
+        std::size_t unmade = 0;
+        auto none = [&target]() noexcept {
+            if constexpr (storage_t::run_length)
+                return target.mx_run_end();
+            else
+                return target.mx_end();
+        }();
+        if constexpr (storage_t::run_length) {
+            auto runs = target.mx_runs_from(window[0].point);
+            for (std::size_t i = 0; i < n; ++i) {
+                auto &p = window[i];
+                p.old_run = none;
+                if (p.inserted)
+                    continue;
+                while (runs != target.mx_runs_end() && storage_t::mx_run_ends_before(*runs, p.point))
+                    ++runs;
+                if (runs != target.mx_runs_end() && !storage_t::mx_run_starts_after(*runs, p.point))
+                    p.old_run = *runs;
+            }
+            if (left_anchor)
+                window[0].make_max = window[0].old_run != none;
+            if (right_anchor)
+                window[n - 1].make_max = window[n - 1].old_run != none;
+        } else {
+            for (std::size_t i = left_anchor; i + right_anchor < n; ++i)
+                window[i].old_run = window[i].inserted ? none : target.mx_find(window[i].point);
+        }
+        for (std::size_t i = left_anchor; i + right_anchor < n; ++i) {
+            auto &p = window[i];
+            bool was_max = p.old_run != none;
+            bool make_max = p.make_max && !p.erased;
+            if (was_max && (!make_max || p.staged != nullptr)) {
+                ++unmade;
+                if (delta != nullptr)
+                    delta->removed.push_back(storage_t::point(p.point));
+            }
+            if (make_max && (!was_max || p.staged != nullptr)) {
+                ++made;
+                if (delta != nullptr)
+                    delta->added.push_back(p.staged != nullptr ? storage_t::staged_point(p.point, *p.staged)
+                                                               : storage_t::point(p.point));
+            }
+        }
+        if constexpr (!storage_t::run_length) {
+            for (std::size_t i = left_anchor; i + right_anchor < n; ++i) {
+                auto &p = window[i];
+                bool was_max = p.old_run != none;
+                bool make_max = p.make_max && !p.erased;
+                if (was_max && (!make_max || p.staged != nullptr))
+                    target.mx_erase(p.old_run);
+                if (make_max && (!was_max || p.staged != nullptr)) {
+                    if (p.staged != nullptr)
+                        target.mx_insert(p.point, *p.staged);
+                    else
+                        target.mx_insert(p.point);
+                }
+            }
+        } else {
+            auto first_run = left_anchor ? window[0].old_run : none;//keeps its maxima before the window
+            auto last_run = window[n - 1].old_run;
+            std::size_t after = 0;//maxima of last_run after the window
+            if (last_run != none && (right_anchor || last_run == first_run)) {
+                after = target.mx_run_members_after(last_run, window[n - 1].point) -
+                        pending(storage_t::mx_run_last_argument(last_run));
+            }
+            std::size_t before = 0;//maxima of first_run before the window
+            if (first_run != none) {
+                before = storage_t::mx_run_length(first_run) - (first_run == last_run ? after : 0);
+                for (std::size_t i = 0; i < n; ++i)
+                    before -= window[i].old_run == first_run;
+            }
+            std::optional<typename storage_t::mx_tail> last_tail;
+            if (right_anchor && last_run != none)
+                last_tail.emplace(storage_t::mx_run_tail(last_run));
+            auto keeps_run = [&window, none](std::size_t i) {
+                auto &p = window[i];
+                return !p.inserted && p.staged == nullptr && p.old_run != none &&
+                       storage_t::mx_run_starts_at(p.old_run, p.point);
+            };
+            std::size_t head = n;//of the open group of maxima, n if there is none
+            std::size_t last = n;//the last point of the open group
+            std::size_t length = 0;
+            std::size_t kept = n;//the last point that is not erased
+            auto spare = none;//a run to be erased, which the next new run reuses instead
+            auto close = [&]() {
+                if (head == n)
+                    return;
+                bool from_left = head == 0 && first_run != none;
+                bool to_right = last == n - 1 && last_tail.has_value();
+                std::size_t run_length = length + (from_left ? before : 0) + (to_right ? after : 0);
+                auto tail = to_right ? *last_tail : storage_t::mx_tail_at(window[last].point);
+                if (from_left) {
+                    target.mx_run_resize(first_run, std::move(tail), run_length);
+                } else if (keeps_run(head)) {
+                    target.mx_run_resize(window[head].old_run, std::move(tail), run_length);
+                } else if (spare != none) {
+                    target.mx_run_rekey(spare, window[head].point, window[head].staged, std::move(tail), run_length);
+                    spare = none;
+                } else {
+                    target.mx_run_insert(window[head].point, window[head].staged, std::move(tail), run_length);
+                }
+                head = n;
+            };
+            auto discard = [&](mx_run_t run) {
+                if (spare != none)
+                    target.mx_run_erase(spare);
+                spare = run;
+            };
+            for (std::size_t i = 0; i < n; ++i) {
+                auto &p = window[i];
+                if (p.erased) {
+                    if (p.old_run != none && storage_t::mx_run_starts_at(p.old_run, p.point) && p.old_run != first_run)
+                        discard(p.old_run);
+                    continue;
+                }
+                bool opens = false;
+                if (!p.make_max) {
+                    close();
+                } else if (head != n && last == kept && are_values_equal(relinked_value(window[last]), relinked_value(p))) {
+                    last = i;
+                    ++length;
+                } else {
+                    close();
+                    head = last = i;
+                    length = 1;
+                    opens = true;
+                }
+                kept = i;
+                if (p.old_run != none && p.old_run != first_run && storage_t::mx_run_starts_at(p.old_run, p.point) &&
+                    !(opens && keeps_run(i)))
+                    discard(p.old_run);
+            }
+            close();
+            if (spare != none)
+                target.mx_run_erase(spare);
+        }
+        return std::make_pair(made, unmade);
+    }
+
+private:
+    std::vector<std::pair<subscription_id_type, subscriber_type>> subscribers;
+    subscription_id_type last_subscription = 0;
+
+    /**
+     * Lazy maintenance, see lazy_maxima: the arguments written since the maxima index was last repaired
+     * and the maxima the writes dropped from the index, which are reported to the subscribers together
+     * with the repair. The arguments are appended as written; once they outgrow twice the distinct ones
+     * found by the last compaction (dirty_distinct), they are sorted and deduplicated, see compact_dirty.
+     */
+    bool lazy = false;
+    mutable std::vector<A> dirty;
+    mutable std::size_t dirty_distinct = 0;
+    mutable maxima_delta lazily_removed;
+
+    /* the delta is recorded only if somebody listens */
+    maxima_delta *recorded(maxima_delta &delta) const noexcept {
+        return subscribers.empty() ? nullptr : &delta;
+    }
+
+    void notify(const maxima_delta &delta) const {
+        if (delta.removed.empty() && delta.added.empty())
+            return;
+        for (auto &subscriber : subscribers)
+            subscriber.second(delta);
+    }
+
+    /* swaps in a whole new storage, reporting all old maxima as removed and all new ones as added */
+    void replace_store(storage_t &replacement) {
+        maxima_delta delta;
+        if (!subscribers.empty()) {
+            delta.removed = lazily_removed.removed;
+            for (auto m = store.mx_begin(); m != store.mx_end(); ++m)
+                delta.removed.push_back(storage_t::mx_point(m));
+            for (auto m = replacement.mx_begin(); m != replacement.mx_end(); ++m)
+                delta.added.push_back(storage_t::mx_point(m));
+        }
+        store.swap(replacement);
+        dirty.clear();
+        dirty_distinct = 0;
+        lazily_removed.removed.clear();
+        notify(delta);
+    }
+
+    /**
+     * Repairs the maxima index after lazy writes, see sync_maxima. When the writes touched so many points
+     * that checking their neighbourhoods costs more than classifying all points, the index is rebuilt
+     * instead (unless there are subscribers, which get the exact delta). Strong exception safety,
+     * with persistent storage by repairing a copy like transaction.
+     */
+    void repair_maxima() const {
+        scope_t scope(instruments, "sync_maxima", *this);
+        maxima_delta delta;
+        if (subscribers.empty() && dirty.size() * balanced_depth(store.size()) > store.size()) {
+            std::size_t before = store.mx_size();
+            build_maxima(store);
+            Instrumentation::maxima_changed(store.mx_size(), before);
+        } else {
+            std::vector<A const *> written = sorted_dirty();
+            if (!subscribers.empty())
+                delta.removed = lazily_removed.removed;
+            std::pair<std::size_t, std::size_t> changed;
+            if constexpr (storage_t::persistent) {
+                FunctionMaxima next(storage_copy, *this);
+                changed = next.repair_neighbourhoods(written, recorded(delta));
+                store.swap(next.store);
+            } else {
+                changed = repair_neighbourhoods(written, recorded(delta));
+            }
+            Instrumentation::maxima_changed(changed.first, changed.second);
+        }
+        dirty.clear();
+        dirty_distinct = 0;
+        lazily_removed.removed.clear();
+        notify(delta);
+    }
+
+    /* pointers to the written arguments sorted by them, so a comparison that throws leaves the arguments intact */
+    std::vector<A const *> sorted_dirty() const {
+        std::vector<A const *> written;
+        written.reserve(dirty.size());
+        for (auto const &a : dirty)
+            written.push_back(&a);
+        std::sort(written.begin(), written.end(), [](A const *lhs, A const *rhs) { return *lhs < *rhs; });
+        return written;
+    }
+
+    /**
+     * Replaces the written arguments by their sorted distinct copies, so that rewriting the same arguments
+     * keeps dirty within twice their number: amortized O(log d) comparisons per lazy write.
+     * Strong exception safety, the copies are made aside.
+     */
+    void compact_dirty() {
+        std::vector<A> distinct;
+        for (A const *a : sorted_dirty())
+            if (distinct.empty() || distinct.back() < *a)
+                distinct.push_back(*a);
+        dirty.swap(distinct);
+        dirty_distinct = dirty.size();
+    }
+
+    /**
+     * Only the neighbourhood of a written argument may be classified wrongly: the point at it (if any)
+     * and the points right before and after it. The neighbourhoods of the sorted arguments are walked
+     * in one ascending pass, so overlapping ones (and repeated arguments) are checked once, and every checked point is compared
+     * with its neighbours. Every run of consecutive checked points is relinked like by set_value,
+     * with the points around it as anchors, and the journal of the index is rolled back on an exception.
+     * Returns the numbers of maxima inserted into and erased from the index; the maxima dropped by the lazy
+     * writes themselves were counted by them.
+     */
+    std::pair<std::size_t, std::size_t>
+    repair_neighbourhoods(const std::vector<A const *> &written, maxima_delta *delta) const {
+        auto f_end = store.end();
+        std::vector<position_t> checked;
+        for (A const *written_argument : written) {
+            A const &a = *written_argument;
+            if (store.size() == 0)
+                break;
+            auto point = store.lower_bound(a);
+            auto last = point != f_end && !(a < storage_t::arg(point)) ? std::next(point) : point;
+            if (last == f_end)
+                --last;
+            if (point != store.begin())
+                --point;
+            if (!checked.empty() && !(storage_t::arg(checked.back()) < storage_t::arg(point)))
+                point = std::next(checked.back());//the neighbourhoods overlap
+            for (; point != f_end && !(storage_t::arg(last) < storage_t::arg(point)); ++point)
+                checked.push_back(point);
+        }
+        std::pair<std::size_t, std::size_t> changed(0, 0);
+        std::vector<relinked_point_t> window;
+        try {
+            for (std::size_t i = 0; i < checked.size();) {//every run of consecutive checked points is a window
+                window.clear();
+                bool left_anchor = checked[i] != store.begin();
+                if (left_anchor)
+                    window.push_back(relinked(std::prev(checked[i]), false));
+                for (; i < checked.size() && (window.size() == left_anchor || std::next(window.back().point) == checked[i]); ++i) {
+                    auto point = checked[i];
+                    window.push_back(relinked(point, is_maximum(value_before(point), storage_t::value(point),
+                                                                value_after(point))));
+                }
+                bool right_anchor = std::next(window.back().point) != f_end;
+                if (right_anchor)
+                    window.push_back(relinked(std::next(window.back().point), false));
+                auto relinked_window = relink_maxima(store, window.data(), window.size(), left_anchor, right_anchor,
+                                                     delta);
+                changed.first += relinked_window.first;
+                changed.second += relinked_window.second;
+            }
+        } catch (...) {
+            Instrumentation::rolled_back();
+            if constexpr (!storage_t::persistent)
+                store.mx_rollback();
+            throw;
+        }
+        store.mx_commit();
+        return changed;
+    }
+
+public:
+    using allocator_type = Allocator;
+
+    FunctionMaxima() = default;
+
+    explicit FunctionMaxima(const Allocator &alloc) : store(alloc) {}
+
+    /* subscriptions are not copied, the maxima of a lazy function are repaired before copying, see lazy_maxima */
+    FunctionMaxima(const FunctionMaxima &other)
+            : store(other.synced().store), instruments(other.instruments), lazy(other.lazy) {}
+
+    FunctionMaxima(const FunctionMaxima &other, const Allocator &alloc)
+            : store(other.synced().store, alloc), instruments(other.instruments), lazy(other.lazy) {}
+
+    /**
+     * @brief Builds the function from (argument, value) pairs sorted by strictly increasing arguments
+     * See assign.
+     */
+    template<typename InputIt>
+    FunctionMaxima(InputIt first, InputIt last, const Allocator &alloc = Allocator()) : store(alloc) {
+        assign(first, last);
+    }
+
+    /* keeps the subscriptions of this function and reports the replacement of all maxima to them */
+    FunctionMaxima &operator=(const FunctionMaxima &other) {
+        scope_t scope(instruments, "operator=", *this);
+        FunctionMaxima copy(other, get_allocator());
+        replace_store(copy.store);
+        return *this;
+    }
+
+    /* takes over the contents of other if the allocators are equal, otherwise copies them */
+    FunctionMaxima &operator=(FunctionMaxima &&other) {
+        if (!(get_allocator() == other.get_allocator()))
+            return *this = static_cast<const FunctionMaxima &>(other);
+        sync_maxima();//other gets the storage of this
+        other.sync_maxima();
+        scope_t scope(instruments, "operator=", *this);
+        replace_store(other.store);
+        return *this;
+    }
+
+    /**
+     * @brief Registers a subscriber called with the maxima_delta of every successful operation that changes
+     * the maxima (set_value, erase, apply_batch, assign and assignment), after the operation is complete
+     * (for lazy writes, after the repair of the index, see lazy_maxima).
+     * Nothing is reported after an operation that throws. Recording the delta copies the changed maxima,
+     * which happens only while there are subscribers. A subscriber must not modify the function
+     * or its subscriptions; an exception thrown by a subscriber propagates to the caller of the operation
+     * (the operation itself stays done) and the following subscribers are not called.
+     *
+     * @return id for unsubscribe
+     */
+    subscription_id_type subscribe(subscriber_type subscriber) {
+        sync_maxima();
+        subscribers.emplace_back(++last_subscription, std::move(subscriber));
+        return last_subscription;
+    }
+
+    void unsubscribe(subscription_id_type id) noexcept {
+        for (auto it = subscribers.begin(); it != subscribers.end(); ++it) {
+            if (it->first == id) {
+                subscribers.erase(it);
+                return;
+            }
+        }
+    }
+
+    allocator_type get_allocator() const noexcept {
+        return store.get_allocator();
+    }
+
+    Instrumentation &instrumentation() noexcept {
+        return instruments;
+    }
+
+    const Instrumentation &instrumentation() const noexcept {
+        return instruments;
+    }
+
+    /**
+     * @brief Copy of the current version of the function
+     * With PersistentStorage it takes O(1) and shares all nodes with this function. Later modifications
+     * of this function do not affect the snapshot, so the snapshot may be read by any number of threads
+     * while one thread keeps modifying this function. With other storages it is a full copy.
+     */
+    FunctionMaxima snapshot() const {
+        return *this;
+    }
+
+    /**
+     * @brief Immutable copy of the function in contiguous arrays, see FrozenFunctionMaxima
+     */
+    FrozenFunctionMaxima<A, V> freeze() const {
+        sync_maxima();
+        std::vector<A> arguments;
+        std::vector<V> values;
+        arguments.reserve(store.size());
+        values.reserve(store.size());
+        for (auto point = store.begin(); point != store.end(); ++point) {
+            arguments.push_back(storage_t::arg(point));
+            values.push_back(storage_t::value(point));
+        }
+        std::vector<std::uint64_t> maxima;
+        maxima.reserve(store.mx_size());
+        for (auto max = store.mx_begin(); max != store.mx_end(); ++max)
+            maxima.push_back(store.rank(storage_t::mx_point(max).arg()));
+        return FrozenFunctionMaxima<A, V>(std::move(arguments), std::move(values), std::move(maxima));
+    }
+
+    /**
+     * @brief Replaces the function with (argument, value) pairs sorted by strictly increasing arguments
+     * Points are appended in one linear pass with hinted insertions at the end, then the maxima are found
+     * in a second pass and appended to the index sorted by value. With threads other than 1, the second pass
+     * runs on up to threads threads (0: all hardware threads) like rebuild_maxima.
+     * Guarantees strong exception safety by building a new storage and swapping it in.
+     * Throws InvalidArg if the arguments are not strictly increasing.
+     *
+     * @param first
+     * @param last
+     * @param threads
+     */
+    template<typename InputIt>
+    void assign(InputIt first, InputIt last, std::size_t threads = 1) {
+        scope_t scope(instruments, "assign", *this);
+        storage_t built(store.get_allocator());
+        for (; first != last; ++first) {
+            auto &&point = *first;
+            if (built.size() != 0 && !(storage_t::arg(std::prev(built.end())) < point.first))
+                throw InvArg;
+            built.push_back(point.first, point.second);
+        }
+        build_maxima(built, threads);
+        Instrumentation::maxima_changed(built.mx_size(), store.mx_size());
+        replace_store(built);
+    }
+
+    /**
+     * @brief Recomputes the maxima index from the points, e.g. to compact it after many updates
+     * A point is a maximum depending only on its neighbours, so with more than one thread (0: all hardware
+     * threads) the points are classified and the maxima sorted in chunks of at least 32768 on threads
+     * of their own, then the sorted chunks are merged pairwise. The values of neighbouring points are
+     * compared concurrently, which must be safe for V. Appending the maxima to the new index is sequential.
+     * Invalidates the maxima iterators. Guarantees strong exception safety by building the new index aside.
+     */
+    void rebuild_maxima(std::size_t threads = 0) {
+        sync_maxima();
+        scope_t scope(instruments, "rebuild_maxima", *this);
+        std::size_t before = store.mx_size();
+        build_maxima(store, threads);
+        Instrumentation::maxima_changed(store.mx_size(), before);
+    }
+
+    /**
+     * @brief Turns the lazy maintenance of the maxima index on (or off, which repairs it at once)
+     * For write-heavy phases: set_value and erase then only drop the maximum at the written point
+     * from the index (one search) and remember the argument, without classifying its neighbours.
+     * The index is repaired by sync_maxima, which runs at the start of the first operation that needs
+     * the maxima: mx_begin, mx_end, mx_size, mx_nth, mx_rank, mx_runs, mx_range, max_in_range, freeze,
+     * save, copying and the operations that keep the index up to date themselves (evict_before, split,
+     * splice, merge, apply_batch, rebuild_maxima). The points (begin, find, value_at, nth, rank, ...)
+     * are always exact. The subscribers are notified of the changed maxima by that repair.
+     * As a const query may repair the index, a lazy function with unrepaired writes must not be
+     * read by several threads at once; call sync_maxima first.
+     */
+    void lazy_maxima(bool on) {
+        if (!on)
+            sync_maxima();
+        lazy = on;
+    }
+
+    bool lazy_maxima() const noexcept {
+        return lazy;
+    }
+
+    /**
+     * @brief Repairs the maxima index after lazy writes, see lazy_maxima
+     * Only the neighbourhoods of the arguments written since the last repair are classified again,
+     * which are sorted first so that overlapping neighbourhoods are checked once: O(d log n)
+     * for d written arguments, or a rebuild like rebuild_maxima if that is cheaper. Strong exception safety.
+     */
+    void sync_maxima() const {
+        if (!dirty.empty())
+            repair_maxima();
+    }
+
+    /**
+     * @brief Writes the points and the maxima index to out in the format of MaximaFormat
+     * Stream errors are left in the state of out.
+     */
+    template<typename ArgumentCodec = BinaryCodec<A>, typename ValueCodec = BinaryCodec<V>>
+    void save(std::ostream &out, const ArgumentCodec &argument_codec = ArgumentCodec(),
+              const ValueCodec &value_codec = ValueCodec()) const {
+        sync_maxima();
+        scope_t scope(instruments, "save", *this);
+        out.write(MaximaFormat::magic, sizeof(MaximaFormat::magic));
+        MaximaFormat::write_number(out, store.size());
+        for (auto point = store.begin(); point != store.end(); ++point) {
+            argument_codec.write(out, storage_t::arg(point));
+            value_codec.write(out, storage_t::value(point));
+        }
+        MaximaFormat::write_number(out, store.mx_size());
+        for (auto max = store.mx_begin(); max != store.mx_end(); ++max)
+            MaximaFormat::write_number(out, store.rank(storage_t::mx_point(max).arg()));
+    }
+
+    /**
+     * @brief Replaces the function with the one written by save, reading the points one at a time
+     * Points are appended like in assign. The saved maxima are checked while the points are classified
+     * in one linear pass and their saved order is checked against the neighbouring maxima,
+     * so the index is built without sorting.
+     * Guarantees strong exception safety by building a new storage and swapping it in.
+     * Throws InvalidArg if the stream is not in the format, ends early, the arguments are not strictly
+     * increasing or the maxima do not match the points.
+     */
+    template<typename ArgumentCodec = BinaryCodec<A>, typename ValueCodec = BinaryCodec<V>>
+    void load(std::istream &in, ArgumentCodec argument_codec = ArgumentCodec(), ValueCodec value_codec = ValueCodec()) {
+        scope_t scope(instruments, "load", *this);
+        FunctionMaximaReader<A, V, ArgumentCodec, ValueCodec> reader(in, std::move(argument_codec),
+                                                                     std::move(value_codec));
+        storage_t built(store.get_allocator());
+        while (auto point = reader.next()) {
+            if (built.size() != 0 && !(storage_t::arg(std::prev(built.end())) < point->first))
+                throw InvArg;
+            built.push_back(std::move(point->first), std::move(point->second));
+        }
+        std::vector<std::size_t> order = reader.maxima();
+        std::vector<std::size_t> by_index = order;
+        std::sort(by_index.begin(), by_index.end());
+        if (std::adjacent_find(by_index.begin(), by_index.end()) != by_index.end())
+            throw InvArg;
+        std::vector<position_t> maxima;
+        maxima.reserve(by_index.size());
+        auto f_end = built.end();
+        V const *prev_value = nullptr;
+        std::size_t index = 0;
+        for (auto point = built.begin(); point != f_end; ++index) {
+            auto next = point;
+            next++;
+            V const &value = storage_t::value(point);
+            bool listed = maxima.size() < by_index.size() && by_index[maxima.size()] == index;
+            if (listed != is_maximum(prev_value, value, next == f_end ? nullptr : &storage_t::value(next)))
+                throw InvArg;
+            if (listed)
+                maxima.push_back(point);
+            prev_value = &value;
+            point = next;
+        }
+        //order of the maxima index: decreasing values, increasing arguments (indices) among equal ones
+        for (std::size_t k = 0; k < order.size(); ++k) {
+            std::size_t max = static_cast<std::size_t>(
+                    std::lower_bound(by_index.begin(), by_index.end(), order[k]) - by_index.begin());
+            if (k > 0) {
+                V const &before = storage_t::value(maxima[order[k - 1]]);
+                V const &value = storage_t::value(maxima[max]);
+                if (before < value || (!(value < before) && order[k - 1] > max))
+                    throw InvArg;
+            }
+            order[k] = max;
+        }
+        built.mx_assign(maxima, std::move(order));
+        Instrumentation::maxima_changed(built.mx_size(), store.mx_size());
+        replace_store(built);
+    }
+
+    /**
+     * @brief Checks value at point a
+     * Guarantees strong exception safety by not performing any modifications to the structure
+     * and letting through any exceptions
+     *
+     * @param a
+     * @return V const&
+     */
+    V const &value_at(A const &a) const {
+        scope_t scope(instruments, "value_at", *this);
+        auto point = store.find(a);
+        if (point == store.end()) {
+            throw InvArg;
+        } else {
+            return storage_t::value(point);
+        }
+    }
+
+    /**
+     * @brief Set value to the argument in function
+     * Guarantees strong exception safety using the rollback method.
+     * Firstly it decides (using only comparisons) which points become or stop being maxima
+     * Then it performs modifications to the structure that may throw exceptions and in case of one performs a rollback
+     * Then it performs noexcept modifications
+     * Setting the value the argument already has (equal by comparisons) copies and allocates nothing.
+     *
+     * @param a
+     * @param v
+     */
+    void set_value(A const &a, V const &v) {
+        update_value(store.end(), a, v);
+    }
+
+    /**
+     * @brief Overloads of set_value moving the argument and/or value into the function when the point is stored
+     * If an exception is thrown the function is unchanged, but what was passed by rvalue may have been moved from.
+     */
+    void set_value(A const &a, V &&v) {
+        update_value(store.end(), a, std::move(v));
+    }
+
+    void set_value(A &&a, V const &v) {
+        update_value(store.end(), std::move(a), v);
+    }
+
+    void set_value(A &&a, V &&v) {
+        update_value(store.end(), std::move(a), std::move(v));
+    }
+
+    /**
+     * @brief Sets the value constructed from args, which is then moved into the function like by set_value(a, V&&)
+     */
+    template<typename... Args>
+    void emplace_value(A const &a, Args &&...args) {
+        update_value(store.end(), a, V(std::forward<Args>(args)...));
+    }
+
+    template<typename... Args>
+    void emplace_value(A &&a, Args &&...args) {
+        update_value(store.end(), std::move(a), V(std::forward<Args>(args)...));
+    }
+
+private:
+    /* hint is a position of this function, a transaction on a copy starts from the end of the copy instead */
+    template<typename AA, typename VV>
+    void update_value(position_t hint, AA &&a, VV &&v) {
+        scope_t scope(instruments, "set_value", *this);
+        if (lazy) {
+            write_lazily(a, [&](FunctionMaxima &f, maxima_delta *record) {
+                f.set_value_unindexed(&f == this ? hint : f.store.end(), std::forward<AA>(a), std::forward<VV>(v),
+                                      record);
+            });
+            return;
+        }
+        maxima_delta delta;
+        maxima_delta *record = recorded(delta);
+        transaction([&](FunctionMaxima &f) {
+            f.set_value_in_place(&f == this ? hint : f.store.end(), std::forward<AA>(a), std::forward<VV>(v), record);
+        });
+        notify(delta);
+    }
+
+    /**
+     * Remembers a as written and runs the lazy write in a transaction, which records the maxima it drops
+     * into lazily_removed. If it throws, both are restored (a compaction of dirty before it may stay).
+     */
+    template<typename Write>
+    void write_lazily(A const &a, Write &&write) {
+        std::size_t removed = lazily_removed.removed.size();
+        if (dirty.size() >= 2 * dirty_distinct + 64)
+            compact_dirty();
+        dirty.push_back(a);
+        try {
+            transaction([&](FunctionMaxima &f) { write(f, recorded(lazily_removed)); });
+        } catch (...) {
+            dirty.pop_back();
+            lazily_removed.removed.erase(lazily_removed.removed.begin() + removed, lazily_removed.removed.end());
+            throw;
+        }
+    }
+
+    /* a lazy set_value: the point is updated and only its own maximum (if listed) leaves the index */
+    template<typename AA, typename VV>
+    void set_value_unindexed(position_t hint, AA &&a, VV &&v, maxima_delta *delta) {
+        auto lower = locate(hint, a);
+        bool in_domain = lower != store.end() && !(a < storage_t::arg(lower));
+        if (in_domain && are_values_equal(storage_t::value(lower), v))
+            return;
+        std::optional<staged_value_t> staged;
+        auto inserted = store.end();
+        if (in_domain)
+            staged.emplace(store.stage(std::forward<VV>(v)));//First operation that may throw an exception
+        else
+            inserted = store.insert(lower, std::forward<AA>(a), std::forward<VV>(v));
+        auto point = in_domain ? lower : inserted;
+        //the neighbours keep their status even if it is wrong now, the point splits their run if they had one
+        relinked_point_t window[3];
+        std::size_t n = 0;
+        bool left_anchor = point != store.begin();
+        if (left_anchor)
+            window[n++] = relinked(std::prev(point), false);
+        window[n] = relinked(point, false, staged ? &*staged : nullptr);
+        window[n++].inserted = !in_domain;
+        bool right_anchor = std::next(point) != store.end();
+        if (right_anchor)
+            window[n++] = relinked(std::next(point), false);
+        std::pair<std::size_t, std::size_t> changed;
+        try {
+            changed = relink_maxima(store, window, n, left_anchor, right_anchor, delta);
+        } catch (...) {
+            rollback(inserted);
+            throw;
+        }
+        store.mx_commit();//These lines are noexcept
+        if (staged)       //
+            store.commit(lower, *staged);
+        Instrumentation::maxima_changed(changed.first, changed.second);
+    }
+
+    /* lower_bound of a, unless hint turns out to be it (or the point right after it) after at most two comparisons */
+    position_t locate(position_t hint, A const &a) const {
+        if (hint == store.begin() || storage_t::arg(std::prev(hint)) < a) {
+            if (hint == store.end() || !(storage_t::arg(hint) < a))
+                return hint;
+        } else if (!(a < storage_t::arg(std::prev(hint)))) {
+            return std::prev(hint);
+        }
+        return store.lower_bound(a);
+    }
+
+    /**
+     * a and v are moved from (if given by rvalue) only when they are put into the storage.
+     * Whether the point and its neighbours are maxima is decided by comparing values, the index is
+     * relinked over the window from the point before the previous one to the point after the next one,
+     * unless no maximum changes and the point was not one (so it was in no run).
+     */
+    template<typename AA, typename VV>
+    void set_value_in_place(position_t hint, AA &&a, VV &&v, maxima_delta *delta) {
+        auto f_begin = store.begin();
+        auto f_end = store.end();
+        auto lower = locate(hint, a);
+        bool in_domain = lower != f_end && !(a < storage_t::arg(lower));
+        if (in_domain && are_values_equal(storage_t::value(lower), v))
+            return;
+        auto prev = lower;
+        auto next = lower;
+        bool has_prev = lower != f_begin;
+        if (has_prev)
+            prev--;
+        if (in_domain)
+            next++;
+        bool has_next = next != f_end;
+        V const *prev_value = has_prev ? &storage_t::value(prev) : nullptr;
+        V const *next_value = has_next ? &storage_t::value(next) : nullptr;
+        V const *before_prev = has_prev ? value_before(prev) : nullptr;
+        V const *after_next = has_next ? value_after(next) : nullptr;
+        V const *old_value = in_domain ? &storage_t::value(lower) : nullptr;
+        bool was_max = in_domain && is_maximum(prev_value, *old_value, next_value);
+        V const *old_after_prev = lower != f_end ? &storage_t::value(lower) : nullptr;
+        bool was_prev_max = has_prev && is_maximum(before_prev, *prev_value, old_after_prev);
+        bool was_next_max = has_next && is_maximum(in_domain ? old_value : prev_value, *next_value, after_next);
+        bool make_max = is_maximum(prev_value, v, next_value);
+        bool make_prev_max = has_prev && is_maximum(before_prev, *prev_value, &v);
+        bool make_next_max = has_next && is_maximum(&v, *next_value, after_next);
+        std::optional<staged_value_t> staged;
+        auto inserted = f_end;
+        if (in_domain)
+            staged.emplace(store.stage(std::forward<VV>(v)));//First operation that may throw an exception
+        if (in_domain && !was_max && !make_max && was_prev_max == make_prev_max && was_next_max == make_next_max) {
+            store.commit(lower, *staged);
+            return;
+        }
+        if (!in_domain)
+            inserted = store.insert(lower, std::forward<AA>(a), std::forward<VV>(v));
+        auto point = in_domain ? lower : inserted;
+        relinked_point_t window[5];
+        std::size_t n = 0;
+        bool left_anchor = false;
+        bool right_anchor = false;
+        if (has_prev) {
+            prev = std::prev(point);
+            left_anchor = prev != store.begin();
+            if (left_anchor)
+                window[n++] = relinked(std::prev(prev), false);
+            window[n++] = relinked(prev, make_prev_max);
+        }
+        window[n] = relinked(point, make_max, staged ? &*staged : nullptr);
+        window[n++].inserted = !in_domain;
+        if (has_next) {
+            next = std::next(point);
+            window[n++] = relinked(next, make_next_max);
+            right_anchor = std::next(next) != store.end();
+            if (right_anchor)
+                window[n++] = relinked(std::next(next), false);
+        }
+        std::pair<std::size_t, std::size_t> changed;
+        try {
+            changed = relink_maxima(store, window, n, left_anchor, right_anchor, delta);
+        } catch (...) {
+            rollback(inserted);
+            throw;
+        }
+        store.mx_commit();//These lines are noexcept
+        if (staged)       //
+            store.commit(lower, *staged);
+        Instrumentation::maxima_changed(changed.first, changed.second);
+    }
+
+public:
+    /**
+     * @brief Erase a point from the function
+     * Guarantees strong exception safety using the rollback method.
+     * Firstly it decides (using only comparisons) which neighbours become or stop being maxima
+     * Then it performs modifications to the structure that may throw exceptions and in case of one performs a rollback
+     * Then it performs noexcept modifications
+     *
+     * @param a
+     */
+    void erase(A const &a) {
+        scope_t scope(instruments, "erase", *this);
+        if (lazy) {
+            write_lazily(a, [&a](FunctionMaxima &f, maxima_delta *record) { f.erase_unindexed(a, record); });
+            return;
+        }
+        maxima_delta delta;
+        maxima_delta *record = recorded(delta);
+        transaction([&](FunctionMaxima &f) { f.erase_in_place(a, record); });
+        notify(delta);
+    }
+
+private:
+    /* a lazy erase, see set_value_unindexed */
+    void erase_unindexed(A const &a, maxima_delta *delta) {
+        auto point = store.find(a);
+        if (point == store.end())
+            return;
+        relinked_point_t window[3];
+        std::size_t n = 0;
+        bool left_anchor = point != store.begin();
+        if (left_anchor)
+            window[n++] = relinked(std::prev(point), false);
+        window[n] = relinked(point, false);
+        window[n++].erased = true;
+        bool right_anchor = std::next(point) != store.end();
+        if (right_anchor)
+            window[n++] = relinked(std::next(point), false);
+        std::pair<std::size_t, std::size_t> changed;
+        try {
+            changed = relink_maxima(store, window, n, left_anchor, right_anchor, delta);
+        } catch (...) {
+            rollback(store.end());
+            throw;
+        }
+        store.mx_commit(); //These lines are noexcept
+        store.erase(point);//
+        Instrumentation::maxima_changed(changed.first, changed.second);
+    }
+
+    void erase_in_place(A const &a, maxima_delta *delta) {
+        auto point = store.find(a);
+        auto f_end = store.end();
+        if (point == f_end)
+            return;
+        auto prev = point;
+        auto next = point;
+        bool has_prev = point != store.begin();
+        if (has_prev)
+            prev--;
+        next++;
+        bool has_next = next != f_end;
+        V const *prev_value = has_prev ? &storage_t::value(prev) : nullptr;
+        V const *next_value = has_next ? &storage_t::value(next) : nullptr;
+        relinked_point_t window[5];
+        std::size_t n = 0;
+        bool left_anchor = has_prev && prev != store.begin();
+        bool right_anchor = has_next && std::next(next) != f_end;
+        if (left_anchor)
+            window[n++] = relinked(std::prev(prev), false);
+        if (has_prev)
+            window[n++] = relinked(prev, is_maximum(value_before(prev), *prev_value, next_value));
+        window[n] = relinked(point, false);
+        window[n++].erased = true;
+        if (has_next)
+            window[n++] = relinked(next, is_maximum(prev_value, *next_value, value_after(next)));
+        if (right_anchor)
+            window[n++] = relinked(std::next(next), false);
+        std::pair<std::size_t, std::size_t> changed;
+        try {
+            changed = relink_maxima(store, window, n, left_anchor, right_anchor, delta);
+        } catch (...) {
+            rollback(f_end);
+            throw;
+        }
+        store.mx_commit(); //These lines are noexcept
+        store.erase(point);//
+        Instrumentation::maxima_changed(changed.first, changed.second);
+    }
+
+public:
+    /**
+     * @brief Erases all points with arguments less than a, e.g. the points that left the window of a stream
+     * The prefix is cut off at once and the maxima among it are dropped from the front of the argument order
+     * of the maxima index, without searching for each of them: O(log n) plus amortized O(1) per erased point
+     * (O(log n) per erased maximum for PersistentStorage). Only the new first point is checked for becoming
+     * a maximum. Strong exception safety.
+     */
+    void evict_before(A const &a) {
+        sync_maxima();
+        scope_t scope(instruments, "evict_before", *this);
+        maxima_delta delta;
+        maxima_delta *record = recorded(delta);
+        transaction([&](FunctionMaxima &f) { f.evict_before_in_place(a, record); });
+        notify(delta);
+    }
+
+private:
+    void evict_before_in_place(A const &a, maxima_delta *delta) {
+        auto first = store.lower_bound(a);
+        if (first == store.begin())
+            return;
+        std::size_t indexed = store.mx_size();
+        if (delta != nullptr) {
+            auto evicted_end = store.mx_argument_lower_bound(a);
+            for (auto max = store.mx_argument_begin(); max != evicted_end; ++max)
+                delta->removed.push_back(storage_t::mx_argument_point(max));
+        }
+        std::pair<std::size_t, std::size_t> changed(0, 0);
+        typename storage_t::mx_run_cursor evicted_end;
+        try {
+            if (first != store.end()) {
+                //the new first point loses its left neighbour, so it may only become a maximum
+                relinked_point_t window[2];
+                std::size_t n = 0;
+                window[n++] = relinked(first, is_maximum(nullptr, storage_t::value(first), value_after(first)));
+                bool right_anchor = std::next(first) != store.end();
+                if (right_anchor)
+                    window[n++] = relinked(std::next(first), false);
+                changed = relink_maxima(store, window, n, false, right_anchor, delta);
+            }
+            evicted_end = store.mx_runs_starting_from(a);
+        } catch (...) {
+            rollback(store.end());
+            throw;
+        }
+        store.mx_commit();                   //These lines are noexcept
+        store.mx_erase_before(evicted_end);  //
+        store.erase_prefix(first);           //
+        Instrumentation::maxima_changed(changed.first, indexed + changed.first - store.mx_size());
+    }
+
+public:
+    /**
+     * @brief Moves the points with arguments not less than a to the returned function (with the same allocator)
+     * The points and their maxima are moved, not copied: tree nodes and blocks are relinked in O(log n)
+     * (the maxima index in O(m)). Only the two points at the seam are re-evaluated, each of them loses
+     * a neighbour, so it may only become a maximum. Strong exception safety.
+     */
+    FunctionMaxima split(A const &a) {
+        sync_maxima();
+        scope_t scope(instruments, "split", *this);
+        FunctionMaxima rest(get_allocator());
+        maxima_delta delta;
+        maxima_delta *record = recorded(delta);
+        transaction([&](FunctionMaxima &f) { f.split_in_place(a, rest.store, record); });
+        notify(delta);
+        return rest;
+    }
+
+    /**
+     * @brief Moves all points of other into this function, leaving other empty
+     * The arguments of other must fit between two neighbouring arguments of this function (or before or after
+     * all of them), otherwise InvalidArg is thrown and nothing changes; merge accepts any arguments.
+     * With equal allocators the points and their maxima are moved like by split and only the (at most four)
+     * points at the seams are re-evaluated. Otherwise the points are copied like by merge.
+     * Strong exception safety.
+     */
+    void splice(FunctionMaxima &other) {
+        if (&other == this || other.size() == 0)
+            return;
+        if (!(get_allocator() == other.get_allocator())) {
+            merge(other);
+            return;
+        }
+        scope_t scope(instruments, "splice", *this);
+        if (!fits(other))
+            throw InvArg;
+        sync_maxima();
+        other.sync_maxima();
+        maxima_delta delta;
+        maxima_delta *record = recorded(delta);
+        maxima_delta emptied;
+        if (!other.subscribers.empty()) {
+            for (auto m = other.store.mx_begin(); m != other.store.mx_end(); ++m)
+                emptied.removed.push_back(storage_t::mx_point(m));
+        }
+        storage_t source(other.get_allocator());
+        source.swap(other.store);
+        try {
+            transaction([&](FunctionMaxima &f) {
+                if constexpr (storage_t::persistent) {
+                    storage_t taken(source, source.get_allocator());
+                    f.splice_in_place(taken, record);
+                } else {
+                    f.splice_in_place(source, record);
+                }
+            });
+        } catch (...) {
+            other.store.swap(source);
+            throw;
+        }
+        notify(delta);
+        other.notify(emptied);
+    }
+
+    /**
+     * @brief Moves all points of other into this function, leaving other empty
+     * resolve(mine, theirs) gives the value of an argument present in both functions.
+     * If the arguments of other fit between two neighbouring arguments of this function, see splice.
+     * Otherwise every point may get new neighbours: both functions are merged point by point into
+     * a new storage in linear time and its maxima are found in one pass. Strong exception safety.
+     */
+    template<typename Resolve>
+    void merge(FunctionMaxima &other, Resolve resolve) {
+        if (&other == this || other.size() == 0)
+            return;
+        if (get_allocator() == other.get_allocator() && fits(other)) {
+            splice(other);
+            return;
+        }
+        scope_t scope(instruments, "merge", *this);
+        other.sync_maxima();
+        storage_t merged(get_allocator());
+        auto mine = store.begin();
+        auto theirs = other.store.begin();
+        while (mine != store.end() || theirs != other.store.end()) {
+            if (theirs == other.store.end() ||
+                (mine != store.end() && storage_t::arg(mine) < storage_t::arg(theirs))) {
+                merged.push_back(storage_t::arg(mine), storage_t::value(mine));
+                ++mine;
+            } else if (mine == store.end() || storage_t::arg(theirs) < storage_t::arg(mine)) {
+                merged.push_back(storage_t::arg(theirs), storage_t::value(theirs));
+                ++theirs;
+            } else {
+                merged.push_back(storage_t::arg(mine), resolve(storage_t::value(mine), storage_t::value(theirs)));
+                ++mine;
+                ++theirs;
+            }
+        }
+        build_maxima(merged);
+        maxima_delta emptied;
+        if (!other.subscribers.empty()) {
+            for (auto m = other.store.mx_begin(); m != other.store.mx_end(); ++m)
+                emptied.removed.push_back(storage_t::mx_point(m));
+        }
+        storage_t cleared(other.get_allocator());
+        other.store.swap(cleared);
+        replace_store(merged);
+        other.notify(emptied);
+    }
+
+    /* merge of functions without common arguments, a common argument throws InvalidArg and changes nothing */
+    void merge(FunctionMaxima &other) {
+        merge(other, [](V const &, V const &) -> V const & { throw InvArg; });
+    }
+
+private:
+    /* no argument of this function lies between the smallest and the largest argument of other (not empty) */
+    bool fits(const FunctionMaxima &other) const {
+        auto gap = store.lower_bound(storage_t::arg(other.store.begin()));
+        return gap == store.end() || storage_t::arg(std::prev(other.store.end())) < storage_t::arg(gap);
+    }
+
+    /**
+     * The run crossing the cut (if any) is cut by relinking the point after it first (which reads the run,
+     * the left boundary of its window is the cut) and then the point before it.
+     */
+    void split_in_place(A const &a, storage_t &rest, maxima_delta *delta) {
+        auto first = store.lower_bound(a);
+        if (first == store.end())
+            return;
+        bool has_last = first != store.begin();
+        auto last = has_last ? std::prev(first) : first;
+        if (delta != nullptr) {
+            for (auto max = store.mx_begin(); max != store.mx_end(); ++max) {
+                if (!(storage_t::mx_point(max).arg() < a))
+                    delta->removed.push_back(storage_t::mx_point(max));
+            }
+        }
+        std::pair<std::size_t, std::size_t> changed(0, 0);
+        try {
+            relinked_point_t window[2];
+            std::size_t n = 0;
+            window[n++] = relinked(first, is_maximum(nullptr, storage_t::value(first), value_after(first)));
+            bool right_anchor = std::next(first) != store.end();
+            if (right_anchor)
+                window[n++] = relinked(std::next(first), false);
+            changed = relink_maxima(store, window, n, false, right_anchor, nullptr);
+            if (has_last) {
+                n = 0;
+                bool left_anchor = last != store.begin();
+                if (left_anchor)
+                    window[n++] = relinked(std::prev(last), false);
+                window[n++] = relinked(last, is_maximum(value_before(last), storage_t::value(last), nullptr));
+                auto relinked_last = relink_maxima(store, window, n, left_anchor, false, delta);
+                changed.first += relinked_last.first;
+                changed.second += relinked_last.second;
+            }
+            store.split_off(first, rest);//the maxima from first on go to rest
+        } catch (...) {
+            rollback(store.end());
+            throw;
+        }
+        store.mx_commit();
+        Instrumentation::maxima_changed(changed.first, changed.second);
+    }
+
+    /**
+     * from is not empty and fits, see splice. The points of from at the seams gain a neighbour, so they may only
+     * stop being maxima, the points of this function around the gap get a new neighbour instead of each other.
+     * Both storages are relinked around the seams like by split before the points move, runs with equal
+     * values meeting at a seam are joined after that.
+     */
+    void splice_in_place(storage_t &from, maxima_delta *delta) {
+        auto first = from.begin();
+        auto last = std::prev(from.end());
+        auto gap = store.lower_bound(storage_t::arg(first));
+        bool has_left = gap != store.begin();
+        bool has_right = gap != store.end();
+        auto left = has_left ? std::prev(gap) : gap;
+        V const *left_value = has_left ? &storage_t::value(left) : nullptr;
+        V const *right_value = has_right ? &storage_t::value(gap) : nullptr;
+        V const &first_value = storage_t::value(first);
+        V const &last_value = storage_t::value(last);
+        V const *after_first = first != last ? &storage_t::value(std::next(first)) : nullptr;
+        V const *before_last = first != last ? &storage_t::value(std::prev(last)) : nullptr;
+        bool make_left_max = has_left && is_maximum(value_before(left), *left_value, &first_value);
+        bool make_right_max = has_right && is_maximum(&last_value, *right_value, value_after(gap));
+        bool make_first_max = is_maximum(left_value, first_value, first != last ? after_first : right_value);
+        bool make_last_max = first != last && is_maximum(before_last, last_value, right_value);
+        bool stop_first_max = !make_first_max && is_maximum(nullptr, first_value, after_first);
+        bool stop_last_max = first != last && !make_last_max && is_maximum(before_last, last_value, nullptr);
+        bool join_left = make_left_max && make_first_max && are_values_equal(*left_value, first_value);
+        bool join_right = make_right_max && (first != last ? make_last_max : make_first_max) &&
+                          are_values_equal(last_value, *right_value);
+        if (delta != nullptr) {
+            for (auto max = from.mx_begin(); max != from.mx_end(); ++max) {
+                A const &arg = storage_t::mx_point(max).arg();
+                if ((!stop_first_max || storage_t::arg(first) < arg) && (!stop_last_max || arg < storage_t::arg(last)))
+                    delta->added.push_back(storage_t::mx_point(max));
+            }
+        }
+        std::pair<std::size_t, std::size_t> changed(0, 0);
+        mx_run_t seams[4];//the runs joined at the left seam and at the right one
+        try {
+            relinked_point_t window[2];
+            auto relink = [&](storage_t &target, std::size_t n, bool left_anchor, bool right_anchor, maxima_delta *d) {
+                auto relinked_window = relink_maxima(target, window, n, left_anchor, right_anchor, d);
+                changed.first += relinked_window.first;
+                changed.second += relinked_window.second;
+            };
+            if (has_right) {
+                window[0] = relinked(gap, make_right_max);
+                bool right_anchor = std::next(gap) != store.end();
+                if (right_anchor)
+                    window[1] = relinked(std::next(gap), false);
+                relink(store, 1 + right_anchor, false, right_anchor, delta);
+            }
+            if (has_left) {
+                bool left_anchor = left != store.begin();
+                if (left_anchor)
+                    window[0] = relinked(std::prev(left), false);
+                window[left_anchor] = relinked(left, make_left_max);
+                relink(store, 1 + left_anchor, left_anchor, false, delta);
+            }
+            window[0] = relinked(first, make_first_max);
+            if (first != last) {
+                window[1] = relinked(std::next(first), false);
+                relink(from, 2, false, true, nullptr);
+                window[0] = relinked(std::prev(last), false);
+                window[1] = relinked(last, make_last_max);
+                relink(from, 2, true, false, nullptr);
+            } else {
+                relink(from, 1, false, false, nullptr);
+            }
+            if constexpr (storage_t::run_length) {
+                if (join_left) {
+                    seams[0] = store.mx_run_at(left);
+                    seams[1] = from.mx_run_at(first);
+                }
+                if (join_right) {
+                    seams[2] = from.mx_run_at(last);
+                    seams[3] = store.mx_run_at(gap);
+                }
+            }
+            store.splice(gap, from);
+        } catch (...) {
+            rollback(store.end());
+            from.mx_rollback();
+            throw;
+        }
+        store.mx_commit();//These lines are noexcept, the runs of from
+        from.mx_commit(); //are in the index of this function now
+        if constexpr (storage_t::run_length) {
+            if (join_left)
+                store.mx_join(seams[0], seams[1]);
+            if (join_right)
+                store.mx_join(join_left && seams[2] == seams[1] ? seams[0] : seams[2], seams[3]);
+        }
+        Instrumentation::maxima_changed(changed.first, changed.second);
+    }
+
+public:
+    /**
+     * Single operation of apply_batch: either sets a value at the argument or erases it.
+     */
+    class update_type {
+    private:
+        friend class FunctionMaxima;
+
+        A argument;
+        std::optional<V> new_value;
+
+        update_type(A const &a, std::optional<V> v) : argument(a), new_value(std::move(v)) {}
+
+    public:
+        update_type() = delete;
+
+        static update_type set_value(A const &a, V const &v) {
+            return update_type(a, std::optional<V>(v));
+        }
+
+        static update_type erase(A const &a) {
+            return update_type(a, std::nullopt);
+        }
+    };
+
+private:
+    struct batch_op_t {
+        const update_type *update;
+        position_t point;
+        bool inserted;
+        bool erased;
+        std::optional<staged_value_t> staged;
+    };
+
+    /* a point of the function touched by the batch or around a touched one */
+    struct batch_point_t {
+        position_t point;
+        V const *value;     //the value after the batch, nullptr for erased points
+        batch_op_t *op;     //nullptr for points not touched by the batch
+        bool evaluate;      //the point is touched by the batch or neighbours a touched point
+        bool segment_begin; //the previous entry is not the neighbour of this point
+    };
+
+    void rollback_batch(std::vector<batch_op_t> &ops) noexcept {
+        Instrumentation::rolled_back();
+        if constexpr (storage_t::persistent)
+            return;//the modified copy is dropped as a whole, see transaction
+        store.mx_rollback();
+        for (auto op = ops.rbegin(); op != ops.rend(); ++op)
+            if (op->inserted)
+                store.erase(op->point);
+    }
+
+public:
+    /**
+     * @brief Applies a sequence of set_value and erase operations as one transaction
+     * The result is the same as applying them one by one (the last operation on an argument wins),
+     * but the operations are grouped by argument and every point whose maximum status may change
+     * is evaluated only once, against its neighbours after the whole batch.
+     * Guarantees strong exception safety for the whole batch using the rollback method.
+     * Firstly it inserts new points (in increasing order), stages new values and relinks the maxima index
+     * over every segment of touched points, erasing the points and rolling the index back in case of an exception.
+     * Then it commits the index and staged values and erases points (in decreasing order) with noexcept operations.
+     *
+     * @param first
+     * @param last forward iterators over update_type
+     */
+    template<typename ForwardIt>
+    void apply_batch(ForwardIt first, ForwardIt last) {
+        sync_maxima();
+        scope_t scope(instruments, "apply_batch", *this);
+        maxima_delta delta;
+        maxima_delta *record = recorded(delta);
+        transaction([&](FunctionMaxima &f) { f.apply_batch_in_place(first, last, record); });
+        notify(delta);
+    }
+
+private:
+    template<typename ForwardIt>
+    void apply_batch_in_place(ForwardIt first, ForwardIt last, maxima_delta *delta) {
+        std::vector<const update_type *> updates;
+        for (; first != last; ++first)
+            updates.push_back(&*first);
+        std::stable_sort(updates.begin(), updates.end(), [](const update_type *lhs, const update_type *rhs) {
+            return lhs->argument < rhs->argument;
+        });
+        std::vector<batch_op_t> ops;
+        std::vector<batch_point_t> window;
+        std::size_t made = 0;
+        std::size_t unmade = 0;
+        ops.reserve(updates.size());
+        try {
+            for (std::size_t i = 0; i < updates.size(); ++i) {
+                if (i + 1 < updates.size() && !(updates[i]->argument < updates[i + 1]->argument))
+                    continue;//overridden by a later update of the same argument
+                auto &update = *updates[i];
+                auto lower = store.lower_bound(update.argument);
+                bool in_domain = lower != store.end() && !(update.argument < storage_t::arg(lower));
+                if (!update.new_value) {
+                    if (in_domain)
+                        ops.push_back(batch_op_t{&update, lower, false, true, std::nullopt});
+                } else if (!in_domain) {
+                    ops.push_back(batch_op_t{&update, lower, false, false, std::nullopt});
+                    ops.back().point = store.insert(lower, update.argument, *update.new_value);
+                    ops.back().inserted = true;
+                } else if (!are_values_equal(storage_t::value(lower), *update.new_value)) {
+                    ops.push_back(batch_op_t{&update, lower, false, false, std::nullopt});
+                    ops.back().staged.emplace(store.stage(*update.new_value));
+                }
+            }
+            if constexpr (storage_t::persistent) {
+                //positions point into the version they were taken from, the walk below needs the final one
+                for (auto &op : ops)
+                    op.point = store.find(op.update->argument);
+            }
+            //Collects touched points with two surviving neighbours on each side, merging overlapping neighbourhoods
+            auto f_begin = store.begin();
+            auto f_end = store.end();
+            std::size_t next_op = 0;
+            std::size_t segment_start = 0;
+            std::size_t kept = 0;//the last surviving point of the segment
+            bool has_kept = false;
+            for (std::size_t i = 0; i < ops.size(); i = std::max(i + 1, next_op)) {
+                auto start = ops[i].point;
+                bool merged = false;
+                for (int steps = 0; steps < 2 && start != f_begin; ++steps) {
+                    auto before = std::prev(start);
+                    if (!window.empty() && before == window.back().point) {
+                        merged = true;
+                        break;
+                    }
+                    start = before;
+                }
+                if (!merged) {
+                    segment_start = window.size();
+                    has_kept = false;
+                }
+                int tail = -1;//surviving points still to collect after the last touched one
+                bool flag_next = false;
+                std::size_t k = i;
+                for (auto point = start; point != f_end; ++point) {
+                    batch_op_t *op = nullptr;
+                    if (k < ops.size() && point == ops[k].point) {
+                        op = &ops[k++];
+                        tail = 2;
+                        if (has_kept)
+                            window[kept].evaluate = true;
+                        if (op->erased) {
+                            window.push_back(batch_point_t{point, nullptr, op, true, window.size() == segment_start});
+                            flag_next = true;
+                            continue;
+                        }
+                    } else {
+                        if (tail == 0)
+                            break;
+                        if (tail > 0)
+                            --tail;
+                    }
+                    V const *value = op != nullptr && op->staged ? &storage_t::staged(*op->staged)
+                                                                 : &storage_t::value(point);
+                    window.push_back(batch_point_t{point, value, op, op != nullptr || flag_next,
+                                                   window.size() == segment_start});
+                    kept = window.size() - 1;
+                    has_kept = true;
+                    flag_next = op != nullptr;
+                }
+                next_op = k;
+            }
+            //Relinks every segment, the points at its ends that are not evaluated are its anchors
+            std::vector<std::size_t> inserted_before(ops.size() + 1, 0);
+            for (std::size_t i = 0; i < ops.size(); ++i)
+                inserted_before[i + 1] = inserted_before[i] + ops[i].inserted;
+            std::vector<relinked_point_t> relinked_window;
+            for (std::size_t s = 0; s < window.size();) {
+                std::size_t e = s + 1;
+                while (e < window.size() && !window[e].segment_begin)
+                    ++e;
+                relinked_window.clear();
+                std::size_t later_ops = 0;//the first op after the segment
+                std::size_t last_kept = e;
+                V const *before_kept = nullptr;
+                for (std::size_t t = s; t < e; ++t) {
+                    auto &entry = window[t];
+                    relinked_window.push_back(relinked(entry.point, false,
+                                                       entry.op != nullptr && entry.op->staged ? &*entry.op->staged
+                                                                                               : nullptr));
+                    if (entry.op != nullptr) {
+                        relinked_window.back().inserted = entry.op->inserted;
+                        relinked_window.back().erased = entry.op->erased;
+                        later_ops = entry.op - ops.data() + 1;
+                    }
+                    if (entry.value == nullptr)
+                        continue;
+                    if (last_kept != e) {
+                        relinked_window[last_kept - s].make_max = is_maximum(before_kept, *window[last_kept].value,
+                                                                             entry.value);
+                        before_kept = window[last_kept].value;
+                    }
+                    last_kept = t;
+                }
+                if (last_kept != e)
+                    relinked_window[last_kept - s].make_max = is_maximum(before_kept, *window[last_kept].value, nullptr);
+                //the points inserted by later segments are not in the runs yet
+                auto pending = [&ops, &inserted_before, later_ops](A const &a) {
+                    auto end = std::upper_bound(ops.begin() + later_ops, ops.end(), a,
+                                                [](A const &x, const batch_op_t &op) { return x < op.update->argument; });
+                    return inserted_before[end - ops.begin()] - inserted_before[later_ops];
+                };
+                auto relinked_segment = relink_maxima(store, relinked_window.data(), relinked_window.size(),
+                                                      !window[s].evaluate, !window[e - 1].evaluate, delta, pending);
+                made += relinked_segment.first;
+                unmade += relinked_segment.second;
+                s = e;
+            }
+        } catch (...) {
+            rollback_batch(ops);
+            throw;
+        }
+        store.mx_commit();//These lines are noexcept
+        Instrumentation::maxima_changed(made, unmade);
+        for (auto &op : ops)
+            if (op.staged)
+                store.commit(op.point, *op.staged);
+        for (auto op = ops.rbegin(); op != ops.rend(); ++op)
+            if (op->erased)
+                store.erase(op->point);
+    }
+
+public:
+    using size_type = size_t;
+
+    size_type size() const noexcept {
+        return store.size();
+    }
+
+    using point_type = typename storage_t::point_type;
+
+    /**
+     * Dereferencing returns a reference to the point_type kept by the storage,
+     * so walking the function never allocates. Copy the point to keep it after
+     * the function is modified or destroyed.
+     */
+    class iterator {
+    private:
+        using self_type = iterator;
+        using wrapped_iterator_t = position_t;
+    public:
+        using iterator_category = std::bidirectional_iterator_tag;
+        using value_type = point_type;
+        using pointer = const value_type *;
+        using reference = const value_type &;
+        using difference_type = std::ptrdiff_t;
+
+        iterator() = default;
+
+        pointer operator->() const noexcept {
+            return &storage_t::point(wrapped_iterator);
+        }
+
+        reference operator*() const noexcept {
+            return storage_t::point(wrapped_iterator);
+        }
+
+        self_type &operator++() {
+            ++wrapped_iterator;
+            return *this;
+        }
+
+        self_type operator++(int) {
+            self_type i = *this;
+            ++wrapped_iterator;
+            return i;
+        }
+
+        self_type &operator--() {
+            --wrapped_iterator;
+            return *this;
+        }
+
+        self_type operator--(int) {
+            self_type i = *this;
+            --wrapped_iterator;
+            return i;
+        }
+
+        bool operator==(const self_type &rhs) const noexcept {
+            return wrapped_iterator == rhs.wrapped_iterator;
+        }
+
+        bool operator!=(const self_type &rhs) const noexcept {
+            return wrapped_iterator != rhs.wrapped_iterator;
+        }
+
+    private:
+        friend class FunctionMaxima;
+
+        wrapped_iterator_t wrapped_iterator;
+
+        iterator(wrapped_iterator_t iterator_to_wrap) : wrapped_iterator(iterator_to_wrap) {}
+    };
+
+    iterator begin() const {
+        return iterator(store.begin());
+    }
+
+    iterator end() const {
+        return iterator(store.end());
+    }
+
+    iterator find(A const &a) const {
+        scope_t scope(instruments, "find", *this);
+        return iterator(store.find(a));
+    }
+
+    /**
+     * @brief set_value starting the search from hint, the point with the smallest argument not less than a
+     * (or the point right after it), e.g. end() when a is not less than every argument stored.
+     * A correct hint is checked with at most two comparisons instead of a full search, the maxima index
+     * is searched only for the neighbours which stop being maxima. A wrong hint costs the usual search.
+     * set_value without a hint tries end(), so appends are fast anyway.
+     */
+    void set_value(iterator hint, A const &a, V const &v) {
+        update_value(hint.wrapped_iterator, a, v);
+    }
+
+    void set_value(iterator hint, A &&a, V &&v) {
+        update_value(hint.wrapped_iterator, std::move(a), std::move(v));
+    }
+
+    /**
+     * @brief Point with the k-th smallest argument (counting from 0), end() if k >= size()
+     */
+    iterator nth(size_type k) const {
+        return iterator(store.nth(k));
+    }
+
+    /**
+     * @brief Number of points with arguments smaller than a
+     */
+    size_type rank(A const &a) const {
+        return store.rank(a);
+    }
+
+    /**
+     * @brief Number of points with arguments in [lo, hi], 0 when hi < lo
+     */
+    size_type count(A const &lo, A const &hi) const {
+        if (hi < lo)
+            return 0;
+        size_type up_to_hi = store.rank(hi);
+        if (store.find(hi) != store.end())
+            ++up_to_hi;
+        return up_to_hi - store.rank(lo);
+    }
+
+    /**
+     * Walks the maxima from the greatest value, ties by increasing argument.
+     * Like iterator, it dereferences to points kept by the storage without allocating.
+     */
+    class mx_iterator {
+    private:
+        using self_type = mx_iterator;
+        using wrapped_iterator_t = mx_position_t;
+    public:
+        using iterator_category = std::bidirectional_iterator_tag;
+        using value_type = point_type;
+        using pointer = const value_type *;
+        using reference = const value_type &;
+        using difference_type = std::ptrdiff_t;
+
+        mx_iterator() = default;
+
+        pointer operator->() const noexcept {
+            return &storage_t::mx_point(wrapped_iterator);
+        }
+
+        reference operator*() const noexcept {
+            return storage_t::mx_point(wrapped_iterator);
+        }
+
+        self_type &operator++() {
+            ++wrapped_iterator;
+            return *this;
+        }
+
+        self_type operator++(int) {
+            self_type i = *this;
+            ++wrapped_iterator;
+            return i;
+        }
+
+        self_type &operator--() {
+            --wrapped_iterator;
+            return *this;
+        }
+
+        self_type operator--(int) {
+            self_type i = *this;
+            --wrapped_iterator;
+            return i;
+        }
+
+        bool operator==(const self_type &rhs) const noexcept {
+            return wrapped_iterator == rhs.wrapped_iterator;
+        }
+
+        bool operator!=(const self_type &rhs) const noexcept {
+            return wrapped_iterator != rhs.wrapped_iterator;
+        }
+
+    private:
+        friend class FunctionMaxima;
+
+        wrapped_iterator_t wrapped_iterator;
+
+        mx_iterator(wrapped_iterator_t iterator_to_wrap) : wrapped_iterator(iterator_to_wrap) {}
+    };
+
+    mx_iterator mx_begin() const {
+        sync_maxima();
+        return mx_iterator(store.mx_begin());
+    }
+
+    mx_iterator mx_end() const {
+        sync_maxima();
+        return mx_iterator(store.mx_end());
+    }
+
+    /**
+     * @brief Number of local maxima, O(1) (unless the index is repaired first, see lazy_maxima)
+     */
+    size_type mx_size() const {
+        sync_maxima();
+        return store.mx_size();
+    }
+
+    /**
+     * @brief k-th maximum in the order of mx_begin() (counting from 0), mx_end() if k >= mx_size()
+     */
+    mx_iterator mx_nth(size_type k) const {
+        sync_maxima();
+        return mx_iterator(store.mx_nth(k));
+    }
+
+    /**
+     * @brief Number of maxima preceding the point in the order of mx_begin(),
+     * for a maximum that is its distance from mx_begin()
+     */
+    size_type mx_rank(point_type const &p) const {
+        sync_maxima();
+        return store.mx_rank(p);
+    }
+
+    /**
+     * A plateau of maxima: maxima at consecutive points with equal values, i.e. consecutive both
+     * in the function and in the order of mx_begin(). begin() and end() expand it into its maxima.
+     */
+    class mx_run_type {
+    public:
+        A const &first_arg() const noexcept {
+            return storage_t::mx_point(first).arg();
+        }
+
+        A const &last_arg() const noexcept {
+            return storage_t::mx_point(last).arg();
+        }
+
+        V const &value() const noexcept {
+            return storage_t::mx_point(first).value();
+        }
+
+        /* number of maxima (and points) of the plateau */
+        size_type size() const noexcept {
+            return length;
+        }
+
+        mx_iterator begin() const noexcept {
+            return mx_iterator(first);
+        }
+
+        mx_iterator end() const {
+            auto past = last;
+            ++past;
+            return mx_iterator(past);
+        }
+
+    private:
+        friend class FunctionMaxima;
+
+        mx_position_t first;
+        mx_position_t last;
+        size_type length = 0;
+    };
+
+    /**
+     * Walks the plateaus of maxima in the order of mx_begin(), see mx_runs.
+     */
+    class mx_run_iterator {
+    private:
+        using self_type = mx_run_iterator;
+    public:
+        using iterator_category = std::forward_iterator_tag;
+        using value_type = mx_run_type;
+        using pointer = const value_type *;
+        using reference = const value_type &;
+        using difference_type = std::ptrdiff_t;
+
+        mx_run_iterator() = default;
+
+        pointer operator->() const noexcept {
+            return &run;
+        }
+
+        reference operator*() const noexcept {
+            return run;
+        }
+
+        self_type &operator++() {
+            auto next = run.last;
+            ++next;
+            index += run.length;
+            run = function->mx_run_at(index, next);
+            return *this;
+        }
+
+        self_type operator++(int) {
+            self_type i = *this;
+            ++*this;
+            return i;
+        }
+
+        bool operator==(const self_type &rhs) const noexcept {
+            return index == rhs.index;
+        }
+
+        bool operator!=(const self_type &rhs) const noexcept {
+            return index != rhs.index;
+        }
+
+    private:
+        friend class FunctionMaxima;
+
+        const FunctionMaxima *function = nullptr;
+        size_type index = 0;//of the first maximum of run in the order of mx_begin()
+        mx_run_type run;
+
+        mx_run_iterator(const FunctionMaxima *function, size_type index, mx_position_t first)
+                : function(function), index(index), run(function->mx_run_at(index, first)) {}
+    };
+
+    /**
+     * The plateaus of maxima, as returned by mx_runs.
+     * Invalidated by any modification of the function, like the iterators.
+     */
+    class mx_runs_type {
+    public:
+        mx_run_iterator begin() const {
+            return mx_run_iterator(function, 0, function->store.mx_begin());
+        }
+
+        mx_run_iterator end() const {
+            return mx_run_iterator(function, function->mx_size(), function->store.mx_end());
+        }
+
+    private:
+        friend class FunctionMaxima;
+
+        const FunctionMaxima *function;
+
+        explicit mx_runs_type(const FunctionMaxima *function) : function(function) {}
+    };
+
+private:
+    /**
+     * The plateau starting with the k-th maximum first (first == mx_end() for k == mx_size()).
+     * A run-length index keeps every plateau as one run, so its last maximum is found in O(1)
+     * (O(log n) for flat storage) and k is not needed.
+     * Otherwise the maxima k..k+j form a plateau iff the (k+j)-th one has the value of the k-th and is the point
+     * j places after it, which holds for a prefix of j (the maxima of equal values come by increasing
+     * argument, so the (k+j)-th one is never before that point). The first log^2 n maxima are walked,
+     * which costs less than the O(log l) probes of O(log n) steps each that find the end of a plateau
+     * of length l by galloping; longer plateaus are galloped over: O(log^2 n + log n log l) in total.
+     * A maximum followed by a smaller one is a plateau of its own, found with one comparison
+     * and without searching for its point, so a function without plateaus is walked like mx_begin().
+     */
+    mx_run_type mx_run_at(size_type k, mx_position_t first) const {
+        mx_run_type run;
+        run.first = run.last = first;
+        if (k >= store.mx_size())
+            return run;
+        if constexpr (storage_t::run_length) {
+            run.last = store.mx_run_last(first);
+            run.length = storage_t::mx_run_size(first);
+            return run;
+        }
+        point_type const &head = storage_t::mx_point(first);
+        auto max = first;
+        if (++max == store.mx_end() || storage_t::mx_point(max).value() < head.value()) {
+            run.length = 1;
+            return run;
+        }
+        auto is_next = [&head](mx_position_t const &max, position_t const &point) {
+            point_type const &next = storage_t::mx_point(max);
+            return !(next.value() < head.value()) && !(storage_t::arg(point) < next.arg());
+        };
+        size_type in = 0;//the maxima k..k+in form a plateau
+        size_type depth = balanced_depth(store.size());
+        max = first;
+        auto point = store.find(head.arg());
+        while (in < depth * depth && ++max != store.mx_end() && is_next(max, ++point))
+            ++in;
+        if (in < depth * depth) {
+            run.last = --max;
+            run.length = in + 1;
+            return run;
+        }
+        run.last = max;
+        size_type out = store.mx_size() - k;//the maxima k..k+out do not
+        size_type first_rank = store.rank(head.arg());
+        auto in_run = [&](size_type j) {
+            return is_next(store.mx_nth(k + j), store.nth(first_rank + j));
+        };
+        size_type walked = in;
+        for (size_type step = 1; in + step < out; step *= 2) {
+            if (!in_run(in + step)) {
+                out = in + step;
+                break;
+            }
+            in += step;
+        }
+        while (out - in > 1) {
+            size_type middle = in + (out - in) / 2;
+            if (in_run(middle))
+                in = middle;
+            else
+                out = middle;
+        }
+        if (in != walked)
+            run.last = store.mx_nth(k + in);
+        run.length = in + 1;
+        return run;
+    }
+
+public:
+    /**
+     * @brief Local maxima grouped into plateaus [first_arg(), last_arg()] of equal values, in the order
+     * of mx_begin(). The run-length storages keep one index entry per plateau, so every plateau costs O(1)
+     * (O(log n) for flat storage). The persistent one keeps an entry for every maximum: a plateau of k > 1
+     * maxima costs O(min(k, log^2 n) + log n log k) there and a single maximum O(1).
+     */
+    mx_runs_type mx_runs() const {
+        sync_maxima();
+        return mx_runs_type(this);
+    }
+
+    /**
+     * Walks the maxima by increasing argument, see mx_range.
+     */
+    class mx_range_iterator {
+    private:
+        using self_type = mx_range_iterator;
+        using wrapped_iterator_t = typename storage_t::mx_argument_position;
+    public:
+        using iterator_category = std::bidirectional_iterator_tag;
+        using value_type = point_type;
+        using pointer = const value_type *;
+        using reference = const value_type &;
+        using difference_type = std::ptrdiff_t;
+
+        mx_range_iterator() = default;
+
+        pointer operator->() const noexcept {
+            return &storage_t::mx_argument_point(wrapped_iterator);
+        }
+
+        reference operator*() const noexcept {
+            return storage_t::mx_argument_point(wrapped_iterator);
+        }
+
+        self_type &operator++() {
+            ++wrapped_iterator;
+            return *this;
+        }
+
+        self_type operator++(int) {
+            self_type i = *this;
+            ++wrapped_iterator;
+            return i;
+        }
+
+        self_type &operator--() {
+            --wrapped_iterator;
+            return *this;
+        }
+
+        self_type operator--(int) {
+            self_type i = *this;
+            --wrapped_iterator;
+            return i;
+        }
+
+        bool operator==(const self_type &rhs) const noexcept {
+            return wrapped_iterator == rhs.wrapped_iterator;
+        }
+
+        bool operator!=(const self_type &rhs) const noexcept {
+            return wrapped_iterator != rhs.wrapped_iterator;
+        }
+
+    private:
+        friend class FunctionMaxima;
+
+        wrapped_iterator_t wrapped_iterator;
+
+        mx_range_iterator(wrapped_iterator_t iterator_to_wrap) : wrapped_iterator(iterator_to_wrap) {}
+    };
+
+    /**
+     * The maxima with arguments in a closed interval, as returned by mx_range.
+     * Invalidated by any modification of the function, like the iterators.
+     */
+    class mx_range_type {
+    public:
+        mx_range_iterator begin() const noexcept {
+            return first;
+        }
+
+        mx_range_iterator end() const noexcept {
+            return last;
+        }
+
+        bool empty() const noexcept {
+            return first == last;
+        }
+
+    private:
+        friend class FunctionMaxima;
+
+        mx_range_iterator first;
+        mx_range_iterator last;
+
+        mx_range_type(mx_range_iterator first, mx_range_iterator last) : first(first), last(last) {}
+    };
+
+    /**
+     * @brief Local maxima with arguments in [lo, hi], by increasing argument, in O(log n) plus the walk.
+     * The range is empty when hi < lo.
+     */
+    mx_range_type mx_range(A const &lo, A const &hi) const {
+        sync_maxima();
+        auto first = store.mx_argument_lower_bound(lo);
+        if (hi < lo)
+            return mx_range_type(first, first);
+        return mx_range_type(first, store.mx_argument_upper_bound(hi));
+    }
+
+    /**
+     * @brief Point with the greatest value among arguments in [lo, hi], the smallest such argument on ties.
+     * The greatest value is taken either at a local maximum or at one of the two points closest
+     * to the ends of the window, so only those are compared: O(log n + k) for k maxima in the window.
+     * Returns end() if no argument lies in [lo, hi].
+     */
+    iterator max_in_range(A const &lo, A const &hi) const {
+        if (hi < lo)
+            return end();
+        auto first = store.lower_bound(lo);
+        if (first == store.end() || hi < storage_t::arg(first))
+            return end();
+        auto last = store.lower_bound(hi);
+        if (last == store.end() || hi < storage_t::arg(last))
+            --last;
+
+        auto best = first;
+        A const *best_max = nullptr;
+        V const *best_value = &storage_t::value(first);
+        for (auto const &max : mx_range(lo, hi)) {
+            if (*best_value < max.value()) {
+                best_max = &max.arg();
+                best_value = &max.value();
+            }
+        }
+        if (*best_value < storage_t::value(last))
+            return iterator(last);
+        if (best_max != nullptr)
+            best = store.find(*best_max);
+        return iterator(best);
+    }
+
+};
+
+/**
+ * FunctionMaxima allocating from a std::pmr::memory_resource, e.g. a std::pmr::monotonic_buffer_resource
+ * arena shared by short-lived functions or a std::pmr::unsynchronized_pool_resource owned by one thread.
+ */
+template<typename A, typename V, typename Storage = MapStorage>
+using PmrFunctionMaxima = FunctionMaxima<A, V, Storage, std::pmr::polymorphic_allocator<std::byte>>;
+
+/**
+ * Function A -> V split by argument into shards, each one a FunctionMaxima guarded by its own mutex,
+ * so set_value and erase calls landing in different shards run in parallel.
+ * Shard i holds the arguments in [boundaries[i - 1], boundaries[i]) (the first and the last shard are unbounded).
+ * A shard computes its maxima without its neighbours in other shards, which can only make its first or last
+ * point a maximum too many. The merged view of the maxima skips those, comparing them with the nearest
+ * points of the neighbouring non-empty shards, and orders the rest like FunctionMaxima::mx_begin() does.
+ * Iterators are not synchronized with modifications: walk the function when no thread modifies it.
+ */
+template<typename A, typename V, typename Storage = MapStorage>
+class ShardedFunctionMaxima {
+public:
+    using function_type = FunctionMaxima<A, V, Storage>;
+    using point_type = typename function_type::point_type;
+    using size_type = typename function_type::size_type;
+
+private:
+    struct shard {
+        mutable std::mutex mutex;
+        function_type function;
+    };
+
+    std::vector<A> boundaries;
+    std::vector<shard> shards;
+
+    shard &route(A const &a) {
+        return shards[static_cast<size_type>(std::upper_bound(boundaries.begin(), boundaries.end(), a) - boundaries.begin())];
+    }
+
+    const shard &route(A const &a) const {
+        return shards[static_cast<size_type>(std::upper_bound(boundaries.begin(), boundaries.end(), a) - boundaries.begin())];
+    }
+
+    static bool same_argument(A const &lhs, A const &rhs) {
+        return !(lhs < rhs) && !(rhs < lhs);
+    }
+
+    /* the values of the nearest points in other shards, nullptr at the ends of the function */
+    struct shard_edges {
+        V const *before = nullptr;
+        V const *after = nullptr;
+    };
+
+    std::vector<shard_edges> edges() const {
+        std::vector<shard_edges> result(shards.size());
+        V const *last_value = nullptr;
+        for (size_type i = 0; i < shards.size(); ++i) {
+            result[i].before = last_value;
+            auto &function = shards[i].function;
+            if (function.size() > 0)
+                last_value = &std::prev(function.end())->value();
+        }
+        V const *first_value = nullptr;
+        for (size_type i = shards.size(); i-- > 0;) {
+            result[i].after = first_value;
+            auto &function = shards[i].function;
+            if (function.size() > 0)
+                first_value = &function.begin()->value();
+        }
+        return result;
+    }
+
+    /* a maximum of the shard that is not a maximum of the whole function */
+    bool is_spurious(const function_type &function, const shard_edges &edge, const point_type &max) const {
+        if (edge.before != nullptr && max.value() < *edge.before && same_argument(max.arg(), function.begin()->arg()))
+            return true;
+        return edge.after != nullptr && max.value() < *edge.after &&
+               same_argument(max.arg(), std::prev(function.end())->arg());
+    }
+
+public:
+    /**
+     * @brief Creates an empty function with boundaries.size() + 1 shards
+     * Throws InvalidArg unless the boundaries are strictly increasing.
+     */
+    explicit ShardedFunctionMaxima(std::vector<A> shard_boundaries) : boundaries(std::move(shard_boundaries)),
+                                                                      shards(boundaries.size() + 1) {
+        for (size_type i = 1; i < boundaries.size(); ++i)
+            if (!(boundaries[i - 1] < boundaries[i]))
+                throw InvArg;
+    }
+
+    ShardedFunctionMaxima(const ShardedFunctionMaxima &other) = delete;
+
+    ShardedFunctionMaxima &operator=(const ShardedFunctionMaxima &other) = delete;
+
+    /**
+     * @brief Thread-safe set_value, locks only the shard of a
+     */
+    void set_value(A const &a, V const &v) {
+        auto &target = route(a);
+        std::lock_guard<std::mutex> lock(target.mutex);
+        target.function.set_value(a, v);
+    }
+
+    /**
+     * @brief Thread-safe erase, locks only the shard of a
+     */
+    void erase(A const &a) {
+        auto &target = route(a);
+        std::lock_guard<std::mutex> lock(target.mutex);
+        target.function.erase(a);
+    }
+
+    /**
+     * @brief Thread-safe value_at, returns a copy as the point may change as soon as the shard is unlocked
+     */
+    V value_at(A const &a) const {
+        auto &target = route(a);
+        std::lock_guard<std::mutex> lock(target.mutex);
+        return target.function.value_at(a);
+    }
+
+    /**
+     * @brief Thread-safe number of points, shards are counted one by one
+     */
+    size_type size() const {
+        size_type result = 0;
+        for (auto &part : shards) {
+            std::lock_guard<std::mutex> lock(part.mutex);
+            result += part.function.size();
+        }
+        return result;
+    }
+
+    size_type shard_count() const noexcept {
+        return shards.size();
+    }
+
+    /**
+     * @brief The function kept by the i-th shard, not synchronized with modifications
+     */
+    const function_type &shard_function(size_type i) const {
+        return shards[i].function;
+    }
+
+    /**
+     * @brief Thread-safe number of maxima of the whole function, O(number of shards)
+     * Locks all shards (in the order of the shards) for the duration of the count.
+     */
+    size_type mx_size() const {
+        std::vector<std::unique_lock<std::mutex>> locks;
+        locks.reserve(shards.size());
+        for (auto &part : shards)
+            locks.emplace_back(part.mutex);
+        auto edge = edges();
+        size_type result = 0;
+        for (size_type i = 0; i < shards.size(); ++i) {
+            auto &function = shards[i].function;
+            result += function.mx_size();
+            if (function.size() == 0)
+                continue;
+            auto first = function.begin();
+            auto last = std::prev(function.end());
+            auto after_first = std::next(first);
+            if (after_first == function.end() || !(first->value() < after_first->value()))
+                result -= is_spurious(function, edge[i], *first) ? 1 : 0;
+            if (first == last)
+                continue;
+            if (!(last->value() < std::prev(last)->value()))
+                result -= is_spurious(function, edge[i], *last) ? 1 : 0;
+        }
+        return result;
+    }
+
+    /**
+     * Walks the points of all shards by increasing argument.
+     */
+    class iterator {
+    private:
+        using self_type = iterator;
+        using wrapped_iterator_t = typename function_type::iterator;
+    public:
+        using iterator_category = std::forward_iterator_tag;
+        using value_type = point_type;
+        using pointer = const value_type *;
+        using reference = const value_type &;
+        using difference_type = std::ptrdiff_t;
+
+        iterator() = default;
+
+        pointer operator->() const noexcept {
+            return &*wrapped_iterator;
+        }
+
+        reference operator*() const noexcept {
+            return *wrapped_iterator;
+        }
+
+        self_type &operator++() {
+            ++wrapped_iterator;
+            skip_empty();
+            return *this;
+        }
+
+        self_type operator++(int) {
+            self_type i = *this;
+            ++*this;
+            return i;
+        }
+
+        bool operator==(const self_type &rhs) const noexcept {
+            return shard_index == rhs.shard_index && (shard_index == owner->shards.size() ||
+                                                      wrapped_iterator == rhs.wrapped_iterator);
+        }
+
+        bool operator!=(const self_type &rhs) const noexcept {
+            return !(*this == rhs);
+        }
+
+    private:
+        friend class ShardedFunctionMaxima;
+
+        const ShardedFunctionMaxima *owner = nullptr;
+        size_type shard_index = 0;
+        wrapped_iterator_t wrapped_iterator;
+
+        iterator(const ShardedFunctionMaxima *owner, size_type shard_index) : owner(owner), shard_index(shard_index) {
+            if (shard_index < owner->shards.size())
+                wrapped_iterator = owner->shards[shard_index].function.begin();
+            skip_empty();
+        }
+
+        void skip_empty() {
+            while (shard_index < owner->shards.size() &&
+                   wrapped_iterator == owner->shards[shard_index].function.end()) {
+                if (++shard_index < owner->shards.size())
+                    wrapped_iterator = owner->shards[shard_index].function.begin();
+            }
+        }
+    };
+
+    iterator begin() const {
+        return iterator(this, 0);
+    }
+
+    iterator end() const {
+        return iterator(this, shards.size());
+    }
+
+    /**
+     * Walks the maxima of the whole function from the greatest value, ties by increasing argument,
+     * merging the maxima of the shards and skipping the spurious ones.
+     * Each step compares the current maxima of all shards. Not synchronized with modifications,
+     * like iterator.
+     */
+    class mx_iterator {
+    private:
+        using self_type = mx_iterator;
+        using wrapped_iterator_t = typename function_type::mx_iterator;
+    public:
+        using iterator_category = std::forward_iterator_tag;
+        using value_type = point_type;
+        using pointer = const value_type *;
+        using reference = const value_type &;
+        using difference_type = std::ptrdiff_t;
+
+        mx_iterator() = default;
+
+        pointer operator->() const noexcept {
+            return &*cursors[current].position;
+        }
+
+        reference operator*() const noexcept {
+            return *cursors[current].position;
+        }
+
+        self_type &operator++() {
+            ++cursors[current].position;
+            skip_spurious(current);
+            pick();
+            return *this;
+        }
+
+        self_type operator++(int) {
+            self_type i = *this;
+            ++*this;
+            return i;
+        }
+
+        bool operator==(const self_type &rhs) const noexcept {
+            return current == rhs.current && (current == cursors.size() ||
+                                              cursors[current].position == rhs.cursors[current].position);
+        }
+
+        bool operator!=(const self_type &rhs) const noexcept {
+            return !(*this == rhs);
+        }
+
+    private:
+        friend class ShardedFunctionMaxima;
+
+        struct cursor {
+            wrapped_iterator_t position;
+            wrapped_iterator_t end;
+            shard_edges edge;
+        };
+
+        const ShardedFunctionMaxima *owner = nullptr;
+        std::vector<cursor> cursors;
+        size_type current = 0;//cursors.size() at the end
+
+        mx_iterator(const ShardedFunctionMaxima *owner, bool at_end) : owner(owner) {
+            if (at_end) {
+                current = owner->shards.size();
+                cursors.resize(current);
+                return;
+            }
+            auto edge = owner->edges();
+            for (size_type i = 0; i < owner->shards.size(); ++i) {
+                auto &function = owner->shards[i].function;
+                cursors.push_back(cursor{function.mx_begin(), function.mx_end(), edge[i]});
+                skip_spurious(i);
+            }
+            pick();
+        }
+
+        void skip_spurious(size_type i) {
+            auto &c = cursors[i];
+            while (c.position != c.end && owner->is_spurious(owner->shards[i].function, c.edge, *c.position))
+                ++c.position;
+        }
+
+        void pick() {
+            current = cursors.size();
+            for (size_type i = 0; i < cursors.size(); ++i) {
+                if (cursors[i].position == cursors[i].end)
+                    continue;
+                if (current == cursors.size()) {
+                    current = i;
+                    continue;
+                }
+                auto &candidate = *cursors[i].position;
+                auto &best = *cursors[current].position;
+                //shards hold disjoint increasing argument ranges, so on equal values the earlier shard goes first
+                if (best.value() < candidate.value())
+                    current = i;
+            }
+        }
+    };
+
+    mx_iterator mx_begin() const {
+        return mx_iterator(this, false);
     }
 
     mx_iterator mx_end() const {
-        return mx_iterator(maxima_set.end());
+        return mx_iterator(this, true);
+    }
+};
+
+/**
+ * Many small functions A -> V (series), one per Key, e.g. one per entity. All series share one pool
+ * of memory owned by the store (a std::pmr::unsynchronized_pool_resource on top of upstream), which
+ * holds the series themselves and all their points and maxima, so many tiny series are packed together
+ * instead of scattered across the heap, without a shared pointer per point.
+ * A series of at most SmallSize points is kept in the small form: its points in one pool-allocated array
+ * sorted by argument (growing geometrically up to SmallSize) and its maxima as an array of their indices
+ * in the order of mx_begin(). A modification classifies again only the written point and its neighbours
+ * and finds their places among the maxima by binary search. A series that outgrows the small form
+ * is promoted to a function_type (NodeStorage) allocated from the same pool; shrink_to_fit brings
+ * series that shrank back to the small form. Either way a series is walked through the iterator,
+ * mx_iterator and point_type of function_type, and the store walks all series by increasing key.
+ * Not thread-safe. Requires A and V to be nothrow move constructible and assignable.
+ */
+template<typename Key, typename A, typename V, std::size_t SmallSize>
+class FunctionMaximaStore {
+    static_assert(SmallSize >= 1 && SmallSize <= 255, "FunctionMaximaStore keeps small series maxima as 8-bit indices");
+    static_assert(std::is_nothrow_move_constructible<A>::value && std::is_nothrow_move_assignable<A>::value &&
+                  std::is_nothrow_move_constructible<V>::value && std::is_nothrow_move_assignable<V>::value,
+                  "FunctionMaximaStore requires nothrow movable arguments and values");
+
+public:
+    using function_type = PmrFunctionMaxima<A, V, NodeStorage>;
+    using point_type = typename function_type::point_type;
+    using size_type = typename function_type::size_type;
+
+    /**
+     * Walks the points of a series by increasing argument, like FunctionMaxima::iterator.
+     */
+    class iterator {
+    private:
+        using self_type = iterator;
+        using wrapped_iterator_t = typename function_type::iterator;
+    public:
+        using iterator_category = std::bidirectional_iterator_tag;
+        using value_type = point_type;
+        using pointer = const value_type *;
+        using reference = const value_type &;
+        using difference_type = std::ptrdiff_t;
+
+        iterator() = default;
+
+        pointer operator->() const noexcept {
+            return small ? point : &*wrapped_iterator;
+        }
+
+        reference operator*() const noexcept {
+            return *operator->();
+        }
+
+        self_type &operator++() {
+            if (small)
+                ++point;
+            else
+                ++wrapped_iterator;
+            return *this;
+        }
+
+        self_type operator++(int) {
+            self_type i = *this;
+            ++*this;
+            return i;
+        }
+
+        self_type &operator--() {
+            if (small)
+                --point;
+            else
+                --wrapped_iterator;
+            return *this;
+        }
+
+        self_type operator--(int) {
+            self_type i = *this;
+            --*this;
+            return i;
+        }
+
+        bool operator==(const self_type &rhs) const noexcept {
+            return small ? point == rhs.point : wrapped_iterator == rhs.wrapped_iterator;
+        }
+
+        bool operator!=(const self_type &rhs) const noexcept {
+            return !(*this == rhs);
+        }
+
+    private:
+        friend class FunctionMaximaStore;
+
+        bool small = true;
+        point_type const *point = nullptr;
+        wrapped_iterator_t wrapped_iterator;
+
+        explicit iterator(point_type const *point) : point(point) {}
+
+        explicit iterator(wrapped_iterator_t iterator_to_wrap) : small(false), wrapped_iterator(iterator_to_wrap) {}
+    };
+
+    /**
+     * Walks the maxima of a series like FunctionMaxima::mx_iterator: from the greatest value,
+     * ties by increasing argument.
+     */
+    class mx_iterator {
+    private:
+        using self_type = mx_iterator;
+        using wrapped_iterator_t = typename function_type::mx_iterator;
+    public:
+        using iterator_category = std::bidirectional_iterator_tag;
+        using value_type = point_type;
+        using pointer = const value_type *;
+        using reference = const value_type &;
+        using difference_type = std::ptrdiff_t;
+
+        mx_iterator() = default;
+
+        pointer operator->() const noexcept {
+            return small ? points + *index : &*wrapped_iterator;
+        }
+
+        reference operator*() const noexcept {
+            return *operator->();
+        }
+
+        self_type &operator++() {
+            if (small)
+                ++index;
+            else
+                ++wrapped_iterator;
+            return *this;
+        }
+
+        self_type operator++(int) {
+            self_type i = *this;
+            ++*this;
+            return i;
+        }
+
+        self_type &operator--() {
+            if (small)
+                --index;
+            else
+                --wrapped_iterator;
+            return *this;
+        }
+
+        self_type operator--(int) {
+            self_type i = *this;
+            --*this;
+            return i;
+        }
+
+        bool operator==(const self_type &rhs) const noexcept {
+            return small ? index == rhs.index : wrapped_iterator == rhs.wrapped_iterator;
+        }
+
+        bool operator!=(const self_type &rhs) const noexcept {
+            return !(*this == rhs);
+        }
+
+    private:
+        friend class FunctionMaximaStore;
+
+        bool small = true;
+        point_type const *points = nullptr;
+        std::uint8_t const *index = nullptr;
+        wrapped_iterator_t wrapped_iterator;
+
+        mx_iterator(point_type const *points, std::uint8_t const *index) : points(points), index(index) {}
+
+        explicit mx_iterator(wrapped_iterator_t iterator_to_wrap) : small(false), wrapped_iterator(iterator_to_wrap) {}
+    };
+
+    /**
+     * A single series of the store, created by the store (see operator[]) in its pool.
+     * Modifications guarantee strong exception safety, like those of FunctionMaxima,
+     * and invalidate the iterators of the series.
+     */
+    class series {
+    public:
+        explicit series(std::pmr::memory_resource *resource) : points(resource), maxima(resource) {}
+
+        series(const series &other) = delete;
+
+        series &operator=(const series &other) = delete;
+
+        size_type size() const noexcept {
+            return full ? full->size() : points.size();
+        }
+
+        /* whether the series is kept in the small form */
+        bool is_small() const noexcept {
+            return !full;
+        }
+
+        iterator begin() const {
+            return full ? iterator(full->begin()) : iterator(points.data());
+        }
+
+        iterator end() const {
+            return full ? iterator(full->end()) : iterator(points.data() + points.size());
+        }
+
+        iterator find(A const &a) const {
+            if (full)
+                return iterator(full->find(a));
+            auto point = lower_bound(a);
+            if (point == points.end() || a < point->arg())
+                return end();
+            return iterator(&*point);
+        }
+
+        V const &value_at(A const &a) const {
+            auto point = find(a);
+            if (point == end())
+                throw InvArg;
+            return point->value();
+        }
+
+        mx_iterator mx_begin() const {
+            return full ? mx_iterator(full->mx_begin()) : mx_iterator(points.data(), maxima.data());
+        }
+
+        mx_iterator mx_end() const {
+            return full ? mx_iterator(full->mx_end()) : mx_iterator(points.data(), maxima.data() + maxima.size());
+        }
+
+        size_type mx_size() const {
+            return full ? full->mx_size() : maxima.size();
+        }
+
+        /**
+         * @brief Like FunctionMaxima::set_value, promotes the series to function_type when it outgrows SmallSize
+         */
+        void set_value(A const &a, V const &v) {
+            if (full) {
+                full->set_value(a, v);
+                return;
+            }
+            auto position = lower_bound(a);
+            auto i = static_cast<size_type>(position - points.begin());
+            std::uint8_t order[SmallSize];
+            if (position != points.end() && !(a < position->arg())) {
+                if (!(v < position->value()) && !(position->value() < v))
+                    return;
+                V staged(v);
+                size_type count = update_maxima(points.size(), i, i, 0, order, [&](size_type k) {
+                    return k == i ? std::make_pair(&points[k].arg(), &staged) :
+                           std::make_pair(&points[k].arg(), &points[k].value());
+                });
+                reserve_for(maxima, count);
+                points[i].val = std::move(staged);//These lines are noexcept
+                maxima.assign(order, order + count);//
+                return;
+            }
+            if (points.size() == SmallSize) {
+                promote(a, v);
+                return;
+            }
+            point_type added(a, v);
+            size_type count = update_maxima(points.size() + 1, i, i, 1, order, [&](size_type k) {
+                point_type const &p = k < i ? points[k] : k == i ? added : points[k - 1];
+                return std::make_pair(&p.arg(), &p.value());
+            });
+            reserve_for(points, points.size() + 1);
+            reserve_for(maxima, count);
+            points.insert(points.begin() + i, std::move(added));//These lines are noexcept
+            maxima.assign(order, order + count);                 //
+        }
+
+        /**
+         * @brief Like FunctionMaxima::erase, the series stays in its form (see shrink_to_fit)
+         */
+        void erase(A const &a) {
+            if (full) {
+                full->erase(a);
+                return;
+            }
+            auto position = lower_bound(a);
+            if (position == points.end() || a < position->arg())
+                return;
+            auto i = static_cast<size_type>(position - points.begin());
+            std::uint8_t order[SmallSize];
+            size_type count = update_maxima(points.size() - 1, i, i + 1, -1, order, [&](size_type k) {
+                point_type const &p = points[k < i ? k : k + 1];
+                return std::make_pair(&p.arg(), &p.value());
+            });
+            reserve_for(maxima, count);
+            points.erase(position);             //These lines are noexcept
+            maxima.assign(order, order + count);//
+        }
+
+        /**
+         * @brief Brings a promoted series of at most SmallSize points back to the small form
+         */
+        void shrink_to_fit() {
+            if (!full || full->size() > SmallSize)
+                return;
+            std::pmr::vector<point_type> small_points(points.get_allocator());
+            std::pmr::vector<std::uint8_t> small_maxima(maxima.get_allocator());
+            small_points.reserve(full->size());
+            small_maxima.reserve(full->mx_size());
+            for (auto const &point : *full)
+                small_points.push_back(point);
+            for (auto max = full->mx_begin(); max != full->mx_end(); ++max)
+                small_maxima.push_back(static_cast<std::uint8_t>(full->rank(max->arg())));
+            points.swap(small_points);//These lines are noexcept
+            maxima.swap(small_maxima);//
+            full.reset();             //
+        }
+
+    private:
+        /* destroys a promoted series in the pool it was allocated from */
+        struct full_deleter {
+            void operator()(function_type *function) const noexcept {
+                std::pmr::polymorphic_allocator<function_type> allocator(function->get_allocator().resource());
+                function->~function_type();
+                allocator.deallocate(function, 1);
+            }
+        };
+
+        std::pmr::vector<point_type> points;//the small form, empty once promoted
+        std::pmr::vector<std::uint8_t> maxima;
+        std::unique_ptr<function_type, full_deleter> full;
+
+        /* makes room for n elements, growing geometrically up to SmallSize like FlatStorage's reserve_one */
+        template<typename Vector>
+        static void reserve_for(Vector &vector, size_type n) {
+            if (vector.capacity() < n)
+                vector.reserve(std::min(std::max(n, 2 * vector.capacity()), SmallSize));
+        }
+
+        typename std::pmr::vector<point_type>::const_iterator lower_bound(A const &a) const {
+            return std::lower_bound(points.begin(), points.end(), a,
+                                    [](point_type const &point, A const &arg) { return point.arg() < arg; });
+        }
+
+        /**
+         * The maxima after writing the point at index i of the n points given by point_at(k) (pointers
+         * to the argument and the value of the k-th one), as indices in the order of mx_begin() written
+         * to order. The old point at index i was changed (shift 0), or the point was inserted before it
+         * (shift 1), or the old point at index from was erased (shift -1, from is i + 1). Old maxima
+         * from index from on move by shift; only the points next to the written one (new indices i - 1
+         * to i + 1, or to i after an erasure) are classified again and inserted by binary search.
+         * Only compares and writes order, so a comparison that throws leaves the series intact.
+         */
+        template<typename PointAt>
+        size_type update_maxima(size_type n, size_type i, size_type from, int shift, std::uint8_t *order,
+                                PointAt const &point_at) const {
+            size_type first = i == 0 ? 0 : i - 1;
+            size_type last = shift < 0 ? i + 1 : i + 2;
+            size_type count = 0;
+            for (std::uint8_t max : maxima) {
+                auto moved = static_cast<size_type>(max < from ? max : max + shift);
+                if (moved < first || moved >= last)
+                    order[count++] = static_cast<std::uint8_t>(moved);
+            }
+            for (size_type k = first; k < std::min(last, n); ++k) {
+                auto p = point_at(k);
+                if ((k != 0 && *p.second < *point_at(k - 1).second) ||
+                    (k + 1 != n && *p.second < *point_at(k + 1).second))
+                    continue;
+                std::uint8_t *place = std::upper_bound(order, order + count, k, [&](size_type, std::uint8_t max) {
+                    auto q = point_at(max);
+                    return maxima_order_less(*p.second, *p.first, *q.second, *q.first);
+                });
+                std::copy_backward(place, order + count, order + count + 1);
+                *place = static_cast<std::uint8_t>(k);
+                ++count;
+            }
+            return count;
+        }
+
+        /* builds the function_type of the points and (a, v) aside by one linear assign, then drops the small form */
+        void promote(A const &a, V const &v) {
+            std::pmr::polymorphic_allocator<function_type> allocator(points.get_allocator().resource());
+            std::pmr::vector<std::pair<A const &, V const &>> merged(allocator);
+            merged.reserve(points.size() + 1);
+            auto position = lower_bound(a);
+            for (auto point = points.begin(); point != position; ++point)
+                merged.emplace_back(point->arg(), point->value());
+            merged.emplace_back(a, v);
+            for (auto point = position; point != points.end(); ++point)
+                merged.emplace_back(point->arg(), point->value());
+            function_type *function = allocator.allocate(1);
+            try {
+                ::new(static_cast<void *>(function)) function_type(merged.begin(), merged.end(), allocator);
+            } catch (...) {
+                allocator.deallocate(function, 1);
+                throw;
+            }
+            std::unique_ptr<function_type, full_deleter> promoted(function);
+            full.swap(promoted);                                                //These lines are noexcept
+            std::pmr::vector<point_type>(points.get_allocator()).swap(points);  //
+            std::pmr::vector<std::uint8_t>(maxima.get_allocator()).swap(maxima);//
+        }
+    };
+
+private:
+    using series_map_t = std::map<Key, series, std::less<Key>,
+            std::pmr::polymorphic_allocator<std::pair<const Key, series>>>;
+
+    std::pmr::unsynchronized_pool_resource pool;
+    series_map_t series_map;
+
+public:
+    /* walks the series as (key, series) pairs by increasing key */
+    using series_iterator = typename series_map_t::const_iterator;
+
+    explicit FunctionMaximaStore(std::pmr::memory_resource *upstream = std::pmr::get_default_resource())
+            : pool(upstream), series_map(&pool) {}
+
+    FunctionMaximaStore(const FunctionMaximaStore &other) = delete;
+
+    FunctionMaximaStore &operator=(const FunctionMaximaStore &other) = delete;
+
+    /**
+     * @brief Number of series
+     */
+    size_type size() const noexcept {
+        return series_map.size();
+    }
+
+    bool contains(Key const &key) const {
+        return series_map.find(key) != series_map.end();
+    }
+
+    /**
+     * @brief The series of key, created empty if there is none
+     */
+    series &operator[](Key const &key) {
+        return series_map.try_emplace(key, &pool).first->second;
+    }
+
+    /**
+     * @brief The series of key, throws InvalidArg if there is none
+     */
+    const series &at(Key const &key) const {
+        auto found = series_map.find(key);
+        if (found == series_map.end())
+            throw InvArg;
+        return found->second;
+    }
+
+    series &at(Key const &key) {
+        auto found = series_map.find(key);
+        if (found == series_map.end())
+            throw InvArg;
+        return found->second;
+    }
+
+    /**
+     * @brief set_value in the series of key, which is created if there is none. Strong exception safety.
+     */
+    void set_value(Key const &key, A const &a, V const &v) {
+        auto [position, created] = series_map.try_emplace(key, &pool);
+        try {
+            position->second.set_value(a, v);
+        } catch (...) {
+            if (created)
+                series_map.erase(position);
+            throw;
+        }
+    }
+
+    /**
+     * @brief erase in the series of key, if there is one; an emptied series is kept
+     */
+    void erase(Key const &key, A const &a) {
+        auto found = series_map.find(key);
+        if (found != series_map.end())
+            found->second.erase(a);
+    }
+
+    /**
+     * @brief Drops the series of key with all its points, if there is one
+     */
+    void erase_series(Key const &key) {
+        series_map.erase(key);
+    }
+
+    /**
+     * @brief Brings every promoted series of at most SmallSize points back to the small form
+     */
+    void shrink_to_fit() {
+        for (auto &entry : series_map)
+            entry.second.shrink_to_fit();
+    }
+
+    series_iterator begin() const {
+        return series_map.begin();
+    }
+
+    series_iterator end() const {
+        return series_map.end();
     }
 
+    series_iterator find(Key const &key) const {
+        return series_map.find(key);
+    }
 };
 
-#endif //FUNCTION_MAXIMA_H
\ No newline at end of file
+#endif //FUNCTION_MAXIMA_H
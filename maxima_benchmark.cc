@@ -0,0 +1,418 @@
+// Benchmark of the FunctionMaxima hot paths.
+//
+//   cmake -S . -B build -DCMAKE_BUILD_TYPE=Release && cmake --build build --target maxima_benchmark
+//   build/maxima_benchmark [operations] [filter]
+//
+// Every workload runs on every storage policy with int, a heavy type (64 character strings) and
+// an opaque Secret-like type as both arguments and values. Only the lines containing filter
+// (e.g. "flat", "heavy" or "churn") are run. Reports time, heap allocations and argument/value
+// comparisons per operation. Comparisons of int are counted in a second, untimed run of the same
+// workload with a counting wrapper of int. Only the calling thread is counted, so the workers of
+// "rebuild_par" are not.
+
+#include "function_maxima.h"
+
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <new>
+#include <random>
+#include <string>
+#include <vector>
+
+namespace {
+
+thread_local std::uint64_t allocations = 0;
+thread_local std::uint64_t comparisons = 0;
+
+struct Counted {
+  int value;
+  bool operator<(const Counted &other) const {
+    ++comparisons;
+    return value < other.value;
+  }
+};
+
+class Heavy {
+public:
+  explicit Heavy(long n) {
+    std::string digits = std::to_string(n);
+    text = std::string(64 - digits.size(), '0') + digits;
+  }
+  bool operator<(const Heavy &other) const {
+    ++comparisons;
+    return text < other.text;
+  }
+private:
+  std::string text;
+};
+
+class Opaque {
+public:
+  static Opaque create(long n) {
+    return Opaque(static_cast<int>(n));
+  }
+  bool operator<(const Opaque &other) const {
+    ++comparisons;
+    return value < other.value;
+  }
+private:
+  explicit Opaque(int v) : value(v) {
+  }
+  int value;
+};
+
+template<typename T>
+T make(long n);
+
+template<>
+int make<int>(long n) {
+  return static_cast<int>(n);
+}
+
+template<>
+Counted make<Counted>(long n) {
+  return Counted{static_cast<int>(n)};
+}
+
+template<>
+Heavy make<Heavy>(long n) {
+  return Heavy(n);
+}
+
+template<>
+Opaque make<Opaque>(long n) {
+  return Opaque::create(n);
+}
+
+template<typename T>
+std::vector<T> make_all(const std::vector<long> &numbers) {
+  std::vector<T> result;
+  result.reserve(numbers.size());
+  for (long n : numbers)
+    result.push_back(make<T>(n));
+  return result;
+}
+
+std::vector<long> random_numbers(std::size_t count, long range, unsigned seed) {
+  std::mt19937_64 generator(seed);
+  std::uniform_int_distribution<long> distribution(0, range - 1);
+  std::vector<long> result(count);
+  for (auto &n : result)
+    n = distribution(generator);
+  return result;
+}
+
+std::vector<long> sequence(std::size_t count, long step) {
+  std::vector<long> result(count);
+  for (std::size_t i = 0; i < count; ++i)
+    result[i] = static_cast<long>(i) * step;
+  return result;
+}
+
+struct result {
+  double ns_per_op = 0;
+  double allocations_per_op = 0;
+  double comparisons_per_op = 0;
+};
+
+template<typename Body>
+result measure(std::size_t operations, Body &&body) {
+  std::uint64_t allocations_before = allocations;
+  std::uint64_t comparisons_before = comparisons;
+  auto start = std::chrono::steady_clock::now();
+  body();
+  auto stop = std::chrono::steady_clock::now();
+  double ops = static_cast<double>(operations == 0 ? 1 : operations);
+  result r;
+  r.ns_per_op = static_cast<double>(std::chrono::duration_cast<std::chrono::nanoseconds>(stop - start).count()) / ops;
+  r.allocations_per_op = static_cast<double>(allocations - allocations_before) / ops;
+  r.comparisons_per_op = static_cast<double>(comparisons - comparisons_before) / ops;
+  return r;
+}
+
+volatile std::size_t sink;
+
+// Makes the compiler produce t without reading it.
+template<typename T>
+std::size_t touch(T const &t) {
+  return reinterpret_cast<std::uintptr_t>(&t) & 1;
+}
+
+template<typename S, typename K>
+void fill(FunctionMaxima<K, K, S> &f, const std::vector<K> &args, const std::vector<K> &values) {
+  for (std::size_t i = 0; i < args.size(); ++i)
+    f.set_value(args[i], values[i]);
+}
+
+// Increasing arguments, random values.
+template<typename S, typename K>
+result sequential_set(std::size_t n) {
+  auto args = make_all<K>(sequence(n, 1));
+  auto values = make_all<K>(random_numbers(n, 1000, 1));
+  FunctionMaxima<K, K, S> f;
+  return measure(n, [&] { fill(f, args, values); });
+}
+
+template<typename S, typename K>
+result random_set(std::size_t n) {
+  auto args = make_all<K>(random_numbers(n, static_cast<long>(n), 2));
+  auto values = make_all<K>(random_numbers(n, 1000, 3));
+  FunctionMaxima<K, K, S> f;
+  return measure(n, [&] { fill(f, args, values); });
+}
+
+// Two of every three operations erase, about half of the erased arguments are missing.
+template<typename S, typename K>
+result churn(std::size_t n) {
+  auto range = static_cast<long>(n);
+  auto prefill = make_all<K>(random_numbers(n / 2, range, 4));
+  auto args = make_all<K>(random_numbers(n, range, 5));
+  auto values = make_all<K>(random_numbers(n, 1000, 6));
+  FunctionMaxima<K, K, S> f;
+  fill(f, prefill, values);
+  return measure(n, [&] {
+    for (std::size_t i = 0; i < n; ++i) {
+      if (i % 3 != 0)
+        f.erase(args[i]);
+      else
+        f.set_value(args[i], values[i]);
+    }
+  });
+}
+
+// Random arguments, values constant on runs of 64 consecutive arguments.
+template<typename S, typename K>
+result plateaus(std::size_t n) {
+  auto numbers = random_numbers(n, static_cast<long>(n), 7);
+  std::vector<long> levels(n);
+  for (std::size_t i = 0; i < n; ++i)
+    levels[i] = (numbers[i] / 64) % 3;
+  auto args = make_all<K>(numbers);
+  auto values = make_all<K>(levels);
+  FunctionMaxima<K, K, S> f;
+  return measure(n, [&] { fill(f, args, values); });
+}
+
+// Sequential arguments with values constant on runs of 64, operations are visited plateaus of maxima.
+template<typename S, typename K>
+result runs(std::size_t n) {
+  std::vector<long> levels(n);
+  auto numbers = random_numbers(n / 64 + 1, 3, 16);
+  for (std::size_t i = 0; i < n; ++i)
+    levels[i] = numbers[i / 64];
+  auto args = make_all<K>(sequence(n, 1));
+  auto values = make_all<K>(levels);
+  FunctionMaxima<K, K, S> f;
+  fill(f, args, values);
+  const int passes = 10;
+  std::size_t plateaus = 0;
+  for (auto const &run : f.mx_runs())
+    plateaus += touch(run) + 1;
+  return measure(passes * plateaus, [&] {
+    std::size_t visited = 0;
+    for (int pass = 0; pass < passes; ++pass)
+      for (auto const &run : f.mx_runs())
+        visited += touch(run.last_arg());
+    sink = visited;
+  });
+}
+
+// Operations are visited points and maxima.
+template<typename S, typename K>
+result scans(std::size_t n) {
+  auto args = make_all<K>(sequence(n, 1));
+  auto values = make_all<K>(random_numbers(n, 1000, 8));
+  FunctionMaxima<K, K, S> f;
+  fill(f, args, values);
+  const int passes = 10;
+  return measure(passes * (f.size() + f.mx_size()), [&] {
+    std::size_t visited = 0;
+    for (int pass = 0; pass < passes; ++pass) {
+      for (auto it = f.begin(); it != f.end(); ++it)
+        visited += touch(it->value());
+      for (auto it = f.mx_begin(); it != f.mx_end(); ++it)
+        visited += touch(it->arg());
+    }
+    sink = visited;
+  });
+}
+
+// Even arguments are stored, value_at hits them and find misses the odd ones.
+template<typename S, typename K>
+result lookups(std::size_t n) {
+  auto args = make_all<K>(sequence(n, 2));
+  auto values = make_all<K>(random_numbers(n, 1000, 9));
+  auto queries = random_numbers(n, 2 * static_cast<long>(n), 10);
+  auto keys = make_all<K>(queries);
+  FunctionMaxima<K, K, S> f;
+  fill(f, args, values);
+  return measure(n, [&] {
+    std::size_t found = 0;
+    for (std::size_t i = 0; i < n; ++i) {
+      if (queries[i] % 2 == 0)
+        found += touch(f.value_at(keys[i]));
+      else
+        found += f.find(keys[i]) == f.end();
+    }
+    sink = found;
+  });
+}
+
+// Operations are points of a function of n points whose maxima index is rebuilt, on one or on all hardware threads.
+template<typename S, typename K>
+result rebuild(std::size_t n, std::size_t threads) {
+  auto args = make_all<K>(sequence(n, 1));
+  auto values = make_all<K>(random_numbers(n, 1000, 17));
+  FunctionMaxima<K, K, S> f;
+  fill(f, args, values);
+  return measure(n, [&] { f.rebuild_maxima(threads); });
+}
+
+// Operations are copies of a function of n / 10 points, half by copy construction, half by operator=.
+template<typename S, typename K>
+result copies(std::size_t n) {
+  std::size_t points = n / 10 + 1;
+  auto args = make_all<K>(random_numbers(points, static_cast<long>(n), 11));
+  auto values = make_all<K>(random_numbers(points, 1000, 12));
+  FunctionMaxima<K, K, S> f;
+  fill(f, args, values);
+  FunctionMaxima<K, K, S> target = f;
+  const std::size_t rounds = 10;
+  return measure(2 * rounds, [&] {
+    for (std::size_t i = 0; i < rounds; ++i) {
+      FunctionMaxima<K, K, S> copy(f);
+      sink = copy.size();
+      target = f;
+    }
+  });
+}
+
+// A stream of increasing arguments keeping about the last 1000 points, older ones are evicted every 100 steps.
+template<typename S, typename K>
+result window(std::size_t n) {
+  auto args = make_all<K>(sequence(n, 1));
+  auto values = make_all<K>(random_numbers(n, 1000, 13));
+  FunctionMaxima<K, K, S> f;
+  return measure(n, [&] {
+    for (std::size_t i = 0; i < n; ++i) {
+      f.set_value(args[i], values[i]);
+      if (i % 100 == 99 && i >= 1000)
+        f.evict_before(args[i - 1000]);
+    }
+  });
+}
+
+// Operations are splits of a function of n points at random arguments, each piece is spliced back.
+template<typename S, typename K>
+result cuts(std::size_t n) {
+  auto args = make_all<K>(sequence(n, 1));
+  auto values = make_all<K>(random_numbers(n, 1000, 14));
+  auto boundaries = make_all<K>(random_numbers(100, static_cast<long>(n), 15));
+  FunctionMaxima<K, K, S> f;
+  fill(f, args, values);
+  return measure(boundaries.size(), [&] {
+    for (auto &a : boundaries) {
+      auto right = f.split(a);
+      f.splice(right);
+    }
+  });
+}
+
+template<typename S, typename K>
+result run(const std::string &name, std::size_t n) {
+  if (name == "seq_set")
+    return sequential_set<S, K>(n);
+  if (name == "rand_set")
+    return random_set<S, K>(n);
+  if (name == "churn")
+    return churn<S, K>(n);
+  if (name == "plateaus")
+    return plateaus<S, K>(n);
+  if (name == "scans")
+    return scans<S, K>(n);
+  if (name == "runs")
+    return runs<S, K>(n);
+  if (name == "lookups")
+    return lookups<S, K>(n);
+  if (name == "window")
+    return window<S, K>(n);
+  if (name == "cuts")
+    return cuts<S, K>(n);
+  if (name == "rebuild")
+    return rebuild<S, K>(n, 1);
+  if (name == "rebuild_par")
+    return rebuild<S, K>(n, 0);
+  return copies<S, K>(n);
+}
+
+const char *const workloads[] = {"seq_set", "rand_set", "churn", "plateaus", "runs", "scans", "lookups", "window",
+                                 "cuts", "rebuild", "rebuild_par", "copies"};
+
+bool selected(const std::string &line, const std::string &filter) {
+  return filter.empty() || line.find(filter) != std::string::npos;
+}
+
+void report(const std::string &line, const result &r) {
+  std::printf("%-28s %12.1f %12.2f %12.2f\n", line.c_str(), r.ns_per_op, r.allocations_per_op, r.comparisons_per_op);
+}
+
+template<typename S>
+void run_storage(const std::string &storage, std::size_t n, const std::string &filter) {
+  for (const char *w : workloads) {
+    std::string name = w;
+    std::string line = storage + " int " + name;
+    if (selected(line, filter)) {
+      result r = run<S, int>(name, n);
+      r.comparisons_per_op = run<S, Counted>(name, n).comparisons_per_op;
+      report(line, r);
+    }
+    line = storage + " heavy " + name;
+    if (selected(line, filter))
+      report(line, run<S, Heavy>(name, n));
+    line = storage + " opaque " + name;
+    if (selected(line, filter))
+      report(line, run<S, Opaque>(name, n));
+  }
+}
+
+}  // namespace
+
+// The replacement operator new and delete are a matching pair built on malloc and free, but GCC sees
+// free called on memory from operator new once it inlines them into their callers.
+#if defined(__GNUC__) && !defined(__clang__)
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wmismatched-new-delete"
+#endif
+
+void *operator new(std::size_t size) {
+  ++allocations;
+  if (void *p = std::malloc(size == 0 ? 1 : size))
+    return p;
+  throw std::bad_alloc();
+}
+
+void operator delete(void *p) noexcept {
+  std::free(p);
+}
+
+void operator delete(void *p, std::size_t) noexcept {
+  std::free(p);
+}
+
+#if defined(__GNUC__) && !defined(__clang__)
+#pragma GCC diagnostic pop
+#endif
+
+int main(int argc, char *argv[]) {
+  std::size_t n = argc > 1 ? static_cast<std::size_t>(std::strtoul(argv[1], nullptr, 10)) : 100000;
+  std::string filter = argc > 2 ? argv[2] : "";
+  if (n < 10)
+    n = 10;
+  std::printf("%-28s %12s %12s %12s\n", "storage type workload", "ns/op", "allocs/op", "cmps/op");
+  run_storage<MapStorage>("map", n, filter);
+  run_storage<NodeStorage>("node", n, filter);
+  run_storage<FlatStorage<shifting_positions>>("flat", n, filter);
+  run_storage<PersistentStorage>("persistent", n, filter);
+}
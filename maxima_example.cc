@@ -3,6 +3,12 @@
 #include <cassert>
 #include <iostream>
 #include <vector>
+#include <map>
+#include <algorithm>
+#include <memory_resource>
+#include <string>
+#include <sstream>
+#include <thread>
 
 class Secret {
 public:
@@ -21,27 +27,655 @@ private:
   int value;
 };
 
-template<typename A, typename V>
+template<typename A, typename V, typename S = MapStorage>
 struct same {
-  bool operator()(const typename FunctionMaxima<A, V>::point_type &p,
+  bool operator()(const typename FunctionMaxima<A, V, S>::point_type &p,
                   const std::pair<A, V> &q) {
     return !(p.arg() < q.first) && !(q.first < p.arg()) &&
            !(p.value() < q.second) && !(q.second < p.value());
   }
 };
 
-template<typename A, typename V>
-bool fun_equal(const FunctionMaxima<A, V> &F,
+template<typename A, typename V, typename S>
+bool fun_equal(const FunctionMaxima<A, V, S> &F,
                const std::initializer_list<std::pair<A, V>> &L) {
   return F.size() == L.size() &&
-         std::equal(F.begin(), F.end(), L.begin(), same<A, V>());
+         std::equal(F.begin(), F.end(), L.begin(), same<A, V, S>());
 }
 
-template<typename A, typename V>
-bool fun_mx_equal(const FunctionMaxima<A, V> &F,
+template<typename A, typename V, typename S>
+bool fun_mx_equal(const FunctionMaxima<A, V, S> &F,
                   const std::initializer_list<std::pair<A, V>> &L) {
-  return static_cast<typename FunctionMaxima<A, V>::size_type>(std::distance(F.mx_begin(), F.mx_end())) == L.size() &&
-         std::equal(F.mx_begin(), F.mx_end(), L.begin(), same<A, V>());
+  return static_cast<typename FunctionMaxima<A, V, S>::size_type>(std::distance(F.mx_begin(), F.mx_end())) == L.size() &&
+         F.mx_size() == L.size() &&
+         std::equal(F.mx_begin(), F.mx_end(), L.begin(), same<A, V, S>());
+}
+
+// Compares the maxima with the ones computed by brute force from the points.
+template<typename A, typename V, typename S>
+bool mx_consistent(const FunctionMaxima<A, V, S> &F) {
+  std::vector<std::pair<A, V>> points, maxima;
+  for (auto it = F.begin(); it != F.end(); ++it) {
+    auto p = *it;
+    points.emplace_back(p.arg(), p.value());
+  }
+  for (size_t i = 0; i < points.size(); ++i) {
+    const V &v = points[i].second;
+    if ((i == 0 || !(v < points[i - 1].second)) &&
+        (i + 1 == points.size() || !(v < points[i + 1].second)))
+      maxima.push_back(points[i]);
+  }
+  std::stable_sort(maxima.begin(), maxima.end(),
+                   [](const std::pair<A, V> &l, const std::pair<A, V> &r) { return r.second < l.second; });
+  return static_cast<size_t>(std::distance(F.mx_begin(), F.mx_end())) == maxima.size() &&
+         F.mx_size() == maxima.size() &&
+         std::equal(F.mx_begin(), F.mx_end(), maxima.begin(), same<A, V, S>());
+}
+
+// Compares the plateaus of maxima with consecutive maxima at consecutive points with equal values.
+template<typename A, typename V, typename S>
+bool runs_consistent(const FunctionMaxima<A, V, S> &F) {
+  auto runs = F.mx_runs();
+  auto run = runs.begin();
+  for (auto mx = F.mx_begin(); mx != F.mx_end(); ++run) {
+    if (run == runs.end() || run->begin() != mx || run->first_arg() != mx->arg() || run->value() != mx->value())
+      return false;
+    size_t first = F.rank(mx->arg()), length = 0;
+    auto last = mx;
+    for (; mx != F.mx_end() && mx->value() == run->value() && F.rank(mx->arg()) == first + length; ++mx, ++length)
+      last = mx;
+    if (run->size() != length || run->end() != mx || run->last_arg() != last->arg())
+      return false;
+  }
+  return run == runs.end();
+}
+
+template<typename A, typename V, typename S>
+bool range_consistent(const FunctionMaxima<A, V, S> &F, A const &lo, A const &hi) {
+  auto best = F.end();
+  std::vector<A> maxima;
+  for (auto &max : F.mx_range(lo, hi))
+    maxima.push_back(max.arg());
+  for (auto it = F.begin(); it != F.end(); ++it)
+    if (!(it->arg() < lo) && !(hi < it->arg()) && (best == F.end() || best->value() < it->value()))
+      best = it;
+  std::vector<A> expected;
+  for (auto mx = F.mx_begin(); mx != F.mx_end(); ++mx)
+    if (!(mx->arg() < lo) && !(hi < mx->arg()))
+      expected.push_back(mx->arg());
+  std::sort(expected.begin(), expected.end());
+  return maxima == expected && F.max_in_range(lo, hi) == best;
+}
+
+// Memory resource counting the bytes it hands out and the bytes still not given back.
+class counting_resource : public std::pmr::memory_resource {
+public:
+  size_t allocated = 0;
+  size_t outstanding = 0;
+private:
+  void *do_allocate(size_t bytes, size_t alignment) override {
+    allocated += bytes;
+    outstanding += bytes;
+    return std::pmr::new_delete_resource()->allocate(bytes, alignment);
+  }
+  void do_deallocate(void *p, size_t bytes, size_t alignment) override {
+    outstanding -= bytes;
+    std::pmr::new_delete_resource()->deallocate(p, bytes, alignment);
+  }
+  bool do_is_equal(const std::pmr::memory_resource &other) const noexcept override {
+    return this == &other;
+  }
+};
+
+// Value counting its copies, moves are not counted.
+class Copied {
+public:
+  static inline size_t copies = 0;
+  explicit Copied(int v) : value(v) {
+  }
+  Copied(const Copied &other) : value(other.value) {
+    ++copies;
+  }
+  Copied(Copied &&other) noexcept = default;
+  Copied &operator=(const Copied &other) {
+    ++copies;
+    value = other.value;
+    return *this;
+  }
+  Copied &operator=(Copied &&other) noexcept = default;
+  bool operator<(const Copied &other) const {
+    return value < other.value;
+  }
+private:
+  int value;
+};
+
+// Codec of strings for save and load: the length followed by the characters.
+struct string_codec {
+  void write(std::ostream &out, const std::string &s) const {
+    MaximaFormat::write_number(out, s.size());
+    out.write(s.data(), static_cast<std::streamsize>(s.size()));
+  }
+  std::string read(std::istream &in) const {
+    std::string s(MaximaFormat::read_number(in), '\0');
+    if (!in.read(&s[0], static_cast<std::streamsize>(s.size())))
+      throw InvArg;
+    return s;
+  }
+};
+
+template<typename S>
+void check_storage() {
+  FunctionMaxima<int, int, S> fun;
+  unsigned seed = 2021;
+  for (int i = 0; i < 3000; ++i) {
+    seed = seed * 1103515245u + 12345u;
+    int a = static_cast<int>((seed >> 8) % 200);
+    int v = static_cast<int>((seed >> 20) % 7);
+    if (seed % 3 == 0)
+      fun.erase(a);
+    else
+      fun.set_value(a, v);
+    assert(mx_consistent(fun));
+  }
+  assert(runs_consistent(fun));
+  for (int lo = -10; lo < 210; lo += 13)
+    assert(range_consistent(fun, lo, lo + 17) && range_consistent(fun, lo, lo + 1));
+  assert(fun.mx_range(50, 40).empty() && fun.max_in_range(50, 40) == fun.end());
+  for (size_t k = 0; k <= fun.mx_size(); ++k) {
+    auto mx_k = fun.mx_nth(k);
+    assert(mx_k == std::next(fun.mx_begin(), static_cast<std::ptrdiff_t>(k)));
+    assert(k == fun.mx_size() || fun.mx_rank(*mx_k) == k);
+  }
+  for (size_t k = 0; k <= fun.size(); ++k) {
+    auto k_th = fun.nth(k);
+    assert(k_th == std::next(fun.begin(), static_cast<std::ptrdiff_t>(k)));
+    assert(k == fun.size() || fun.rank(k_th->arg()) == k);
+  }
+  for (int lo = -10; lo < 210; lo += 13)
+    assert(fun.count(lo, lo + 17) == static_cast<size_t>(std::count_if(
+        fun.begin(), fun.end(), [lo](auto &p) { return lo <= p.arg() && p.arg() <= lo + 17; })));
+  assert(fun.count(10, 9) == 0);
+  // Two values make long plateaus, which every kind of update splits, merges and moves the heads of.
+  {
+    using update = typename FunctionMaxima<int, int, S>::update_type;
+    FunctionMaxima<int, int, S> plateaus;
+    for (int a = 0; a < 60; ++a)
+      plateaus.set_value(a, 1);
+    assert(runs_consistent(plateaus) && std::distance(plateaus.mx_runs().begin(), plateaus.mx_runs().end()) == 1);
+    unsigned state = 7;
+    for (int i = 0; i < 1500; ++i) {
+      state = state * 1103515245u + 12345u;
+      int a = static_cast<int>((state >> 8) % 64);
+      int v = static_cast<int>((state >> 20) % 2);
+      switch ((state >> 4) % 7) {
+        case 0:
+          plateaus.erase(a);
+          break;
+        case 1: {
+          std::vector<update> batch{update::set_value(a, v), update::erase(a + 1), update::set_value(a + 2, 1 - v),
+                                    update::set_value(a + 9, v), update::erase(a + 10)};
+          plateaus.apply_batch(batch.begin(), batch.end());
+          break;
+        }
+        case 2: {
+          auto rest = plateaus.split(a);
+          assert(mx_consistent(plateaus) && runs_consistent(plateaus) && runs_consistent(rest));
+          plateaus.splice(rest);
+          break;
+        }
+        case 3: {
+          auto rest = plateaus.split(a);
+          rest.evict_before(a + 3);
+          plateaus.splice(rest);
+          break;
+        }
+        case 4:
+          plateaus.lazy_maxima(true);
+          plateaus.set_value(a, v);
+          plateaus.erase(a + 1);
+          plateaus.set_value(a + 2, v);
+          plateaus.lazy_maxima(false);
+          break;
+        default:
+          plateaus.set_value(a, v);
+      }
+      assert(mx_consistent(plateaus) && runs_consistent(plateaus));
+    }
+  }
+  auto it = fun.begin();
+  auto old = it++;
+  assert(old == fun.begin() && ++old == it && &*old == &*it);
+  auto mx = fun.mx_end();
+  assert(--mx != fun.mx_end() && mx++ != fun.mx_end() && mx == fun.mx_end());
+  FunctionMaxima<int, int, S> copy = fun;
+  for (int a = 0; a < 200; a += 2)
+    fun.erase(a);
+  assert(mx_consistent(fun));
+  assert(mx_consistent(copy));
+  assert(fun.find(0) == fun.end());
+  copy = fun;
+  assert(fun_equal(copy, {}) == (fun.size() == 0));
+
+  std::vector<std::pair<int, int>> sorted;
+  for (int a = 0; a < 100; ++a)
+    sorted.emplace_back(a, (a * 37) % 11);
+  FunctionMaxima<int, int, S> loaded(sorted.begin(), sorted.end());
+  assert(loaded.size() == sorted.size() && mx_consistent(loaded));
+  using update = typename FunctionMaxima<int, int, S>::update_type;
+  std::vector<update> batch{update::set_value(5, 20), update::erase(6), update::set_value(150, 3),
+                            update::erase(5), update::set_value(6, 1), update::set_value(5, 21)};
+  loaded.apply_batch(batch.begin(), batch.end());
+  assert(loaded.value_at(5) == 21 && loaded.value_at(6) == 1 && loaded.value_at(150) == 3);
+  assert(mx_consistent(loaded) && loaded.mx_begin()->arg() == 5);
+  assert(loaded.size() == sorted.size() + 1);
+
+  // Large enough to be classified and sorted in parallel chunks.
+  std::vector<std::pair<int, int>> many;
+  for (int a = 0; a < 100000; ++a)
+    many.emplace_back(a, (a * 7919) % 13);
+  FunctionMaxima<int, int, S> in_parallel, in_sequence;
+  in_parallel.assign(many.begin(), many.end(), 4);
+  in_sequence.assign(many.begin(), many.end());
+  auto same_point = [](auto &p, auto &q) { return p.arg() == q.arg() && p.value() == q.value(); };
+  assert(std::equal(in_parallel.mx_begin(), in_parallel.mx_end(), in_sequence.mx_begin(), in_sequence.mx_end(),
+                    same_point));
+  in_parallel.set_value(500, 20);
+  in_parallel.erase(50001);
+  in_parallel.rebuild_maxima(3);
+  assert(mx_consistent(in_parallel) && in_parallel.mx_begin()->arg() == 500);
+  in_sequence.rebuild_maxima(1);
+  assert(mx_consistent(in_sequence));
+  ShardedFunctionMaxima<int, int, S> sharded({40, 80, 90, 160});
+  for (auto it = fun.begin(); it != fun.end(); ++it)
+    sharded.set_value(it->arg(), it->value());
+  for (int a = 0; a < 200; a += 7) {
+    sharded.set_value(a, a % 5);
+    fun.set_value(a, a % 5);
+  }
+  sharded.erase(80);
+  fun.erase(80);
+  assert(sharded.size() == fun.size() && sharded.mx_size() == fun.mx_size());
+  assert(std::equal(sharded.begin(), sharded.end(), fun.begin(), fun.end(),
+                    [](auto &p, auto &q) { return p.arg() == q.arg() && p.value() == q.value(); }));
+  assert(std::equal(sharded.mx_begin(), sharded.mx_end(), fun.mx_begin(), fun.mx_end(),
+                    [](auto &p, auto &q) { return p.arg() == q.arg() && p.value() == q.value(); }));
+  // Producers own disjoint arguments spread over all shards, so every shard is written by several threads.
+  {
+    ShardedFunctionMaxima<int, int, S> ingested({100, 200, 300});
+    FunctionMaxima<int, int, S> expected;
+    const int producers = 4;
+    auto produce = [](int t, auto &&set_value, auto &&erase) {
+      for (int round = 0; round < 3; ++round)
+        for (int a = t; a < 400; a += producers) {
+          if ((a + round) % 11 == 0)
+            erase(a);
+          else
+            set_value(a, (a * 31 + round) % 17);
+        }
+    };
+    std::vector<std::thread> threads;
+    for (int t = 0; t < producers; ++t)
+      threads.emplace_back([&, t] {
+        produce(t, [&](int a, int v) {
+          ingested.set_value(a, v);
+          assert(ingested.value_at(a) == v);
+        }, [&](int a) { ingested.erase(a); });
+      });
+    threads.emplace_back([&] {
+      for (int i = 0; i < 200; ++i)
+        assert(ingested.mx_size() <= ingested.size() + 4);
+    });
+    for (auto &thread : threads)
+      thread.join();
+    for (int t = 0; t < producers; ++t)
+      produce(t, [&](int a, int v) { expected.set_value(a, v); }, [&](int a) { expected.erase(a); });
+    assert(ingested.size() == expected.size() && ingested.mx_size() == expected.mx_size());
+    assert(std::equal(ingested.begin(), ingested.end(), expected.begin(), expected.end(),
+                      [](auto &p, auto &q) { return p.arg() == q.arg() && p.value() == q.value(); }));
+    assert(std::equal(ingested.mx_begin(), ingested.mx_end(), expected.mx_begin(), expected.mx_end(),
+                      [](auto &p, auto &q) { return p.arg() == q.arg() && p.value() == q.value(); }));
+  }
+
+  counting_resource resource;
+  {
+    auto same_points = [](auto &p, auto &q) { return p.arg() == q.arg() && p.value() == q.value(); };
+    // Nothing may fall back to the default resource while the function is filled.
+    auto previous = std::pmr::set_default_resource(std::pmr::null_memory_resource());
+    PmrFunctionMaxima<int, int, S> pooled(&resource);
+    for (auto it = fun.begin(); it != fun.end(); ++it)
+      pooled.set_value(it->arg(), it->value());
+    pooled.erase(7);
+    pooled.set_value(7, fun.value_at(7));
+    PmrFunctionMaxima<int, int, S> same_resource(pooled, pooled.get_allocator());
+    std::pmr::set_default_resource(previous);
+    assert(resource.allocated > 0 && same_resource.get_allocator().resource() == &resource);
+    assert(std::equal(pooled.begin(), pooled.end(), fun.begin(), fun.end(), same_points));
+    assert(std::equal(pooled.mx_begin(), pooled.mx_end(), fun.mx_begin(), fun.mx_end(), same_points));
+    PmrFunctionMaxima<int, int, S> on_default = pooled;
+    assert(on_default.get_allocator().resource() == std::pmr::get_default_resource());
+    on_default.set_value(1000, 1);
+    pooled = on_default;
+    assert(pooled.get_allocator().resource() == &resource && pooled.size() == fun.size() + 1);
+    assert(std::equal(pooled.mx_begin(), pooled.mx_end(), on_default.mx_begin(), on_default.mx_end(), same_points));
+  }
+  assert(resource.outstanding == 0);
+
+  FunctionMaxima<int, int, S, std::allocator<std::byte>, CountingInstrumentation> counted;
+  std::vector<std::string> operations;
+  counted.instrumentation().on_sample = [&](const CountingInstrumentation::sample &sample) {
+    operations.push_back(sample.operation);
+    assert(sample.points == counted.size() && sample.maxima == counted.mx_size());
+  };
+  counted.set_value(1, 5);
+  counted.set_value(2, 3);
+  counted.set_value(3, 7);
+  counted.erase(3);
+  assert(counted.find(2) != counted.end() && counted.value_at(1) == 5);
+  auto totals = counted.instrumentation().totals();
+  assert(totals.maxima_inserted - totals.maxima_removed == counted.mx_size() && totals.maxima_removed == 1);
+  assert(totals.argument_comparisons > 0 && totals.maxima_comparisons > 0 && totals.allocations > 0);
+  assert(totals.rollbacks == 0);
+  assert((operations == std::vector<std::string>{"set_value", "set_value", "set_value", "erase", "find", "value_at"}));
+  // Const lookups of a counted function may run on several threads at once.
+  counted.instrumentation().on_sample = nullptr;
+  {
+    const auto &shared = counted;
+    std::vector<std::thread> readers;
+    for (int t = 0; t < 3; ++t)
+      readers.emplace_back([&shared] {
+        for (int i = 0; i < 1000; ++i)
+          assert(shared.find(2) != shared.end() && shared.value_at(1) == 5);
+      });
+    for (auto &reader : readers)
+      reader.join();
+  }
+  // A copy assigned is counted by the assigned function, a copy constructed as unscoped (persistent copies share).
+  {
+    constexpr bool shares = std::is_same<S, PersistentStorage>::value;
+    auto unscoped = CountingInstrumentation::unscoped_allocations();
+    auto copy = counted;
+    assert(shares || CountingInstrumentation::unscoped_allocations() > unscoped);
+    auto allocations = copy.instrumentation().totals().allocations;
+    copy = counted;
+    assert(shares || copy.instrumentation().totals().allocations > allocations);
+  }
+  assert(counted.instrumentation().totals().argument_comparisons > totals.argument_comparisons + 6000);
+
+  FunctionMaxima<int, int, S> hinted;
+  FunctionMaxima<int, int, S> plain;
+  for (int i = 0; i < 2000; ++i) {
+    seed = seed * 1103515245u + 12345u;
+    int a = i % 4 == 0 ? static_cast<int>((seed >> 8) % 300) : i;
+    int v = static_cast<int>((seed >> 20) % 6);
+    auto hint = seed % 3 == 0 ? hinted.begin() : seed % 3 == 1 ? hinted.find(a) : hinted.end();
+    hinted.set_value(hint, a, v);
+    plain.set_value(a, v);
+  }
+  assert(hinted.size() == plain.size() && mx_consistent(hinted));
+  assert(std::equal(hinted.begin(), hinted.end(), plain.begin(), plain.end(),
+                    [](auto &p, auto &q) { return p.arg() == q.arg() && p.value() == q.value(); }));
+
+  // A window of the last 40 arguments of a stream, the points which leave it are evicted every 7 steps.
+  FunctionMaxima<int, int, S> window;
+  FunctionMaxima<int, int, S> erased_one_by_one;
+  for (int t = 0; t < 1000; ++t) {
+    seed = seed * 1103515245u + 12345u;
+    int v = static_cast<int>((seed >> 20) % 6);
+    window.set_value(t, v);
+    erased_one_by_one.set_value(t, v);
+    if (t % 7 == 0) {
+      window.evict_before(t - 40);
+      while (erased_one_by_one.begin()->arg() < t - 40)
+        erased_one_by_one.erase(erased_one_by_one.begin()->arg());
+      assert(window.size() <= 41 && mx_consistent(window));
+      assert(std::equal(window.mx_begin(), window.mx_end(), erased_one_by_one.mx_begin(), erased_one_by_one.mx_end(),
+                        [](auto &p, auto &q) { return p.arg() == q.arg() && p.value() == q.value(); }));
+    }
+  }
+  window.evict_before(-5);
+  assert(window.size() == erased_one_by_one.size());
+  window.evict_before(2000);
+  assert(window.size() == 0 && window.mx_size() == 0);
+  window.evict_before(0);
+
+  // Lazily maintained maxima are repaired by the first query to what the eager updates keep.
+  FunctionMaxima<int, int, S> lazy;
+  FunctionMaxima<int, int, S> eager;
+  lazy.lazy_maxima(true);
+  for (int i = 0; i < 3000; ++i) {
+    seed = seed * 1103515245u + 12345u;
+    int a = static_cast<int>((seed >> 8) % 200);
+    int v = static_cast<int>((seed >> 20) % 6);
+    if (seed % 3 == 0) {
+      lazy.erase(a);
+      eager.erase(a);
+    } else {
+      lazy.set_value(a, v);
+      eager.set_value(a, v);
+    }
+    assert(lazy.size() == eager.size() && (lazy.find(a) == lazy.end() || lazy.value_at(a) == v));
+    if (i % 100 == 0 || i > 2990) {
+      assert(mx_consistent(lazy));
+      assert(std::equal(lazy.mx_begin(), lazy.mx_end(), eager.mx_begin(), eager.mx_end(),
+                        [](auto &p, auto &q) { return p.arg() == q.arg() && p.value() == q.value(); }));
+    }
+  }
+  FunctionMaxima<int, int, S> lazy_copy = lazy;
+  lazy.set_value(1000, 1000);
+  assert(lazy_copy.lazy_maxima() && mx_consistent(lazy_copy));
+  lazy.lazy_maxima(false);
+  assert(!lazy.lazy_maxima() && mx_consistent(lazy) && lazy.mx_begin()->arg() == 1000);
+  // Rewriting a few points lazily many times repairs only their neighbourhoods and counts what it changed.
+  {
+    FunctionMaxima<int, int, S, std::allocator<std::byte>, CountingInstrumentation> rewritten;
+    for (int a = 0; a < 1000; ++a)
+      rewritten.set_value(a, a % 7);
+    auto inserted = rewritten.instrumentation().totals().maxima_inserted;
+    rewritten.lazy_maxima(true);
+    for (int i = 0; i < 2000; ++i)
+      rewritten.set_value(500 + i % 5, i % 9);
+    rewritten.sync_maxima();
+    auto rewritten_totals = rewritten.instrumentation().totals();
+    assert(rewritten_totals.maxima_inserted - inserted <= 7);
+    assert(rewritten_totals.maxima_inserted - rewritten_totals.maxima_removed == rewritten.mx_size());
+  }
+
+  // Cutting a function into pieces and splicing them back gives the same function.
+  auto same = [](auto &f, auto &g) {
+    auto same_point = [](auto &p, auto &q) { return p.arg() == q.arg() && p.value() == q.value(); };
+    return std::equal(f.begin(), f.end(), g.begin(), g.end(), same_point) &&
+           std::equal(f.mx_begin(), f.mx_end(), g.mx_begin(), g.mx_end(), same_point);
+  };
+  FunctionMaxima<int, int, S> pieces = fun;
+  for (int a : {-5, 0, 37, 100, 199, 250}) {
+    auto right = pieces.split(a);
+    assert(mx_consistent(pieces) && mx_consistent(right) && pieces.size() == fun.rank(a));
+    assert(right.size() == 0 || right.begin()->arg() >= a);
+    pieces.splice(right);
+    assert(right.size() == 0 && same(pieces, fun));
+  }
+  auto middle = pieces.split(80);
+  auto tail = middle.split(120);
+  pieces.splice(tail);
+  assert(mx_consistent(pieces) && pieces.size() + middle.size() == fun.size());
+  pieces.splice(middle);
+  assert(same(pieces, fun));
+  FunctionMaxima<int, int, S> odd;
+  FunctionMaxima<int, int, S> even;
+  for (auto it = fun.begin(); it != fun.end(); ++it)
+    (it->arg() % 2 != 0 ? odd : even).set_value(it->arg(), it->value());
+  try {
+    even.splice(odd);
+    assert(false);
+  } catch (InvalidArg &) {
+    assert(odd.size() + even.size() == fun.size());
+  }
+  even.merge(odd);
+  assert(odd.size() == 0 && same(even, fun));
+  odd.set_value(7, 100);
+  odd.set_value(1000, 0);
+  try {
+    even.merge(odd);
+    assert(false);
+  } catch (InvalidArg &) {
+    assert(odd.size() == 2 && same(even, fun));
+  }
+  even.merge(odd, [](int mine, int theirs) { return std::max(mine, theirs); });
+  assert(mx_consistent(even) && even.value_at(7) == 100 && even.size() == fun.size() + 1);
+
+  FunctionMaxima<int, Copied, S> moved;
+  for (int a = 0; a < 40; ++a) {
+    moved.set_value(a, Copied(a % 7));
+    moved.emplace_value(a, a % 5);
+  }
+  // Neither a repeated value, nor a missing argument, nor a new point which is not a maximum is copied.
+  size_t copies_before = Copied::copies;
+  Copied same_value(3);
+  moved.set_value(3, same_value);
+  moved.emplace_value(3, 3);
+  moved.erase(100);
+  moved.set_value(-1, Copied(-100));
+  assert(Copied::copies == copies_before && moved.size() == 41 && mx_consistent(moved));
+
+  FunctionMaxima<int, int, S> watched;
+  std::vector<std::pair<int, int>> mirror;
+  size_t deltas = 0;
+  auto id = watched.subscribe([&](const typename FunctionMaxima<int, int, S>::maxima_delta &delta) {
+    ++deltas;
+    for (auto &p : delta.removed) {
+      auto found = std::find(mirror.begin(), mirror.end(), std::make_pair(p.arg(), p.value()));
+      assert(found != mirror.end());
+      mirror.erase(found);
+    }
+    for (auto &p : delta.added)
+      mirror.emplace_back(p.arg(), p.value());
+  });
+  auto mirrored = [&] {
+    std::vector<std::pair<int, int>> maxima;
+    for (auto it = watched.mx_begin(); it != watched.mx_end(); ++it)
+      maxima.emplace_back(it->arg(), it->value());
+    std::sort(maxima.begin(), maxima.end());
+    std::sort(mirror.begin(), mirror.end());
+    return maxima == mirror;
+  };
+  for (int i = 0; i < 1500; ++i) {
+    seed = seed * 1103515245u + 12345u;
+    int a = static_cast<int>((seed >> 8) % 60);
+    int v = static_cast<int>((seed >> 20) % 5);
+    if (seed % 5 == 0) {
+      std::vector<update> updates{update::set_value(a, v), update::erase(a + 1), update::set_value(a + 2, v + 1)};
+      watched.apply_batch(updates.begin(), updates.end());
+    } else if (seed % 3 == 0) {
+      watched.erase(a);
+    } else {
+      watched.set_value(a, v);
+    }
+    assert(mirrored());
+  }
+  watched.evict_before(30);
+  assert(mirrored() && (watched.size() == 0 || watched.begin()->arg() >= 30));
+  auto cut = watched.split(45);
+  assert(mirrored());
+  watched.splice(cut);
+  assert(mirrored());
+  FunctionMaxima<int, int, S> interleaved;
+  for (int a = 31; a < 70; a += 4)
+    interleaved.set_value(a, a % 3);
+  watched.merge(interleaved, [](int mine, int) { return mine; });
+  assert(mirrored());
+  // Lazy writes are reported by the repair of the index, which the first query runs.
+  watched.lazy_maxima(true);
+  for (int i = 0; i < 300; ++i) {
+    seed = seed * 1103515245u + 12345u;
+    int a = static_cast<int>((seed >> 8) % 60);
+    if (seed % 3 == 0)
+      watched.erase(a);
+    else
+      watched.set_value(a, static_cast<int>((seed >> 20) % 5));
+    if (i % 10 == 0)
+      assert(mirrored());
+  }
+  watched.lazy_maxima(false);
+  assert(mirrored());
+  size_t reported = deltas;
+  watched.set_value(watched.begin()->arg(), watched.begin()->value());
+  watched.erase(1000);
+  assert(deltas == reported);
+  watched = fun;
+  assert(mirrored());
+  watched.assign(sorted.begin() + 5, sorted.end());
+  assert(mirrored());
+  FunctionMaxima<int, int, S> unwatched = watched;
+  watched.unsubscribe(id);
+  watched.set_value(-1, 100);
+  unwatched.set_value(-1, 100);
+  assert(deltas == reported + 2);
+
+  std::swap(sorted[3], sorted[4]);
+  try {
+    loaded.assign(sorted.begin(), sorted.end());
+    assert(false);
+  } catch (InvalidArg &) {
+    assert(loaded.size() == sorted.size() + 1 && loaded.value_at(3) == (3 * 37) % 11);
+  }
+
+  auto same_points = [](const auto &p, const auto &q) { return p.arg() == q.arg() && p.value() == q.value(); };
+  std::stringstream saved;
+  fun.save(saved);
+  std::string bytes = saved.str();
+  FunctionMaxima<int, int, S> restored;
+  restored.load(saved);
+  assert(std::equal(restored.begin(), restored.end(), fun.begin(), fun.end(), same_points));
+  assert(std::equal(restored.mx_begin(), restored.mx_end(), fun.mx_begin(), fun.mx_end(), same_points));
+  std::istringstream streamed(bytes);
+  FunctionMaximaReader<int, int> reader(streamed);
+  size_t read = 0;
+  while (auto point = reader.next())
+    assert(fun.value_at(point->first) == point->second && ++read);
+  assert(read == fun.size() && reader.maxima().size() == fun.mx_size());
+  // Truncated files and maxima out of order are rejected without touching the function.
+  std::string swapped = bytes;
+  std::swap_ranges(swapped.end() - 16, swapped.end() - 8, swapped.end() - 8);
+  for (auto &broken : {bytes.substr(0, bytes.size() - 1), swapped, std::string("FMX0")}) {
+    std::istringstream in(broken);
+    try {
+      restored.load(in);
+      assert(false);
+    } catch (InvalidArg &) {
+      assert(restored.size() == fun.size() && mx_consistent(restored));
+    }
+  }
+  auto frozen = fun.freeze();
+  assert(std::equal(frozen.begin(), frozen.end(), fun.begin(), fun.end(), same_points));
+  assert(std::equal(frozen.mx_begin(), frozen.mx_end(), fun.mx_begin(), fun.mx_end(), same_points));
+  for (int a = -5; a < 205; ++a) {
+    assert(frozen.rank(a) == fun.rank(a) && (frozen.find(a) == frozen.end()) == (fun.find(a) == fun.end()));
+    assert(frozen.find(a) == frozen.end() || frozen.find(a)->value() == fun.value_at(a));
+  }
+  std::ostringstream image;
+  frozen.write_image(image);
+  std::string image_bytes = image.str();
+  std::vector<std::max_align_t> mapped(image_bytes.size() / sizeof(std::max_align_t) + 1);
+  std::copy(image_bytes.begin(), image_bytes.end(), reinterpret_cast<char *>(mapped.data()));
+  auto from_image = FrozenFunctionMaxima<int, int>::map_image(mapped.data(), image_bytes.size());
+  assert(std::equal(from_image.begin(), from_image.end(), fun.begin(), fun.end(), same_points));
+  assert(std::equal(from_image.mx_begin(), from_image.mx_end(), fun.mx_begin(), fun.mx_end(), same_points));
+  try {
+    FrozenFunctionMaxima<int, int>::map_image(mapped.data(), image_bytes.size() - alignof(std::max_align_t));
+    assert(false);
+  } catch (InvalidArg &) {
+  }
+
+  FunctionMaxima<std::string, std::string, S> named;
+  for (int a = 0; a < 50; ++a)
+    named.set_value("point " + std::to_string(a), std::string(static_cast<size_t>(a % 7), 'x'));
+  std::stringstream named_saved;
+  named.save(named_saved, string_codec(), string_codec());
+  FunctionMaxima<std::string, std::string> named_restored;
+  named_restored.load(named_saved, string_codec(), string_codec());
+  assert(std::equal(named.mx_begin(), named.mx_end(), named_restored.mx_begin(), named_restored.mx_end(),
+                    [](auto &p, auto &q) { return p.arg() == q.arg() && p.value() == q.value(); }));
 }
 
 int main() {
@@ -82,6 +716,33 @@ int main() {
   fun.set_value(-2, 0);
   fun.set_value(-1, -1);
   assert(fun_mx_equal(fun, {{0, 2}, {2, 2}, {-2, 0}}));
+  auto runs = fun.mx_runs();
+  auto run = runs.begin();
+  assert(run->first_arg() == 0 && run->last_arg() == 2 && run->value() == 2 && run->size() == 2);
+  assert(std::distance(run->begin(), run->end()) == 2 && run->begin() == fun.mx_begin());
+  ++run;
+  assert(run->first_arg() == -2 && run->last_arg() == -2 && run->size() == 1 && ++run == runs.end());
+
+  FunctionMaxima<int, std::string> labels;
+  for (int a = 0; a < 70000; ++a)
+    labels.set_value(a, std::to_string(a % 97));
+  labels.rebuild_maxima(2);
+  assert(mx_consistent(labels) && labels.mx_begin()->value() == "96");
+
+  FunctionMaxima<int, int> plateaus;
+  for (int a = 0; a < 9600; ++a)
+    plateaus.set_value(a, a % 1000 < 600 ? 5 : 1);
+  size_t plateau_count = 0;
+  for (auto const &plateau : plateaus.mx_runs()) {
+    // The inner points of the low plateaus are maxima as well.
+    assert(plateau.size() == (plateau.value() == 5 ? 600 : 398));
+    assert(plateau.last_arg() == plateau.first_arg() + static_cast<int>(plateau.size()) - 1);
+    ++plateau_count;
+  }
+  assert(plateau_count == 19 && plateaus.mx_size() == 9582 && runs_consistent(plateaus));
+  plateaus.set_value(2300, 7);
+  plateaus.set_value(5000, 0);
+  assert(runs_consistent(plateaus));
 
   std::vector<FunctionMaxima<Secret, Secret>::point_type> v;
   {
@@ -96,6 +757,111 @@ int main() {
   assert(v[1].arg().get() == 2);
   assert(v[1].value().get() == 20);
 
+  std::vector<FunctionMaxima<Secret, Secret, NodeStorage>::point_type> detached;
+  {
+    FunctionMaxima<Secret, Secret, NodeStorage> temp;
+    temp.set_value(Secret::create(1), Secret::create(10));
+    temp.set_value(Secret::create(2), Secret::create(20));
+    detached.push_back(*temp.begin());
+    detached.push_back(*temp.mx_begin());
+  }
+  assert(detached[0].arg().get() == 1);
+  assert(detached[1].value().get() == 20);
+
+  FunctionMaxima<Secret, Secret, PersistentStorage> versioned;
+  versioned.set_value(Secret::create(1), Secret::create(10));
+  versioned.set_value(Secret::create(2), Secret::create(20));
+  auto version = versioned.snapshot();
+  auto version_max = version.mx_begin();
+  versioned.set_value(Secret::create(2), Secret::create(5));
+  versioned.erase(Secret::create(1));
+  assert(version.size() == 2 && version_max->value().get() == 20);
+  assert(versioned.size() == 1 && versioned.mx_begin()->value().get() == 5);
+
+  // Persistent iterators keep only a few levels of their path, yet walk trees deeper than that both ways.
+  {
+    FunctionMaxima<int, int, PersistentStorage> deep;
+    FunctionMaxima<int, int> plain;
+    unsigned seed = 77;
+    for (int i = 0; i < 5000; ++i) {
+      seed = seed * 1103515245u + 12345u;
+      int a = static_cast<int>((seed >> 8) % 4000), v = static_cast<int>((seed >> 20) % 50);
+      deep.set_value(a, v);
+      plain.set_value(a, v);
+    }
+    assert(sizeof(decltype(deep.begin())) <= 128);
+    assert(std::equal(deep.begin(), deep.end(), plain.begin(), plain.end(), [](auto &p, auto &q) {
+      return p.arg() == q.arg() && p.value() == q.value();
+    }));
+    size_t k = deep.size();
+    for (auto it = deep.end(); it != deep.begin();) {
+      --it;
+      --k;
+      assert(it->arg() == plain.nth(k)->arg() && deep.rank(it->arg()) == k && deep.nth(k) == it);
+    }
+    assert(k == 0);
+  }
+
+  // Series of a store, small or promoted, match the functions they mirror and take all memory from its pool.
+  {
+    counting_resource upstream;
+    std::map<int, FunctionMaxima<int, int>> mirrored;
+    {
+      FunctionMaximaStore<int, int, int, 8> store(&upstream);
+      auto previous = std::pmr::set_default_resource(std::pmr::null_memory_resource());
+      unsigned seed = 7;
+      auto same_point = [](auto &p, auto &q) { return p.arg() == q.arg() && p.value() == q.value(); };
+      auto matches = [&] {
+        if (store.size() != mirrored.size())
+          return false;
+        auto expected = mirrored.begin();
+        for (auto &[key, series] : store) {
+          auto &f = (expected++)->second;
+          if (series.size() != f.size() || series.mx_size() != f.mx_size() ||
+              !std::equal(series.begin(), series.end(), f.begin(), f.end(), same_point) ||
+              !std::equal(series.mx_begin(), series.mx_end(), f.mx_begin(), f.mx_end(), same_point))
+            return false;
+        }
+        return true;
+      };
+      for (int i = 0; i < 4000; ++i) {
+        seed = seed * 1103515245u + 12345u;
+        int key = static_cast<int>((seed >> 4) % 40);
+        int a = static_cast<int>((seed >> 10) % (key < 5 ? 30 : 6));
+        int v = static_cast<int>((seed >> 20) % 4);
+        if (seed % 4 == 0) {
+          store.erase(key, a);
+          if (mirrored.count(key))
+            mirrored[key].erase(a);
+        } else {
+          store.set_value(key, a, v);
+          mirrored[key].set_value(a, v);
+          assert(store.at(key).value_at(a) == v && store.at(key).find(a)->arg() == a);
+        }
+        assert(matches());
+      }
+      assert(matches() && !store.at(0).is_small() && store.at(10).is_small());
+      for (int a = 0; a < 30; ++a)
+        if (a % 5 != 0)
+          store.erase(0, a);
+      store.shrink_to_fit();
+      for (int a = 0; a < 30; ++a)
+        if (a % 5 != 0)
+          mirrored[0].erase(a);
+      assert(store.at(0).is_small() && matches());
+      store.erase_series(0);
+      mirrored.erase(0);
+      assert(!store.contains(0) && matches());
+      std::pmr::set_default_resource(previous);
+      try {
+        store.at(0);
+        assert(false);
+      } catch (InvalidArg &) {
+      }
+    }
+    assert(upstream.allocated > 0 && upstream.outstanding == 0);
+  }
+
   // To powinno działać szybko.
   FunctionMaxima<int, int> big;
   using size_type = decltype(big)::size_type;
@@ -112,4 +878,24 @@ int main() {
   }
   assert(counter == 2 * N - 1);
   big = fun;
+
+  // Erasing from a copy of a flat function merges its blocks without allocating.
+  {
+    counting_resource resource;
+    PmrFunctionMaxima<int, int, FlatStorage<shifting_positions, 8>> flat(&resource);
+    for (int a = 0; a < 200; ++a)
+      flat.set_value(a, 1);
+    PmrFunctionMaxima<int, int, FlatStorage<shifting_positions, 8>> copy(flat, flat.get_allocator());
+    size_t allocated = resource.allocated;
+    for (int a = 0; a < 200; a += 2)
+      copy.erase(a);
+    for (int a = 199; a > 0; a -= 2)
+      copy.erase(a);
+    assert(resource.allocated == allocated && copy.size() == 0);
+  }
+
+  check_storage<MapStorage>();
+  check_storage<NodeStorage>();
+  check_storage<FlatStorage<shifting_positions, 4>>();
+  check_storage<PersistentStorage>();
 }
\ No newline at end of file